@@ -28,6 +28,10 @@ The Atmega644 needs to have some fuses set in order to support teh bootloader. F
 
 Revisions
 ---------
+V0.4.6
+ -Added support for version 2 UZE files (packrom -c): the program is stored as LZ compressed blocks
+  with a CRC each, unpacked while reading the card straight into the flash pages.
+
 V0.4.5 06-jun-2015
  -Changed the rule that detects if a game is already programmed. Now reflash if location (0) is 0xff.
 
@@ -68,7 +72,7 @@ extern unsigned int vram[];
 /*
  * Game loader version string as display in the menu
  */
-const char strDemo[] PROGMEM = ">> Uzebox GameLoader 0.4.5 <<";
+const char strDemo[] PROGMEM = ">> Uzebox GameLoader 0.4.6 <<";
 
 
 /*
@@ -114,6 +118,14 @@ const char strDemo[] PROGMEM = ">> Uzebox GameLoader 0.4.5 <<";
 #define EEP_FIELD_CRC32 18
 #define EEP_FIELD_FLAGS 22
 
+//UZE file defines
+#define HEADER_VERSION_PACKED 2
+#define PACK_MIN_MATCH 4
+#define MAX_PROG_SIZE (65536-4096) //bootloader starts here
+
+//flash page being filled, kept in the part of vram that isn't shown while loading
+#define pageBuffer ((unsigned char *)&vram[40*4])
+
 
 //EEPROM Kernel structs
 struct EepromHeaderStruct
@@ -337,6 +349,14 @@ unsigned char maxRootDirectorySectors;
 unsigned char eeBootloaderFlags;
 unsigned long filesFirstSector[128];
 
+//game flashing state
+unsigned long readSector;
+unsigned int readPos;
+unsigned int flashAddr;
+unsigned long blockCrc;
+unsigned char romVersion;
+unsigned char progress,progressCount,progressPos;
+
 /*
  * Local functions declares
  */
@@ -618,10 +638,102 @@ browse_files:
 
 
 
+/*
+ * Returns the next byte of the game file, reading
+ * the following sector when the current one is used up
+ */
+unsigned char ReadByte(void){
+	if(readPos==BYTES_PER_SECTOR){
+		mmc_readsector(readSector++);
+		readPos=0;
+	}
+	return sector.buffer[readPos++];
+}
+
+unsigned int ReadWord(void){
+	unsigned char low=ReadByte();
+	return low|((unsigned int)ReadByte()<<8);
+}
+
+/*
+ * Programs the page buffer at the specified flash address
+ * and advances the progress bar
+ */
+void WritePage(unsigned int flashPage){
+	unsigned char *buf=pageBuffer;
+
+	cli();
+	boot_page_erase (flashPage);
+	sei();
+	boot_spm_busy_wait ();      // Wait until the memory is erased.
+
+	for (int i=0; i<SPM_PAGESIZE; i+=2)
+	{
+		// Set up little-endian word.
+
+		uint16_t w = *buf++;
+		w += (*buf++) << 8;
+		cli();
+		boot_page_fill (flashPage + i, w);
+		sei();
+	}
+	cli();
+	boot_page_write (flashPage);     // Store buffer in flash page.
+	sei();
+
+	boot_spm_busy_wait();       // Wait until the memory is written.
+
+	// Reenable RWW-section again. We need this if we want to jump back
+	// to the application after bootloading.
+	cli();
+	boot_rww_enable();
+	sei();
+
+	progressCount++;
+	if(progressCount>=progress){
+		progressCount=0;
+		progressPos++;
+	}
+	SetFont(progressPos,1,'>',80);
+}
+
+/*
+ * Appends a byte to the game, programming each
+ * flash page as soon as it is complete
+ */
+void WriteByte(unsigned char b){
+	if(romVersion==HEADER_VERSION_PACKED){
+		blockCrc^=b;
+		for(unsigned char i=0;i<8;i++){
+			blockCrc=(blockCrc&1)?(blockCrc>>1)^0xEDB88320:(blockCrc>>1);
+		}
+	}
+
+	if(flashAddr<MAX_PROG_SIZE){
+		pageBuffer[flashAddr&(SPM_PAGESIZE-1)]=b;
+		if((flashAddr&(SPM_PAGESIZE-1))==SPM_PAGESIZE-1){
+			WritePage(flashAddr&~(SPM_PAGESIZE-1));
+		}
+	}
+	flashAddr++;
+}
+
+/*
+ * Returns the byte written at the specified distance back, from
+ * the page buffer or from the flash pages already programmed
+ */
+unsigned char ReadBack(unsigned int distance){
+	unsigned int addr=flashAddr-distance;
+	if(addr>=(flashAddr&~(SPM_PAGESIZE-1))){
+		return pageBuffer[addr&(SPM_PAGESIZE-1)];
+	}
+	return pgm_read_byte(addr);
+}
+
 void flashGame(unsigned char fileNo){
 
-	unsigned long flashPage=0;//,crc;
-	unsigned char fileSector,sectors,pageNo,progress,progressCount=0,progressPos=2;
+	unsigned long progSize;
+	unsigned char crcError=0;
 	
 	//read rom header's CRC value
 	mmc_readsector(filesFirstSector[fileNo]);
@@ -646,78 +758,80 @@ void flashGame(unsigned char fileNo){
 
 
 		conv32.value=sector.header.crc32;
-		sectors=sector.header.progSize/BYTES_PER_SECTOR;
-	
+		romVersion=sector.header.version;
+		progSize=sector.header.progSize;
+
 		//clip prog size to prevent overwriting the bootloader
-		//(65536-4096)/BYTES_PER_SECTOR=120 sectors max
-		if(sectors>=120){
-			sectors=120;
-		} else if((sector.header.progSize%BYTES_PER_SECTOR)!=0){
-			sectors++;
+		if(progSize>MAX_PROG_SIZE){
+			progSize=MAX_PROG_SIZE;
 		}
-		progress=sectors/32;
-		
-		eeprom_busy_wait();
+		progress=((progSize+SPM_PAGESIZE-1)/SPM_PAGESIZE)/32;
+		progressCount=0;
+		progressPos=2;
 
-		for(fileSector=0;fileSector<sectors;fileSector++){
-	
-			//read first sectgor after header
-			mmc_readsector(filesFirstSector[fileNo]+1+fileSector);
-			unsigned char *buf=sector.buffer;
-
-			/*			
-			//patch soft power interrupt vectors into bootloader
-			if(fileSector==0){
-				sector.buffer[6]=0x04;
-				sector.buffer[7]=0xf0;
-				sector.buffer[10]=0x08;
-				sector.buffer[11]=0xf0;
-			}
-			*/
+		//the program starts in the sector after the header
+		readSector=filesFirstSector[fileNo]+1;
+		readPos=BYTES_PER_SECTOR;
+		flashAddr=0;
 
-			//program the game
-			//two flash pages per SD sector
-			for(pageNo=0;pageNo<2;pageNo++){
-			
-			    
-			    cli();
-				boot_page_erase (flashPage);
-				sei();
-			    boot_spm_busy_wait ();      // Wait until the memory is erased.
-				
-				
-			    for (int i=0; i<SPM_PAGESIZE; i+=2)
-			    {
-			        // Set up little-endian word.
-
-			        uint16_t w = *buf++;
-			        w += (*buf++) << 8;
-					cli();	
-			        boot_page_fill (flashPage + i, w);
-					sei();
-			    }
-				cli();
-			    boot_page_write (flashPage);     // Store buffer in flash page.
-				sei();
-
-			    boot_spm_busy_wait();       // Wait until the memory is written.
-
-			    // Reenable RWW-section again. We need this if we want to jump back
-			    // to the application after bootloading.
-			    cli();
-				boot_rww_enable();
-				sei();
-
-				flashPage+=256;
-			}
+		eeprom_busy_wait();
 
-			progressCount++;
-			if(progressCount>=progress){
-				progressCount=0;
-				progressPos++;
+		while(flashAddr<progSize){
+			if(romVersion==HEADER_VERSION_PACKED){
+				//block header: unpacked size, packed size, CRC32
+				unsigned int size=ReadWord();
+				unsigned int packed=ReadWord();
+				unsigned long crc=ReadWord();
+				crc|=(unsigned long)ReadWord()<<16;
+				unsigned int end=flashAddr+size;
+
+				if(size==0){
+					crcError=1;
+					break;
+				}
+
+				blockCrc=0xffffffff;
+				if(packed==size){
+					while(flashAddr<end) WriteByte(ReadByte());
+				}else{
+					while(flashAddr<end){
+						unsigned char token=ReadByte();
+						if(token<0x80){
+							//literal run of token+1 bytes
+							do WriteByte(ReadByte()); while(token--);
+						}else{
+							//match of token-0x80+PACK_MIN_MATCH bytes
+							unsigned int distance=ReadWord();
+							token-=0x80-PACK_MIN_MATCH;
+							do WriteByte(ReadBack(distance)); while(--token);
+						}
+					}
+				}
+				if(~blockCrc!=crc){
+					crcError=1;
+				}
+			}else{
+				WriteByte(ReadByte());
 			}
-			SetFont(progressPos,1,'>',80);
+		}
 
+		//program the last partial page
+		while(flashAddr&(SPM_PAGESIZE-1)){
+			WriteByte(0xff);
+		}
+
+		if(crcError){
+			//erase the first page so the damaged game doesn't boot and gets flashed again
+			cli();
+			boot_page_erase(0);
+			sei();
+			boot_spm_busy_wait();
+			cli();
+			boot_rww_enable();
+			sei();
+
+			Print((15*2),PSTR("CRC ERROR!"),0);
+			while(1);
 		}
 
 		//Write the CRC of the game just flashed to eeprom
@@ -728,4 +842,3 @@ void flashGame(unsigned char fileNo){
 
 	}
 }
-
@@ -244,4 +244,12 @@
 		unsigned char data[30];		
 	};
 
+	//gconvert RLE data being unpacked, see RleInit()
+	struct RleStream{
+		const char *src;	//next packed byte in flash
+		u8 left;			//bytes left in the current block
+		bool repeat;		//the block repeats value rather than copying
+		u8 value;
+	};
+
 #endif
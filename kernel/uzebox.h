@@ -48,6 +48,7 @@
 	extern void SetSpriteVisibility(bool visible);
 	extern void MapSprite(unsigned char startSprite,const char *map);
 	extern void MapSprite2(unsigned char startSprite,const char *map,u8 spriteFlags);
+	extern void MapSpriteMirrored(unsigned char startSprite,const char *map,u8 spriteFlags);
 	extern void MoveSprite(unsigned char startSprite,unsigned char x,unsigned char y,unsigned char width,unsigned char height);
 	extern void Scroll(char sx,char sy);
 
@@ -63,6 +64,10 @@
 	extern void SetFontTable(const char *data);
 	extern void SetTileTable(const char *data);	
 	extern void DrawMap(unsigned char x,unsigned char y,const VRAM_PTR_TYPE *map); 	
+	extern void DrawMapRle(unsigned char x,unsigned char y,const char *map);
+	extern void RleInit(struct RleStream *s,const char *data);
+	extern u8 RleGet(struct RleStream *s);
+	extern void RleUnpack(struct RleStream *s,u8 *dest,u16 len);
 	extern void Print(int x,int y,const char *string);
 	extern void PrintRam(int x,int y,unsigned char *string);
 	extern void PrintBinaryByte(char x,char y,unsigned char byte);
@@ -72,6 +72,56 @@
 #endif
 
 
+/*
+ * Tiles and maps gconvert exports with compression="rle". A control byte
+ * below 0x80 is followed by that many plus one bytes to copy, one with bit 7
+ * set by a byte to repeat (control & 0x7f)+2 times. The stream can stop and
+ * carry on anywhere, so a big unpack can be spread over several frames, a
+ * few hundred bytes per vsync, rather than stall the game.
+ */
+void RleInit(struct RleStream *s,const char *data){
+	s->src=data;
+	s->left=0;
+}
+
+u8 RleGet(struct RleStream *s){
+	if(s->left==0){
+		u8 c=pgm_read_byte(s->src++);
+		s->repeat=(c&0x80)!=0;
+		if(s->repeat){
+			s->left=(c&0x7f)+2;
+			s->value=pgm_read_byte(s->src++);
+		}else{
+			s->left=c+1;
+		}
+	}
+
+	s->left--;
+	if(s->repeat) return s->value;
+	return pgm_read_byte(s->src++);
+}
+
+//Unpacks the next len bytes, e.g. tiles straight into ram_tiles
+void RleUnpack(struct RleStream *s,u8 *dest,u16 len){
+	while(len--){
+		*dest++=RleGet(s);
+	}
+}
+
+//Same as DrawMap() for the maps gconvert packs
+void DrawMapRle(unsigned char x,unsigned char y,const char *map){
+	struct RleStream s;
+	u8 mapWidth=pgm_read_byte(&(map[0]));
+	u8 mapHeight=pgm_read_byte(&(map[1]));
+
+	RleInit(&s,map+2);
+	for(u8 dy=0;dy<mapHeight;dy++){
+		for(u8 dx=0;dx<mapWidth;dx++){
+			SetTile(x+dx,y+dy,RleGet(&s));
+		}
+	}
+}
+
 //Print an unsigned long in decimal
 void PrintLong(int x,int y, unsigned long val){
 	unsigned char c,i;
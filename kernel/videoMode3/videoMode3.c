@@ -337,6 +337,46 @@
 	    }
 	}
 
+	/*
+	 * Same as MapSprite2() for maps gconvert exports with remove-mirrored-tiles.
+	 * Each cell is a tile index followed by the SPRITE_FLIP_X/SPRITE_FLIP_Y
+	 * flags to draw it with, which get flipped again by spriteFlags.
+	 */
+	void MapSpriteMirrored(unsigned char startSprite,const char *map,u8 spriteFlags){
+
+		unsigned char mapWidth=pgm_read_byte(&(map[0]));
+		unsigned char mapHeight=pgm_read_byte(&(map[1]));
+		s8 x,y,dx,dy;
+		u16 cell;
+
+		if(spriteFlags & SPRITE_FLIP_X){
+			x=(mapWidth-1);
+			dx=-1;
+		}else{
+			x=0;
+			dx=1;
+		}
+
+		if(spriteFlags & SPRITE_FLIP_Y){
+			y=(mapHeight-1);
+			dy=-1;
+		}else{
+			y=0;
+			dy=1;
+		}
+
+		for(u8 cy=0;cy<mapHeight;cy++){
+			for(u8 cx=0;cx<mapWidth;cx++){
+				cell=(((y*mapWidth)+x)*2)+2;
+				sprites[startSprite].tileIndex=pgm_read_byte(&(map[cell]));
+				sprites[startSprite++].flags=spriteFlags^pgm_read_byte(&(map[cell+1]));
+				x+=dx;
+			}
+			y+=dy;
+			x=(spriteFlags & SPRITE_FLIP_X)?(mapWidth-1):0;
+		}
+	}
+
 
 	void MoveSprite(unsigned char startSprite,unsigned char x,unsigned char y,unsigned char width,unsigned char height){
 
@@ -72,11 +72,16 @@
 #define VRAM_ADDR_SIZE 1 //in bytes
 #define VRAM_PTR_TYPE char
 
+//FONT_TILE_WIDTH can be set to the row size of gconvert's compact-code-tiles="true"
 #if RESOLUTION==60
-	#define FONT_TILE_WIDTH 21 //in words
+	#ifndef FONT_TILE_WIDTH
+		#define FONT_TILE_WIDTH 21 //in words
+	#endif
 	#define CYCLES_PER_PIXEL 4
 #else
-	#define FONT_TILE_WIDTH 15 //in words
+	#ifndef FONT_TILE_WIDTH
+		#define FONT_TILE_WIDTH 15 //in words
+	#endif
 	#define CYCLES_PER_PIXEL 3
 #endif
 #define FONT_TILE_SIZE FONT_TILE_WIDTH*TILE_HEIGHT //Size in words: n instructions * 8 rows
@@ -24,20 +24,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <vector>
+#include <algorithm>
+#include <map>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if !defined(__WIN32__)
+	#include <sys/wait.h>
+#endif
 #include "tinyxml.h"
 #include "lodepng.h"
 #include "paletteTable.h"
 using namespace std;
 
 #define VERSION_MAJ 1
-#define VERSION_MIN 5
+#define VERSION_MIN 6
+struct Input;
+bool convert(const char* xformFile,bool fromDirectory,bool force);
 void parseXml(TiXmlDocument* doc);
+const char* contentHash();
+bool upToDate(const char* hash);
 bool process();
-unsigned char* loadRawImage();
-unsigned char* loadPngImage();
-unsigned char* loadImage();
+unsigned char* loadRawImage(Input* input);
+unsigned char* loadPngImage(Input* input);
+unsigned char* loadImage(Input* input);
 void loadPalette();
 const char* toUpperCase(const char *src);
 int paletteIndexFromColor(unsigned char color);
@@ -47,8 +59,22 @@ int paletteIndexFromColor(unsigned char color);
 //enum Duplicates { discard=0, keep } ;
 //enum Duplicates { discard=0, keep } ;
 
+enum Dither { DITHER_NONE=0, DITHER_ORDERED, DITHER_FLOYD_STEINBERG };
+
+struct Input {
+	const char* file;
+	const char* type;		//"raw" and "png" are only valid values
+	int dither;				//for truecolor PNGs, how to make up for the colors they have and Uzebox doesn't
+	int width;				//total image width in pixels
+	int height;				//total image height in pixels
+	int tilesetHeight;		//height of section from top reserved for tileset tile (remaining contains maps data)
+	int tileWidth;			//in pixels, the same for all inputs
+	int tileHeight;
+};
+
 struct TileMap {
 	const char* varName;
+	int input;			//the image it's in, its input="file" attribute (default: the first one)
 	int left;
 	int top;
 	int width;
@@ -57,6 +83,7 @@ struct TileMap {
 
 struct Palette {
 	unsigned char colors[256];
+	int indexes[256];			//of each color in colors, -1 if it isn't in the palette
 	int numColors;
 	int maxColors;
 	const char* filename;
@@ -68,19 +95,26 @@ struct Palette {
 struct ConvertionDefinition {
 	int version;		//"1"
 	const char* xformFile;
-	const char* inputFile;
-	const char* inputType;		//"raw" and "png" are only valid values
+	const char* contentHash;	//of gconvert and its inputs, written in the output to skip unchanged ones
+	Input* inputs;				//several inputs share one tileset, their maps all point in it
+	int inputsCount;
 	const char* outputType;		//"8bpp" (default) or "code"
 	const char* outputFile;
+	const char* binaryFile;		/*optional, the data goes to this file as is and the output file only
+								  declares it, for the assembler to .incbin instead of parsing C arrays*/
 	const char* tilesVarName;
 	int backgroundColor;		//optional, specify the mask color for mode 9
+	int foregroundColor;		//optional, the color mode 9 with 60 columns takes from foregroundColor
+	bool compactCodeTiles;		//compact-code-tiles="true", mode 9 code tiles with rows as short as they can be
 	bool isBackgroundTiles;		/*indicate the tileset is made of background tiles (vs tiles for sprites).
 								  Depending on the mode, it will be placed in different memory section.*/
 	bool removeDuplicateTiles;	//Remove identical tiles from the output tileset and ajust maps accordingly
+	bool compressTiles;			//compression="rle" on <tiles>, for unpacking to RAM with RleUnpack()
+	bool compressMaps;			//compression="rle" on <maps>, for DrawMapRle()
+	bool removeMirroredTiles;	/*Also remove tiles that are a flipped copy of another one. Maps then hold
+								  a tile and its SPRITE_FLIP_X/Y flags per cell, for MapSpriteMirrored().*/
+	bool orderTilesByUsage;		//order-tiles="usage", the tiles used by the most map cells first
 
-	int width;			//total image width in pixels
-	int height;			//total image height in pixels
-	int tilesetHeight;  //height of section from top reserved for tileset tile (remaining contains maps data)
 	int tileWidth;		//in pixels
 	int tileHeight;		//in pixels
 
@@ -101,12 +135,61 @@ typedef struct {
 
 ConvertionDefinition xform;
 
+struct Job {
+	string xformFile;
+	bool fromDirectory;		//skip it quietly if it isn't a gconvert file
+};
+
 int main(int argc, char *argv[]) {
 
-	if(argc==1){
+	vector<Job> jobs;
+	bool force=false;
+#if defined(__WIN32__)
+	int workers=1;
+#else
+	int workers=sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	for(int i=1;i<argc;i++){
+		if(strcmp(argv[i],"-f")==0){
+			force=true;
+		}else if(strcmp(argv[i],"-j")==0 && i+1<argc){
+			workers=atoi(argv[++i]);
+		}else{
+			struct stat st;
+			DIR* dir=stat(argv[i],&st)==0 && S_ISDIR(st.st_mode)?opendir(argv[i]):NULL;
+			Job job;
+			if(dir==NULL){
+				job.xformFile=argv[i];
+				job.fromDirectory=false;
+				jobs.push_back(job);
+				continue;
+			}
+
+			//every .xml in it, in a stable order
+			vector<string> files;
+			for(struct dirent* entry=readdir(dir);entry!=NULL;entry=readdir(dir)){
+				size_t length=strlen(entry->d_name);
+				if(length>4 && strcmp(entry->d_name+length-4,".xml")==0){
+					files.push_back(string(argv[i])+"/"+entry->d_name);
+				}
+			}
+			closedir(dir);
+			sort(files.begin(),files.end());
+			for(unsigned int f=0;f<files.size();f++){
+				job.xformFile=files[f];
+				job.fromDirectory=true;
+				jobs.push_back(job);
+			}
+		}
+	}
+
+	if(jobs.size()==0){
 		printf("Error: No input file provided.\n\n");
 		printf("Uzebox graphics converter version %i.%i.\n",VERSION_MAJ,VERSION_MIN);
-		printf("Usage: gconv <configuration.xml>");
+		printf("Usage: gconv [-f] [-j jobs] <configuration.xml or directory>...\n");
+		printf("\t-f       Convert even if the output is up to date with its inputs\n");
+		printf("\t-j jobs  How many files to convert at once (default: one per CPU)\n");
 		exit( 1 );
 	}
 
@@ -117,38 +200,165 @@ int main(int argc, char *argv[]) {
 	path=getcwd(path,size);
 	printf("Current working directory: %s\n",path);
 
+	int failed=0;
+
+#if !defined(__WIN32__)
+	/*
+	 * Everything gconvert knows about a conversion is in the global xform,
+	 * so files are converted in worker processes rather than threads. The
+	 * output of each one is held back and shown once it's done.
+	 */
+	if(workers>1 && jobs.size()>1){
+		map<pid_t,FILE*> running;
+		unsigned int next=0;
+		bool logWarned=false;
+
+		while(next<jobs.size() || running.size()>0){
+			if(next<jobs.size() && (int)running.size()<workers){
+				//without a log file the worker writes straight to our output
+				FILE* log=tmpfile();
+				if(log==NULL && !logWarned){
+					printf("Warning: Unable to create a log file, output of the workers will be mixed: %s\n",strerror(errno));
+					logWarned=true;
+				}
+				fflush(stdout);
+				pid_t pid=fork();
+				if(pid==0){
+					if(log!=NULL) dup2(fileno(log),1);
+					bool ok=convert(jobs[next].xformFile.c_str(),jobs[next].fromDirectory,force);
+					fflush(stdout);
+					_exit(ok?0:1);
+				}
+				if(pid<0){
+					printf("Error: Unable to start a worker: %s\n",strerror(errno));
+					exit(1);
+				}
+				running[pid]=log;
+				next++;
+				continue;
+			}
+
+			int status;
+			pid_t pid=wait(&status);
+			if(pid<0 || running.count(pid)==0) continue;
+
+			FILE* log=running[pid];
+			running.erase(pid);
+			if(log!=NULL){
+				rewind(log);
+				char buffer[4096];
+				size_t length;
+				while((length=fread(buffer,1,sizeof(buffer),log))>0){
+					fwrite(buffer,1,length,stdout);
+				}
+				fclose(log);
+			}
+			if(!WIFEXITED(status) || WEXITSTATUS(status)!=0) failed++;
+		}
+
+		exit(failed>0?1:0);
+	}
+#endif
+
+	for(unsigned int i=0;i<jobs.size();i++){
+		if(!convert(jobs[i].xformFile.c_str(),jobs[i].fromDirectory,force)) failed++;
+	}
+
+	return failed>0?1:0;
+}
+
+//Converts one file, returns false on errors
+bool convert(const char* xformFile,bool fromDirectory,bool force){
+
+	memset(&xform,0,sizeof(xform));
+	fill(xform.palette.indexes,xform.palette.indexes+256,-1);
+	xform.palette.transparentColor=254;
+
 	//load the xform definition file
-	printf("Loading transformation file: %s\n",argv[1]);
-	TiXmlDocument doc (argv[1]);
-	xform.xformFile=argv[1];
+	TiXmlDocument doc (xformFile);
+	xform.xformFile=xformFile;
 
 	doc.LoadFile();
+	if(fromDirectory && (doc.Error() || doc.RootElement()==NULL || strcmp(doc.RootElement()->Value(),"gfx-xform")!=0)){
+		return true;
+	}
+
+	printf("Loading transformation file: %s\n",xformFile);
 	if ( doc.Error() )
 	{
 		printf( "Error in %s: %s\n", doc.Value(), doc.ErrorDesc() );
-		exit( 1 );
+		return false;
 	}
 
 	//parse configuration
 	parseXml(&doc);
 
+	xform.contentHash=contentHash();
+	if(!force && upToDate(xform.contentHash)){
+		printf("Output file %s is up to date\n",xform.outputFile);
+		return true;
+	}
+
 	//generate include file
 	if(!process()){
-		exit(1);
+		//don't leave something that looks up to date behind
+		remove(xform.outputFile);
+		if(xform.binaryFile!=NULL) remove(xform.binaryFile);
+		return false;
 	}
 
+	return true;
+}
 
+//FNV-1a over a file, unchanged if it can't be read
+unsigned long long hashFile(const char* filename,unsigned long long h){
+	FILE* f=filename!=NULL?fopen(filename,"rb"):NULL;
+	if(f==NULL) return h;
 
-	return 0;
+	unsigned char buffer[4096];
+	size_t length;
+	while((length=fread(buffer,1,sizeof(buffer),f))>0){
+		for(size_t i=0;i<length;i++) h=(h^buffer[i])*1099511628211ULL;
+	}
+	fclose(f);
+	return h;
 }
 
-int paletteIndexFromColor(unsigned char color){
-	
-	for(int index = 0; index < xform.palette.numColors; index++){
-		if(xform.palette.colors[index] == color)
-			return index;	
+const char* contentHash(){
+	unsigned long long h=14695981039346656037ULL;
+	h=(h^VERSION_MAJ)*1099511628211ULL;
+	h=(h^VERSION_MIN)*1099511628211ULL;
+	h=hashFile(xform.xformFile,h);
+	for(int i=0;i<xform.inputsCount;i++){
+		h=hashFile(xform.inputs[i].file,h);
 	}
-	return -1;
+	h=hashFile(xform.palette.filename,h);
+
+	char* hash=new char[17];
+	sprintf(hash,"%08x%08x",(unsigned int)(h>>32),(unsigned int)h);
+	return hash;
+}
+
+//the output exists and was made from the same inputs
+bool upToDate(const char* hash){
+	FILE* f=fopen(xform.outputFile,"rt");
+	if(f==NULL) return false;
+	if(xform.binaryFile!=NULL && access(xform.binaryFile,F_OK)!=0){
+		fclose(f);
+		return false;
+	}
+
+	char line[256];
+	bool same=false;
+	while(!same && fgets(line,sizeof(line),f)!=NULL && strncmp(line," */",3)!=0){
+		same=strncmp(line," * Content hash: ",17)==0 && strncmp(line+17,hash,16)==0;
+	}
+	fclose(f);
+	return same;
+}
+
+int paletteIndexFromColor(unsigned char color){
+	return xform.palette.indexes[color];
 }
 
 unsigned char* getTileAt(int x,int y,Image *image){
@@ -170,37 +380,468 @@ unsigned char* getTileAt(int x,int y,Image *image){
 	return tile;
 }
 
+//flags are the mode 3 SPRITE_FLIP_X (1) and SPRITE_FLIP_Y (2)
+unsigned char* flipTile(unsigned char* tile,int flags,int width,int height){
+	unsigned char* flipped=new unsigned char[width*height];
+
+	for(int y=0;y<height;y++){
+		int sy=(flags&2)?height-1-y:y;
+		for(int x=0;x<width;x++){
+			int sx=(flags&1)?width-1-x:x;
+			flipped[y*width+x]=tile[sy*width+sx];
+		}
+	}
+
+	return flipped;
+}
+
 bool tilesEqual(unsigned char* tile1,unsigned char* tile2,int lenght){
-	int j;
-	for(j=0;j<lenght;j++){
-		if(*tile1!=tile2[j]) break;
-		tile1++;
+	return memcmp(tile1,tile2,lenght)==0;
+}
+
+/*
+ * Finds tiles by content. Tiles are bucketed by a hash of their pixels, so
+ * only the few sharing a bucket get compared instead of the whole tileset.
+ */
+class TileIndex {
+public:
+	TileIndex(vector<unsigned char*> &tiles,int tileSize) : tiles(tiles),tileSize(tileSize) {}
+
+	//index of the first tile with this content, -1 if none
+	int find(unsigned char* tile){
+		pair<multimap<unsigned int,int>::iterator,multimap<unsigned int,int>::iterator> range=buckets.equal_range(hash(tile));
+		for(multimap<unsigned int,int>::iterator it=range.first;it!=range.second;it++){
+			if(tilesEqual(tile,tiles[it->second],tileSize)) return it->second;
+		}
+		return -1;
 	}
 
-	if(j==lenght){
-		return true;
+	//tiles[index] must be the tile, the first one added for a given content wins
+	void add(unsigned char* tile,int index){
+		if(find(tile)==-1) buckets.insert(make_pair(hash(tile),index));
+	}
+
+private:
+	unsigned int hash(unsigned char* tile){
+		unsigned int h=2166136261u;	//FNV-1a
+		for(int i=0;i<tileSize;i++) h=(h^tile[i])*16777619u;
+		return h;
+	}
+
+	vector<unsigned char*> &tiles;
+	int tileSize;
+	multimap<unsigned int,int> buckets;
+};
+
+/*
+ * Index of the unique tile that shows as this tile, -1 if none. With
+ * removeMirroredTiles, flips gets the flags to draw that tile with.
+ */
+int findTile(TileIndex &tileIndex,unsigned char* tile,int* flips){
+	*flips=0;
+	int index=tileIndex.find(tile);
+
+	//flipping is its own inverse, so the tile flipped like this is the unique one
+	for(int f=1;f<4 && index==-1 && xform.removeMirroredTiles;f++){
+		unsigned char* flipped=flipTile(tile,f,xform.tileWidth,xform.tileHeight);
+		index=tileIndex.find(flipped);
+		if(index!=-1) *flips=f;
+		delete[] flipped;
+	}
+
+	return index;
+}
+
+//output types that are plain pixel data, as opposed to code tiles
+bool isDataTileType(const char* type){
+	return strcmp(type,"8bpp")==0 || strcmp(type,"3bpp")==0 || strcmp(type,"4bpp")==0 ||
+			strcmp(type,"mode13-extended")==0 || strcmp(type,"1bpp")==0;
+}
+
+//4 bit value of a pixel for the palette based output types
+int paletteNibble(const char* type,unsigned char color,bool* valid){
+	if(strcmp(type,"mode13-extended")!=0 && color==xform.palette.transparentColor){
+		return strcmp(type,"3bpp")==0?0x1:0xF;
+	}
+
+	int index=paletteIndexFromColor(color);
+	if(index==-1){
+		*valid=false;
+		index=0;
+	}
+	return strcmp(type,"3bpp")==0?index<<1:index;
+}
+
+/*
+ * Appends the bytes of a tile in one of the data output types. Returns false
+ * if it has colors the palette doesn't, those get color index 0.
+ */
+bool encodeTile(const char* type,unsigned char* tile,vector<unsigned char> &out){
+	bool valid=true;
+
+	if(strcmp(type,"8bpp")==0){
+		out.insert(out.end(),tile,tile+xform.tileWidth*xform.tileHeight);
+
+	}else if(strcmp(type,"1bpp")==0){
+		for(int y=0;y<xform.tileHeight;y++){
+			unsigned char b=0;
+			//pack 8 pixels in one byte
+			for(int x=0;x<xform.tileWidth;x++){
+				if(tile[y*xform.tileWidth+x]!=0) b|=(0x80>>x);
+			}
+			out.push_back(b);
+		}
+
 	}else{
-		return false;
+		//pack 2 pixels in one byte
+		for(int i=0;i<xform.tileWidth*xform.tileHeight;i+=2){
+			unsigned char b;
+			b  = (paletteNibble(type,tile[i],&valid) & 0xF);
+			b |= (paletteNibble(type,tile[i+1],&valid) & 0xF) << 4;
+			if(strcmp(type,"mode13-extended")==0){
+				b = PaletteConversionTable[b];
+			}
+			out.push_back(b);
+		}
 	}
+
+	return valid;
 }
 
-bool process(){
+/*
+ * RLE for compression="rle", unpacked by RleUnpack() in the kernel. A control
+ * byte below 0x80 is followed by that many plus one bytes to copy, one with
+ * bit 7 set by a byte to repeat (control & 0x7f)+2 times.
+ */
+void packRle(vector<unsigned char> &in,vector<unsigned char> &out){
+	unsigned int i=0;
 
-	Image image;
-	image.buffer=loadImage();
+	while(i<in.size()){
+		unsigned int run=1;
+		while(i+run<in.size() && in[i+run]==in[i] && run<129) run++;
 
+		if(run>=2){
+			out.push_back(0x80|(run-2));
+			out.push_back(in[i]);
+			i+=run;
+		}else{
+			//copy up to where a run starts paying off
+			unsigned int start=i;
+			while(i<in.size() && i-start<128){
+				if(i+2<in.size() && in[i]==in[i+1] && in[i]==in[i+2]) break;
+				i++;
+			}
+			out.push_back(i-start-1);
+			out.insert(out.end(),in.begin()+start,in.begin()+i);
+		}
+	}
+}
 
-	if(image.buffer==NULL){
+/*
+ * Appends the instructions of a mode 9 code tile. Each row draws its pixels
+ * with the instructions that fetch and jump to the next tile in between.
+ */
+void encodeCodeTile(const char* type,unsigned char* tile,vector<unsigned char> &out){
+	static const unsigned char between[6][4]={
+		{0x19,0x91},			//ld	r17, Y+
+		{0x15,0x9f},			//mul	r17, r21
+		{0x08,0x0e,0x19,0x1e},	//add	r0, r24 / adc	r1, r25
+		{0xf9,0x01,0x4a,0x95},	//movw r30, r18 / dec	r20
+		{0x09,0xf0,0xf0,0x01},	//breq	.+2 / movw	r30, r0
+		{0x09,0x94},			//ijmp
+	};
+	static const int betweenSize[6]={2,2,4,4,4,2};
+	bool code80=strcmp(type,"code80")==0;
+
+	for(int y=0;y<xform.tileHeight;y++){
+		for(int x=0;x<6;x++){
+			unsigned char color=tile[y*xform.tileWidth+x];
+			bool background=xform.backgroundColor!=-1 && xform.backgroundColor==color;
+
+			if(code80){
+				//1bpp, the colors are in r2 (background) and r3 (foreground)
+				out.push_back((background || color==0)?0x28:0x38);		//out 0x08,r2 / out 0x08,r3
+				out.push_back(0xb8);
+			}else{
+				if(background){
+					out.push_back(0x02);				//mov r16,r2
+					out.push_back(0x2D);
+				}else if(xform.foregroundColor!=-1 && xform.foregroundColor==color){
+					out.push_back(0x03);				//mov r16,r3
+					out.push_back(0x2D);
+				}else{
+					out.push_back(color&0xf);			//ldi	r16, pixel color
+					out.push_back(0xe0|(color>>4));
+				}
+				out.push_back(0x08);					//out	0x08, r16
+				out.push_back(0xb9);
+			}
+			out.insert(out.end(),between[x],between[x]+betweenSize[x]);
+		}
+	}
+}
+
+/*
+ * Compiles a row of compact code tiles (compact-code-tiles="true"). The pixel
+ * outs have to happen at the same cycles as in the usual rows, the color loads
+ * and the instructions that fetch the next tile are scheduled around them in
+ * as few words as possible. Colors in r2/r3 are output directly and a pixel
+ * of the same color as the one before needs no out at all.
+ */
+class CodeRowCompiler {
+public:
+	CodeRowCompiler(const char* type,unsigned char* row){
+		bool code80=strcmp(type,"code80")==0;
+		pitch=code80?3:4;	//cycles per pixel
+		first=code80?0:1;	//cycle of the first out
+		end=pitch*6;
+
+		for(int x=0;x<6;x++){
+			color[x]=row[x];
+			bool background=xform.backgroundColor!=-1 && xform.backgroundColor==row[x];
+			if(code80){
+				source[x]=(background || row[x]==0)?2:3;
+			}else if(background){
+				source[x]=2;
+			}else if(xform.foregroundColor!=-1 && xform.foregroundColor==row[x]){
+				source[x]=3;
+			}else{
+				source[x]=16;	//ldi r16
+			}
+		}
+		//the port keeps its value, the first pixel follows another tile though
+		for(int x=5;x>0;x--){
+			if(source[x]==source[x-1] && (source[x]!=16 || color[x]==color[x-1])) source[x]=-1;
+		}
+
+		memset(memo,-1,sizeof(memo));
+	}
+
+	void compile(vector<unsigned char> &out){
+		int t=0,chain=0,movw=0,loaded=0,pixel=0;
+
+		best(t,chain,movw,loaded);
+		while(t<end-2){
+			switch(choice[t][chain][movw][loaded]){
+			case OUT:
+				if(source[pixel]==16) loaded=0;
+				word(out,0xb808|((source[pixel]&0x10)<<4)|((source[pixel]&0xf)<<4));	//out 0x08,rN
+				t++;
+				break;
+			case CHAIN:
+				for(int i=0;i<chainWords[chain];i++) word(out,chainCode[chain][i]);
+				t+=chainCycles[chain++];
+				break;
+			case MOVW:
+				word(out,0x01f9);	//movw r30, r18
+				movw=1;
+				t++;
+				break;
+			case LDI:
+				for(int x=pixel;x<6;x++){
+					if(source[x]==16){
+						word(out,0xe000|((color[x]&0xf0)<<4)|(color[x]&0xf));	//ldi r16, pixel color
+						break;
+					}
+				}
+				loaded=1;
+				t++;
+				break;
+			case NOP:
+				word(out,0x0000);	//nop
+				t++;
+				break;
+			case RJMP:
+				word(out,0xc000);	//rjmp .+0, two cycles
+				t+=2;
+				break;
+			}
+			while(pixel<6 && first+pixel*pitch<t) pixel++;
+		}
+		word(out,0x9409);	//ijmp
+	}
+
+private:
+	enum { OUT, CHAIN, MOVW, LDI, NOP, RJMP, INFEASIBLE=1000 };
+
+	//pixel with an out at this cycle, -1 if none
+	int outAt(int t){
+		if(t<first || (t-first)%pitch!=0 || (t-first)/pitch>=6) return -1;
+		int x=(t-first)/pitch;
+		return source[x]==-1?-1:x;
+	}
+
+	bool ldiAfter(int t){
+		for(int x=0;x<6;x++){
+			if(source[x]==16 && first+x*pitch>t) return true;
+		}
 		return false;
 	}
 
+	//fewest words to finish the row from this state
+	int best(int t,int chain,int movw,int loaded){
+		if(t>=end-2) return (t==end-2 && chain==6 && movw)?1:INFEASIBLE;	//ijmp
+		int &result=memo[t][chain][movw][loaded];
+		if(result!=-1) return result;
+
+		result=INFEASIBLE;
+		int pixel=outAt(t);
+		if(pixel!=-1){
+			if(source[pixel]!=16 || loaded){
+				result=1+best(t+1,chain,movw,source[pixel]==16?0:loaded);
+				choice[t][chain][movw][loaded]=OUT;
+			}
+			return result;
+		}
+
+		bool fitsTwo=t+1<end-2 && outAt(t+1)==-1;
+		int words;
+		if(chain<6 && (chainCycles[chain]==1 || fitsTwo) && (chain!=5 || movw)){
+			words=chainWords[chain]+best(t+chainCycles[chain],chain+1,movw,loaded);
+			if(words<result){ result=words; choice[t][chain][movw][loaded]=CHAIN; }
+		}
+		if(!movw){
+			words=1+best(t+1,chain,1,loaded);
+			if(words<result){ result=words; choice[t][chain][movw][loaded]=MOVW; }
+		}
+		if(!loaded && ldiAfter(t)){
+			words=1+best(t+1,chain,movw,1);
+			if(words<result){ result=words; choice[t][chain][movw][loaded]=LDI; }
+		}
+		if(fitsTwo){
+			words=1+best(t+2,chain,movw,loaded);
+			if(words<result){ result=words; choice[t][chain][movw][loaded]=RJMP; }
+		}
+		words=1+best(t+1,chain,movw,loaded);
+		if(words<result){ result=words; choice[t][chain][movw][loaded]=NOP; }
+
+		return result;
+	}
+
+	void word(vector<unsigned char> &out,unsigned int w){
+		out.push_back(w&0xff);
+		out.push_back(w>>8);
+	}
+
+	//fetching the next tile, in this order
+	static const int chainCycles[6];
+	static const int chainWords[6];
+	static const unsigned int chainCode[6][2];
+
+	int source[6];
+	unsigned char color[6];
+	int pitch,first,end;
+	int memo[24][7][2][2];
+	int choice[24][7][2][2];
+};
+
+const int CodeRowCompiler::chainCycles[6]={2,2,1,1,1,2};
+const int CodeRowCompiler::chainWords[6]={1,1,1,1,1,2};
+const unsigned int CodeRowCompiler::chainCode[6][2]={
+	{0x9119},			//ld	r17, Y+
+	{0x9f15},			//mul	r17, r21
+	{0x0e08},			//add	r0, r24
+	{0x1e19},			//adc	r1, r25
+	{0x954a},			//dec	r20, right before the breq as add and adc change the flags too
+	{0xf009,0x01f0},	//breq	.+2 / movw	r30, r0
+};
+
+/*
+ * Appends the compact code tiles, all rows padded to the longest one.
+ * Returns its size in words, for FONT_TILE_WIDTH.
+ */
+int encodeCompactCodeTiles(const char* type,vector<unsigned char*> &tiles,vector<unsigned char> &out){
+	vector<vector<unsigned char> > rows;
+	unsigned int rowSize=0;
+	int longest=0,longestTile=0;
+
+	for(unsigned int t=0;t<tiles.size();t++){
+		for(int y=0;y<xform.tileHeight;y++){
+			rows.push_back(vector<unsigned char>());
+			CodeRowCompiler(type,&tiles[t][y*xform.tileWidth]).compile(rows.back());
+
+			if(rows.back().size()>rowSize){
+				rowSize=rows.back().size();
+				longest=0;
+				longestTile=t;
+			}
+			if(rows.back().size()==rowSize) longest++;
+		}
+	}
+	for(unsigned int r=0;r<rows.size();r++){
+		rows[r].resize(rowSize,0);
+		out.insert(out.end(),rows[r].begin(),rows[r].end());
+	}
+	printf("Code tile rows of the longest size: %i, the first in tile %i\n",longest,longestTile);
+
+	return rowSize/2;
+}
+
+void writeBytes(FILE *tf,vector<unsigned char> &data){
+	for(unsigned int i=0;i<data.size();i++){
+		if(i%20==0) fprintf(tf,"\n"); //wrap line
+		fprintf(tf,i+1<data.size()?"0x%x,":"0x%x",data[i]);
+	}
+	fprintf(tf,"\n");
+}
+
+/*
+ * For binary-file: appends an array to the binary file and declares it in
+ * the output file, with the .incbin that makes the assembler take its bytes.
+ * With filler set, that many zeros go right before the array as
+ * vector_table_filler. It has to be in the same asm block: GCC emits
+ * toplevel asm ahead of the variables, so a C array would end up after it.
+ */
+void writeBinaryArray(FILE *tf,FILE *bf,const char* type,const char* name,const char* section,int align,vector<unsigned char> &data,int filler=0){
+	long offset=ftell(bf);
+	if(data.size()>0) fwrite(&data[0],1,data.size(),bf);
+
+	//the assembler wants forward slashes, even on Windows
+	string path=xform.binaryFile;
+	replace(path.begin(),path.end(),'\\','/');
+
+	fprintf(tf,"extern const %s %s[] PROGMEM;\n",type,name);
+	fprintf(tf,"__asm__(\".pushsection %s,\\\"a\\\",@progbits\\n\"\n",section);
+	if(align>1) fprintf(tf,"\t\".balign %i\\n\"\n",align);
+	if(filler>0){
+		fprintf(tf,"\t\".global vector_table_filler\\n\"\n");
+		fprintf(tf,"\t\"vector_table_filler:\\n\"\n");
+		fprintf(tf,"\t\".space %i\\n\"\n",filler);
+	}
+	fprintf(tf,"\t\".global %s\\n\"\n",name);
+	fprintf(tf,"\t\"%s:\\n\"\n",name);
+	fprintf(tf,"\t\".incbin \\\"%s\\\",%li,%u\\n\"\n",path.c_str(),offset,(unsigned int)data.size());
+	fprintf(tf,"\t\".popsection\\n\");\n");
+}
+
+//orders tiles by how many map cells use them, most used first
+struct ByUsage {
+	ByUsage(vector<int> &usage) : usage(usage) {}
+	bool operator()(int a,int b) const { return usage[a]>usage[b]; }
+	vector<int> &usage;
+};
+
+bool process(){
+
 	//some validation
     if(xform.maps!=NULL && xform.mapsPointersSize!=8 && xform.mapsPointersSize!=16){
 		printf("Error: Invalid map pointers size: %i. Valid values are 8 and 16.\n", xform.mapsPointersSize);
 		return false;
     }
-    if(xform.width==0 || xform.height==0){
-		printf("Error: Invalid image size(%i,%i)\n", xform.width, xform.height);
+    if(xform.maps!=NULL && xform.removeMirroredTiles && xform.mapsPointersSize!=8){
+		printf("Error: Mirrored tiles are for sprite maps, they need a map pointers size of 8.\n");
+		return false;
+    }
+    if(xform.compressMaps && (xform.mapsPointersSize!=8 || xform.removeMirroredTiles)){
+		printf("Error: Only maps with a pointers size of 8 and no mirrored tiles can be compressed.\n");
+		return false;
+    }
+    if(xform.compressTiles && !isDataTileType(xform.outputType==NULL?"8bpp":xform.outputType)){
+		printf("Error: Code tiles run from flash, they can't be compressed.\n");
+		return false;
+    }
+    if(xform.inputsCount==0){
+		printf("Error: No input file.\n");
 		return false;
     }
     if(xform.tileWidth==0 || xform.tileHeight==0){
@@ -208,15 +849,40 @@ bool process(){
 		return false;
     }
 
-    if((xform.width%xform.tileWidth!=0)){
-    	printf("Error: Image width must an integer multiple of the tile width.\n");
-    	return false;
-    }
+	vector<Image> images(xform.inputsCount);
+	for(int i=0;i<xform.inputsCount;i++){
+		Input* input=&xform.inputs[i];
+		Image* image=&images[i];
 
-    if((xform.height%xform.tileHeight!=0)){
-    	printf("Error: Image height must be an integer multiple of the tile height.\n");
-    	return false;
-    }
+		image->buffer=loadImage(input);
+		if(image->buffer==NULL){
+			return false;
+		}
+
+	    if(input->tileWidth!=xform.tileWidth || input->tileHeight!=xform.tileHeight){
+			printf("Error: All inputs must have the same tile size, %s doesn't.\n", input->file);
+			return false;
+	    }
+	    if(input->width==0 || input->height==0){
+			printf("Error: Invalid image size(%i,%i)\n", input->width, input->height);
+			return false;
+	    }
+
+	    if((input->width%xform.tileWidth!=0)){
+	    	printf("Error: Image width must an integer multiple of the tile width.\n");
+	    	return false;
+	    }
+
+	    if((input->height%xform.tileHeight!=0)){
+	    	printf("Error: Image height must be an integer multiple of the tile height.\n");
+	    	return false;
+	    }
+
+		image->tileWidth=xform.tileWidth;
+		image->tileHeight=xform.tileHeight;
+		image->width=input->width;
+		image->height=input->height;
+	}
 	
 	if(xform.palette.filename != NULL){
 		loadPalette();
@@ -226,21 +892,19 @@ bool process(){
 		}
 	}
 
-	image.tileWidth=xform.tileWidth;
-	image.tileHeight=xform.tileHeight;
-	image.width=xform.width;
-	image.height=xform.height;
-
 	printf("Transform file version: %i\n",xform.version);
-	printf("Input file: %s\n",xform.inputFile);
-	printf("Input file type: %s\n",xform.inputType);
-	printf("Input width: %ipx\n",xform.width);
-	printf("Input height: %ipx\n",xform.height);
+	for(int i=0;i<xform.inputsCount;i++){
+		printf("Input file: %s\n",xform.inputs[i].file);
+		printf("Input file type: %s\n",xform.inputs[i].type);
+		printf("Input width: %ipx\n",xform.inputs[i].width);
+		printf("Input height: %ipx\n",xform.inputs[i].height);
+	}
 	printf("Tile width: %ipx\n",xform.tileWidth);
 	printf("Tile height: %ipx\n",xform.tileHeight);
 	printf("Output file: %s\n",xform.outputFile);
 	printf("Output type: %s\n",xform.outputType);
 	printf("Remove duplicate tiles: %s\n",xform.removeDuplicateTiles?"true":"false");
+	printf("Remove mirrored tiles: %s\n",xform.removeMirroredTiles?"true":"false");
 
 	printf("Tiles variable name: %s\n",xform.tilesVarName);
 	if(xform.maps!=NULL){
@@ -255,571 +919,425 @@ bool process(){
 		printf("Palette transparent color: %d\n", xform.palette.transparentColor);
 	}
 
-	int horizontalTiles=xform.width/xform.tileWidth;
-	int verticalTiles=xform.height/xform.tileHeight;
 	int totalSize=0;
-	int verticalTilesetHeight=xform.tilesetHeight==0?verticalTiles:xform.tilesetHeight;
+	int tilesetSize=0;	//unpacked
 
 
 	vector<unsigned char*> uniqueTiles;
-	int count=0;
+	TileIndex tileIndex(uniqueTiles,xform.tileWidth*xform.tileHeight);
+	vector<vector<int> > tilesetMaps(xform.inputsCount);	//unique tile for each position of the tileset area of an input
+	vector<vector<int> > tilesetFlips(xform.inputsCount);	//and the flags to draw it with
+	int count=0,mirrored=0;
 
-	//build tile file from tiles
-    FILE *tf = fopen(xform.outputFile,"wt");
-    if (!tf){
-    	printf("Error: Unable to write to tiles output file %s\n", xform.outputFile);
-    	return false;
-    }
+    //build unique tileset, shared by all inputs
+	for(int i=0;i<xform.inputsCount;i++){
+		int horizontalTiles=images[i].width/xform.tileWidth;
+		int verticalTilesetHeight=xform.inputs[i].tilesetHeight==0?images[i].height/xform.tileHeight:xform.inputs[i].tilesetHeight;
 
-    fprintf(tf,"/*\n");
-    fprintf(tf," * Transformation file: %s\n",xform.xformFile);
-    fprintf(tf," * Source image: %s\n",xform.inputFile);
-    fprintf(tf," * Tile width: %ipx\n",xform.tileWidth);
-    fprintf(tf," * Tile height: %ipx\n",xform.tileHeight);
-    fprintf(tf," * Output format: %s\n",xform.outputType);
-    fprintf(tf," */\n");
-
-    //build unique tileset
-	for(int v=0; v<verticalTilesetHeight; v++){
-		for(int h=0; h<horizontalTiles; h++){
+		for(int v=0; v<verticalTilesetHeight; v++){
+			for(int h=0; h<horizontalTiles; h++){
 
-			unsigned char* tile=getTileAt(h,v,&image);
+				unsigned char* tile=getTileAt(h,v,&images[i]);
 
-			if(xform.removeDuplicateTiles==false){
-				uniqueTiles.push_back(tile);
-			}else{
-				int refIndex=-1;
 				//check if tile already exist
-				for(int i=uniqueTiles.size()-1;i>=0;i--){
-					unsigned char* b=uniqueTiles.at(i);
-
-					int j;
-					for(j=0;j<xform.tileWidth*xform.tileHeight;j++){if(*b!=tile[j]) break;b++;}
+				int flips;
+				int refIndex=findTile(tileIndex,tile,&flips);
+				if(flips!=0) mirrored++;
 
-					if(j==(xform.tileWidth*xform.tileHeight)){
-						refIndex=i;	//tile already exist in unique list
-						break;
-					}
-				}
-
-				if(refIndex==-1){
+				if(xform.removeDuplicateTiles==false || refIndex==-1){
 					uniqueTiles.push_back(tile);
+					tileIndex.add(tile,uniqueTiles.size()-1);
 				}else{
-					free(tile);
+					delete[] tile;
 				}
-			}
+				//maps point to the first copy of a tile, even when duplicates are kept
+				tilesetMaps[i].push_back(refIndex==-1?uniqueTiles.size()-1:refIndex);
+				tilesetFlips[i].push_back(flips);
 
-			count++;
+				count++;
+			}
 		}
 	}
 
-	//Export maps first
-	if(xform.maps!=NULL){
+	//find the tiles of the maps
+	vector<vector<int> > mapTiles(xform.mapsCount),mapFlips(xform.mapsCount);
+	for(int m=0; m<xform.mapsCount && xform.maps!=NULL; m++){
+		TileMap map=xform.maps[m];
 
-		int index=0;
+		if(map.input==-1){
+			printf("Error: Map %s is of an input that isn't listed\n",map.varName);
+			return false;
+		}
+		Image* image=&images[map.input];
+		int horizontalTiles=image->width/xform.tileWidth;
+		int verticalTiles=image->height/xform.tileHeight;
+		int verticalTilesetHeight=xform.inputs[map.input].tilesetHeight==0?verticalTiles:xform.inputs[map.input].tilesetHeight;
+
+		//validate map
+		if(map.left>horizontalTiles || map.left+map.width>horizontalTiles || map.top>verticalTiles || map.top+map.height >verticalTiles){
+			printf("Error: Positions or sizes are out of bound for map: %s\n",map.varName);
+			return false;
+		}
 
-		for(int m=0; m<xform.mapsCount; m++){
-			TileMap map=xform.maps[m];
+		for(int y=map.top;y<(map.top+map.height);y++){
+			for(int x=map.left;x<(map.left+map.width);x++){
 
-			//validate map
-			if(map.left>horizontalTiles || map.left+map.width>horizontalTiles || map.top>verticalTiles || map.top+map.height >verticalTiles){
-				printf("Error: Positions or sizes are out of bound for map: %s\n",map.varName);
-				return false;
-			}
+				//check for first tile that match pixels at the current map position
+				int index,flips;
+				if(y<verticalTilesetHeight){
+					index=tilesetMaps[map.input][y*horizontalTiles+x];
+					flips=tilesetFlips[map.input][y*horizontalTiles+x];
+				}else{
+					unsigned char* tile=getTileAt(x,y,image);
+					index=findTile(tileIndex,tile,&flips);
+					delete[] tile;
+				}
 
-			fprintf(tf,"#define %s_WIDTH %i\n",toUpperCase(map.varName),map.width);
-			fprintf(tf,"#define %s_HEIGHT %i\n",toUpperCase(map.varName),map.height);
+				if(index==-1){
+					printf("Map tile not found in tilset!\n");
+					return false;
+				}
 
-			if(xform.mapsPointersSize==8){
-				fprintf(tf,"const char %s[] PROGMEM ={\n",map.varName);
-			}else{
-				fprintf(tf,"const int %s[] PROGMEM ={\n",map.varName);
+				mapTiles[m].push_back(index);
+				mapFlips[m].push_back(flips);
 			}
+		}
+	}
 
-			fprintf(tf,"%i,",map.width);
-			fprintf(tf,"%i",map.height);
+	//how many tiles the inputs would have with a tileset each
+	int separateTiles=0;
+	for(int i=0;i<xform.inputsCount && xform.inputsCount>1;i++){
+		vector<bool> used(uniqueTiles.size(),false);
+		for(unsigned int t=0;t<tilesetMaps[i].size();t++) used[tilesetMaps[i][t]]=true;
+		for(int m=0;m<xform.mapsCount && xform.maps!=NULL;m++){
+			if(xform.maps[m].input!=i) continue;
+			for(unsigned int t=0;t<mapTiles[m].size();t++) used[mapTiles[m][t]]=true;
+		}
+		separateTiles+=std::count(used.begin(),used.end(),true);
+	}
 
+	if(xform.orderTilesByUsage){
+		vector<int> usage(uniqueTiles.size(),0);
+		for(int m=0;m<xform.mapsCount;m++){
+			for(unsigned int t=0;t<mapTiles[m].size();t++) usage[mapTiles[m][t]]++;
+		}
 
-			int c=0;
-			for(int y=map.top;y<(map.top+map.height);y++){
-				for(int x=map.left;x<(map.left+map.width);x++){
+		vector<int> order(uniqueTiles.size());
+		for(unsigned int t=0;t<order.size();t++) order[t]=t;
+		stable_sort(order.begin(),order.end(),ByUsage(usage));
 
-					if(c%20==0)	fprintf(tf,"\n"); //wrap line
+		vector<int> position(uniqueTiles.size());
+		vector<unsigned char*> sorted(uniqueTiles.size());
+		for(unsigned int t=0;t<order.size();t++){
+			position[order[t]]=t;
+			sorted[t]=uniqueTiles[order[t]];
+		}
+		uniqueTiles.swap(sorted);
 
-					fprintf(tf,",");
+		for(int i=0;i<xform.inputsCount;i++){
+			for(unsigned int t=0;t<tilesetMaps[i].size();t++) tilesetMaps[i][t]=position[tilesetMaps[i][t]];
+		}
+		for(int m=0;m<xform.mapsCount;m++){
+			for(unsigned int t=0;t<mapTiles[m].size();t++) mapTiles[m][t]=position[mapTiles[m][t]];
+		}
+	}
 
-					//check for first tile that match pixels at the current map position
-					unsigned char* tile=getTileAt(x,y,&image);
-					index=-1;
-					for(unsigned int i=0;i<uniqueTiles.size();i++){
-						unsigned char* b=uniqueTiles.at(i);
-						if(tilesEqual(tile,b,image.tileWidth*image.tileHeight)){
-							index=i;	//tile found in tile list
-							break;
-						}
-					}
-					free(tile);
+	//build tile file from tiles
+    FILE *tf = fopen(xform.outputFile,"wt");
+    if (!tf){
+    	printf("Error: Unable to write to tiles output file %s\n", xform.outputFile);
+    	return false;
+    }
 
-					if(index==-1){
-						printf("Map tile not found in tilset!\n");
-						return false;
-					}
+    fprintf(tf,"/*\n");
+    fprintf(tf," * Transformation file: %s\n",xform.xformFile);
+	for(int i=0;i<xform.inputsCount;i++){
+	    fprintf(tf," * Source image: %s\n",xform.inputs[i].file);
+	}
+    fprintf(tf," * Tile width: %ipx\n",xform.tileWidth);
+    fprintf(tf," * Tile height: %ipx\n",xform.tileHeight);
+    fprintf(tf," * Output format: %s\n",xform.outputType);
+    fprintf(tf," * Content hash: %s\n",xform.contentHash);
+    if(xform.binaryFile!=NULL){
+        fprintf(tf," * Data: %s, included by the assembler from the directory it runs in\n",xform.binaryFile);
+    }
+    if(xform.orderTilesByUsage){
+        fprintf(tf," * Tiles ordered by how many map cells use them\n");
+    }
+    fprintf(tf," */\n");
 
-					fprintf(tf,"0x%x",index);
+    FILE *bf=NULL;
+    if(xform.binaryFile!=NULL){
+        bf=fopen(xform.binaryFile,"wb");
+        if(!bf){
+        	printf("Error: Unable to write to binary output file %s\n", xform.binaryFile);
+        	fclose(tf);
+        	return false;
+        }
+    }
 
+	//Export maps first
+	if(xform.maps!=NULL){
 
-					c++;
+		for(int m=0; m<xform.mapsCount; m++){
+			TileMap map=xform.maps[m];
 
-				}
+			fprintf(tf,"#define %s_WIDTH %i\n",toUpperCase(map.varName),map.width);
+			fprintf(tf,"#define %s_HEIGHT %i\n",toUpperCase(map.varName),map.height);
+
+			if(xform.removeMirroredTiles){
+				fprintf(tf,"//tile and flip flags for each cell, see MapSpriteMirrored()\n");
 			}
+			if(xform.compressMaps){
+				fprintf(tf,"//RLE packed after the size, see DrawMapRle()\n");
+			}
+			//with a binary file, it's declared once the data is known
+			if(bf==NULL){
+				if(xform.mapsPointersSize==8){
+					fprintf(tf,"const char %s[] PROGMEM ={\n",map.varName);
+				}else{
+					fprintf(tf,"const int %s[] PROGMEM ={\n",map.varName);
+				}
 
-			fprintf(tf,"};\n\n");
+				fprintf(tf,"%i,",map.width);
+				fprintf(tf,"%i",map.height);
+			}
 
-			totalSize+=((map.height*map.width)+2)*(xform.mapsPointersSize/8);
-		}
-	}
 
-	if(xform.outputType==NULL || strcmp(xform.outputType,"8bpp")==0){
+			int c=0;
+			vector<int> mapData;
+			for(unsigned int t=0;t<mapTiles[m].size();t++){
+				int index=mapTiles[m][t];
+				int flips=mapFlips[m][t];
+
+				if(xform.compressMaps || bf!=NULL){
+					mapData.push_back(index);
+					if(xform.removeMirroredTiles) mapData.push_back(flips);
+					continue;
+				}
 
-		/*Export tileset in 8 bits per pixel format*/
-	    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),uniqueTiles.size());
-	    fprintf(tf,"const char %s[] PROGMEM={\n",xform.tilesVarName);
+				if(c%20==0)	fprintf(tf,"\n"); //wrap line
 
-		int c=0,t=0;
-		vector<unsigned char*>::iterator it;
-		for(it=uniqueTiles.begin();it < uniqueTiles.end();it++){
+				fprintf(tf,",");
+				fprintf(tf,"0x%x",index);
+				if(xform.removeMirroredTiles){
+					fprintf(tf,",%i",flips);
+				}
 
-			unsigned char* tile=*it;
 
-			for(int index=0;index<(xform.tileWidth*xform.tileHeight);index++){
-				if(c>0)fprintf(tf,",");
-				fprintf(tf," 0x%x",tile[index]);
 				c++;
 			}
-			fprintf(tf,"\t\t //tile:%i\n",t);
-			t++;
-		}
-		fprintf(tf,"};\n");
-		totalSize+=(uniqueTiles.size()*xform.tileHeight*xform.tileHeight);
 
-	}else if(strcmp(xform.outputType,"3bpp")==0){
-		if(xform.palette.numColors == 0) {
-			printf("Error using 3bpp but no palette specified!\n");
-		}
-		else{
-			bool invalidColor=false;
-			/*Export tileset in 3 bits per pixel format*/
-		    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),uniqueTiles.size());
-
-			if(xform.isBackgroundTiles){
-			    fprintf(tf,"const char vector_table_filler[144] __attribute__ ((section (\".uze_progmem_origin\")))={};\n");
-				fprintf(tf,"const char %s[] __attribute__ ((section (\"uze_progmem_origin\")))={\n",xform.tilesVarName);
+			vector<unsigned char> data;
+			if(xform.compressMaps){
+				vector<unsigned char> cells(mapData.begin(),mapData.end());
+				packRle(cells,data);
+				totalSize+=data.size()+2;
 			}else{
-				fprintf(tf,"const char %s[] PROGMEM ={\n",xform.tilesVarName);
+				for(unsigned int i=0;i<mapData.size();i++){
+					data.push_back(mapData[i]);
+					if(xform.mapsPointersSize==16) data.push_back(mapData[i]>>8);
+				}
+				totalSize+=((map.height*map.width*(xform.removeMirroredTiles?2:1))+2)*(xform.mapsPointersSize/8);
 			}
 
-	
-			int c=0,t=0;
-			unsigned char b;
-			vector<unsigned char*>::iterator it;
-			for(it=uniqueTiles.begin();it < uniqueTiles.end();it++){
-	
-				unsigned char* tile=*it;
-	
-				for(int y=0;y<xform.tileHeight;y++){
-					//pack 2 pixels in one byte
-					for(int x=0;x<xform.tileWidth;x+=2){
-						int first = tile[(y*xform.tileWidth)+x];
-						int second = tile[(y*xform.tileWidth)+x+1];
-						
-						if(first != xform.palette.transparentColor){
-							first = paletteIndexFromColor(first) << 1;
-							if(first == -1){
-								invalidColor=true;
-								first=0;
-							}
-						}
-						else first = 0x1;
-						
-						if(second != xform.palette.transparentColor){
-							second = paletteIndexFromColor(second) << 1;
-							if(second == -1){
-								invalidColor=true;
-								second=0;
-							}
-						}
-						else second = 0x1;
-						
-						b  = (first & 0xF);
-						b |= (second & 0xF) << 4;
-						fprintf(tf," 0x%x,",b);
-					}
-					c++;
+			if(bf!=NULL){
+				//the size first, little endian like the compiler lays out an int
+				unsigned char size[]={(unsigned char)map.width,(unsigned char)(map.width>>8),(unsigned char)map.height,(unsigned char)(map.height>>8)};
+				if(xform.mapsPointersSize==8){
+					size[1]=size[2];
+					data.insert(data.begin(),size,size+2);
+				}else{
+					data.insert(data.begin(),size,size+4);
 				}
-				fprintf(tf,"\t\t //tile:%i\n",t);
-				t++;
-			}
-			fprintf(tf,"};\n\n");
-			totalSize+=(uniqueTiles.size()*xform.tileHeight*xform.tileHeight/2);
-			
-			if(invalidColor){
-				printf("Warning: colors in input image not included in palette");
+				writeBinaryArray(tf,bf,xform.mapsPointersSize==8?"char":"int",map.varName,".progmem.data",1,data);
+				fprintf(tf,"\n");
+				continue;
 			}
-		}
-	}
-	else if(strcmp(xform.outputType,"4bpp")==0){
-		if(xform.palette.numColors == 0) {
-			printf("Error using 4bpp but no palette specified!\n");
-		}
-		else{
-			bool invalidColor=false;
-			/*Export tileset in 4 bits per pixel format*/
-		    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),uniqueTiles.size());
-			fprintf(tf,"const char %s[] PROGMEM ={\n",xform.tilesVarName);
-	
-			int c=0,t=0;
-			unsigned char b;
-			vector<unsigned char*>::iterator it;
-			for(it=uniqueTiles.begin();it < uniqueTiles.end();it++){
-	
-				unsigned char* tile=*it;
-	
-				for(int y=0;y<xform.tileHeight;y++){
-					//pack 2 pixels in one byte
-					for(int x=0;x<xform.tileWidth;x+=2){
-						int first = tile[(y*xform.tileWidth)+x];
-						int second = tile[(y*xform.tileWidth)+x+1];
-						
-						if(first != xform.palette.transparentColor){
-							first = paletteIndexFromColor(first);
-							if(first == -1){
-								invalidColor=true;
-								first=0;
-							}
-						}
-						else first = 0xF;
-						
-						if(second != xform.palette.transparentColor){
-							second = paletteIndexFromColor(second);
-							if(second == -1){
-								invalidColor=true;
-								second=0;
-							}
-						}
-						else second = 0xF;
-						
-						b  = (first & 0xF);
-						b |= (second & 0xF) << 4;
-						fprintf(tf," 0x%x,",b);
-					}
-					c++;
-				}
-				fprintf(tf,"\t\t //tile:%i\n",t);
-				t++;
+
+			if(xform.compressMaps){
+				fprintf(tf,",");
+				writeBytes(tf,data);
 			}
 			fprintf(tf,"};\n\n");
-			totalSize+=(uniqueTiles.size()*xform.tileHeight*xform.tileHeight/2);
-			
-			if(invalidColor){
-				printf("Warning: colors in input image not included in palette");
-			}
 		}
-	}else if(strcmp(xform.outputType,"mode13-extended")==0){
-		if(xform.palette.numColors == 0) {
-			printf("Error using extendedPalette but no palette specified!\n");
+	}
+
+	const char* type=xform.outputType==NULL?"8bpp":xform.outputType;
+
+	if(isDataTileType(type)){
+		if(strcmp(type,"8bpp")!=0 && strcmp(type,"1bpp")!=0 && xform.palette.numColors == 0) {
+			printf("Error using %s but no palette specified!\n",type);
 		}
 		else{
 			bool invalidColor=false;
-			
-			/*Export tileset in palette extended pixel format*/
-		    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),uniqueTiles.size());			
-		    fprintf(tf,"const char vector_table_filler[144] __attribute__ ((section (\".uze_progmem_origin\")))={};\n");
-		    fprintf(tf,"const char %s[] __attribute__ ((section (\".uze_progmem_origin\")))={\n",xform.tilesVarName);
-	
-			int c=0,t=0;
-			unsigned char b;
+			vector<unsigned char> tileData;
+			vector<int> tileStarts;
 			vector<unsigned char*>::iterator it;
 			for(it=uniqueTiles.begin();it < uniqueTiles.end();it++){
-				unsigned char* tile=*it;
-	
-				for(int y=0;y<xform.tileHeight;y++){
-					//pack 2 pixels in one byte
-					for(int x=0;x<xform.tileWidth;x+=2){
-						
-						int first = paletteIndexFromColor(tile[(y*xform.tileWidth)+x]);
-						int second = paletteIndexFromColor(tile[(y*xform.tileWidth)+x+1]);
-						
-						if(first == -1){
-							invalidColor=true;
-							first=0;
-						}
-						if(second == -1){
-							invalidColor=true;
-							second=0;
-						}
-						
-						b  = (first & 0xF);
-						b |= (second & 0xF) << 4;
-						b = PaletteConversionTable[b];
-						fprintf(tf," 0x%x,",b);
-					}
-					c++;
-				}
-				fprintf(tf,"\t\t //tile:%i\n",t);
-				t++;
-			}
-			fprintf(tf,"};\n\n");
-			totalSize+=(uniqueTiles.size()*xform.tileHeight*xform.tileHeight/2);
-			
-			if(invalidColor){
-				printf("Warning: Input image contains colors not included in palette. They will appear as color index 0.");
-			}
-		}
-	}else if(strcmp(xform.outputType,"1bpp")==0){
-
-		/*Export tileset in 1 bits per pixel format*/
-	    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),uniqueTiles.size());
-	    fprintf(tf,"const char %s[] PROGMEM={\n",xform.tilesVarName);
-
-		int c=0,t=0;
-		unsigned char b;
-		vector<unsigned char*>::iterator it;
-		for(it=uniqueTiles.begin();it < uniqueTiles.end();it++){
-
-			unsigned char* tile=*it;
-
-			for(int y=0;y<xform.tileHeight;y++){
-				if(c>0)fprintf(tf,",");
-
-				b=0;
-				//pack 8 pixels in one byte
-				for(int x=0;x<xform.tileWidth;x++){
-					if(tile[y*xform.tileWidth+x]!=0) b|=(0x80>>x);
-				}
-				fprintf(tf," 0x%x",b);
-				c++;
+				tileStarts.push_back(tileData.size());
+				if(!encodeTile(type,*it,tileData)) invalidColor=true;
 			}
-			fprintf(tf,"\t\t //tile:%i\n",t);
-			t++;
-		}
-		fprintf(tf,"};\n");
-		totalSize+=(uniqueTiles.size()*xform.tileHeight*xform.tileHeight);
-
-	}else if(xform.outputType!=NULL && (strcmp(xform.outputType,"code")==0 || strcmp(xform.outputType,"code60")==0)){
-
-		/*export "code tiles"*/
-		fprintf(tf,"#if !(VIDEO_MODE==9 && RESOLUTION==60) \r\n#error The included code-tiles data is only compatible with video mode 9 with 60 columns.\r\n#endif\r\n");
-	    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),uniqueTiles.size());
-	    fprintf(tf,"const char %s[] PROGMEM __attribute__ ((aligned (4))) ={\n",xform.tilesVarName);
+			tileStarts.push_back(tileData.size());
+			tilesetSize=tileData.size();
 
-		int c=0,t=0;
-		vector<unsigned char*>::iterator it;
-		for(it=uniqueTiles.begin();it < uniqueTiles.end();it++){
+			/*Export tileset in the requested bits per pixel format*/
+		    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),(int)uniqueTiles.size());
 
-			unsigned char* tile=*it;
-			int pos;
+			if(xform.compressTiles){
+				vector<unsigned char> packed;
+				packRle(tileData,packed);
 
-			for(int index=0;index<xform.tileHeight;index++){
-				if(c>0)fprintf(tf,",");
-				pos=xform.tileWidth*index;
-
-				//unsigned char col=tile[pos];
-
-				//pixel 0
-				if(xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]){
-					fprintf(tf,"0x02,0x2D,"); 										//08 b9       	mov r16,r2
-				}else{
-					fprintf(tf,"0x%x,0x%x,",tile[pos]&0xf,0xe0|(tile[pos]>>4)); 	//01 e0       	ldi	r16, pixel color	; 1
-				}
-				fprintf(tf,"0x08,0xb9,"); 											//08 b9       	out	0x08, r16
-				fprintf(tf,"0x19,0x91,"); 											//19 91       	ld	r17, Y+
-				pos++;
-
-				//pixel 1
-				if(xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]){
-					fprintf(tf,"0x02,0x2D,"); 										//08 b9       	mov r16,r2
+			    fprintf(tf,"#define %s_UNPACKED_SIZE %i\n",toUpperCase(xform.tilesVarName),(int)tileData.size());
+			    fprintf(tf,"//RLE packed, see RleUnpack()\n");
+				if(bf!=NULL){
+					writeBinaryArray(tf,bf,"char",xform.tilesVarName,".progmem.data",1,packed);
 				}else{
-					fprintf(tf,"0x%x,0x%x,",tile[pos]&0xf,0xe0|(tile[pos]>>4)); 	//01 e0       	ldi	r16, pixel color	; 1
+				    fprintf(tf,"const char %s[] PROGMEM={",xform.tilesVarName);
+					writeBytes(tf,packed);
+					fprintf(tf,"};\n");
 				}
-				fprintf(tf,"0x08,0xb9,"); 											//08 b9       	out	0x08, r16
-				fprintf(tf,"0x15,0x9f,");									 		//15 9f       	mul	r17, r21
-				pos++;
+				totalSize+=packed.size();
+				printf("Tiles packed from %i to %i bytes\n",(int)tileData.size(),(int)packed.size());
 
-				//pixel 2
-				if(xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]){
-					fprintf(tf,"0x02,0x2D,"); 										//08 b9       	mov r16,r2
-				}else{
-					fprintf(tf,"0x%x,0x%x,",tile[pos]&0xf,0xe0|(tile[pos]>>4)); 	//01 e0       	ldi	r16, pixel color	; 1
-				}
-				fprintf(tf,"0x08,0xb9,"); 											//08 b9       	out	0x08, r16
-				fprintf(tf,"0x08,0x0e,"); 											//08 0e       	add	r0, r24
-				fprintf(tf,"0x19,0x1e,"); 											//19 1e       	adc	r1, r25
-				pos++;
-
-				//pixel 3
-				if(xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]){
-					fprintf(tf,"0x02,0x2D,"); 										//08 b9       	mov r16,r2
-				}else{
-					fprintf(tf,"0x%x,0x%x,",tile[pos]&0xf,0xe0|(tile[pos]>>4)); 	//01 e0       	ldi	r16, pixel color	; 1
-				}
-				fprintf(tf,"0x08,0xb9,"); 											//08 b9       	out	0x08, r16
-				fprintf(tf,"0xf9,0x01,"); 											//f9 01       	movw r30, r18
-				fprintf(tf,"0x4a,0x95,"); 											//4a 95       	dec	r20
-				pos++;
-
-				//pixel 4
-				if(xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]){
-					fprintf(tf,"0x02,0x2D,"); 										//08 b9       	mov r16,r2
-				}else{
-					fprintf(tf,"0x%x,0x%x,",tile[pos]&0xf,0xe0|(tile[pos]>>4)); 	//01 e0       	ldi	r16, pixel color	; 1
+			}else{
+				if(bf==NULL && ((strcmp(type,"3bpp")==0 && xform.isBackgroundTiles) || strcmp(type,"mode13-extended")==0)){
+				    fprintf(tf,"const char vector_table_filler[144] __attribute__ ((section (\".uze_progmem_origin\")))={};\n");
 				}
-				fprintf(tf,"0x08,0xb9,"); 											//08 b9       	out	0x08, r16
-				fprintf(tf,"0x09,0xf0,");											//09 f0       	breq	.+2
-				fprintf(tf,"0xf0,0x01,"); 											//f0 01       	movw	r30, r0
-				pos++;
-
-				//pixel 5
-				if(xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]){
-					fprintf(tf,"0x02,0x2D,"); 										//08 b9       	mov r16,r2
+				if(bf!=NULL){
+					const char* section=".progmem.data";
+					if(strcmp(type,"3bpp")==0 && xform.isBackgroundTiles){
+						section="uze_progmem_origin";
+					}else if(strcmp(type,"mode13-extended")==0){
+						section=".uze_progmem_origin";
+					}
+					writeBinaryArray(tf,bf,"char",xform.tilesVarName,section,1,tileData,strcmp(section,".progmem.data")!=0?144:0);
 				}else{
-					fprintf(tf,"0x%x,0x%x,",tile[pos]&0xf,0xe0|(tile[pos]>>4)); 	//01 e0       	ldi	r16, pixel color	; 1
+					if(strcmp(type,"3bpp")==0 && xform.isBackgroundTiles){
+						fprintf(tf,"const char %s[] __attribute__ ((section (\"uze_progmem_origin\")))={\n",xform.tilesVarName);
+					}else if(strcmp(type,"mode13-extended")==0){
+					    fprintf(tf,"const char %s[] __attribute__ ((section (\".uze_progmem_origin\")))={\n",xform.tilesVarName);
+					}else if(strcmp(type,"8bpp")==0 || strcmp(type,"1bpp")==0){
+					    fprintf(tf,"const char %s[] PROGMEM={\n",xform.tilesVarName);
+					}else{
+						fprintf(tf,"const char %s[] PROGMEM ={\n",xform.tilesVarName);
+					}
+
+					//packed formats end every byte with a comma
+					bool packedPixels=strcmp(type,"8bpp")!=0 && strcmp(type,"1bpp")!=0;
+					for(unsigned int t=0;t<uniqueTiles.size();t++){
+						for(int i=tileStarts[t];i<tileStarts[t+1];i++){
+							if(packedPixels){
+								fprintf(tf," 0x%x,",tileData[i]);
+							}else{
+								if(i>0)fprintf(tf,",");
+								fprintf(tf," 0x%x",tileData[i]);
+							}
+						}
+						fprintf(tf,"\t\t //tile:%i\n",t);
+					}
+					fprintf(tf,packedPixels?"};\n\n":"};\n");
 				}
-				fprintf(tf,"0x08,0xb9,"); 											//08 b9       	out	0x08, r16
-				fprintf(tf,"0x09,0x94 "); 											//09 94       	ijmp
+				totalSize+=tileData.size();
+			}
 
-				c++;
+			if(invalidColor){
+				printf("Warning: Input image contains colors not included in palette. They will appear as color index 0.\n");
 			}
-			fprintf(tf,"\t\t //tile:%i\n",t);
-			t++;
 		}
-		fprintf(tf,"};\n");
-		totalSize+=(uniqueTiles.size()*xform.tileHeight*21*2);
-	
-	}else if(xform.outputType!=NULL && strcmp(xform.outputType,"code80")==0){
+	}else if(strcmp(type,"code")==0 || strcmp(type,"code60")==0 || strcmp(type,"code80")==0){
+		int columns=strcmp(type,"code80")==0?80:60;
 
 		/*export "code tiles"*/
-		fprintf(tf,"#if !(VIDEO_MODE==9 && RESOLUTION==80) \r\n#error The included code-tiles data is only compatible with video mode 9 with 80 columns.\r\n#endif\r\n");
+		fprintf(tf,"#if !(VIDEO_MODE==9 && RESOLUTION==%i) \r\n#error The included code-tiles data is only compatible with video mode 9 with %i columns.\r\n#endif\r\n",columns,columns);
 	    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.tilesVarName),uniqueTiles.size());
-	    fprintf(tf,"const char %s[] PROGMEM __attribute__ ((aligned (2))) ={\n",xform.tilesVarName);
-
-		int c=0,t=0;
-		vector<unsigned char*>::iterator it;
-		for(it=uniqueTiles.begin();it < uniqueTiles.end();it++){
 
-			unsigned char* tile=*it;
-			int pos;
+		vector<unsigned char> tileData;
+		vector<int> tileStarts;
+		int usualRowWords=columns==60?21:15;
+		int rowWords=usualRowWords;
+		if(xform.compactCodeTiles){
+			rowWords=encodeCompactCodeTiles(type,uniqueTiles,tileData);
+			for(unsigned int t=0;t<=uniqueTiles.size();t++) tileStarts.push_back(t*rowWords*2*xform.tileHeight);
 
-			for(int index=0;index<xform.tileHeight;index++){
-				if(c>0)fprintf(tf,",");
-				pos=xform.tileWidth*index;
-
-				/*
-				Generate assembly code (pixel color control if r2 (bg) or r3 (fg) is assembled):
-				
-				out 0x08,r2
-				ld	r17, Y+
-
-				out 0x08,r3
-				mul	r17, r21
-
-				out 0x08,r2
-				add	r0, r24
-				adc	r1, r25
-
-				out 0x08,r3
-				movw r30, r18
-				dec	r20
+			//the kernel finds rows with it
+		    fprintf(tf,"#if FONT_TILE_WIDTH!=%i\n#error These code tiles have rows of %i words, the kernel needs -DFONT_TILE_WIDTH=%i.\n#endif\n",rowWords,rowWords,rowWords);
+		}else{
+			for(unsigned int t=0;t<uniqueTiles.size();t++){
+				tileStarts.push_back(tileData.size());
+				encodeCodeTile(type,uniqueTiles[t],tileData);
+			}
+			tileStarts.push_back(tileData.size());
+		}
+		tilesetSize=tileData.size();
 
-				out 0x08,r2
-				breq	.+2
-				movw	r30, r0
+		printf("Code tile rows: %i words",rowWords);
+		if(rowWords!=usualRowWords){
+			printf(" instead of %i, saving %i bytes",usualRowWords,(usualRowWords-rowWords)*2*xform.tileHeight*(int)uniqueTiles.size());
+		}
+		printf("\nCode tiles flash: %i bytes\n",(int)tileData.size());
+
+		if(columns==60){
+			//the colors background-color and foreground-color would best take from r2 and r3
+			vector<pair<int,int> > uses(256);
+			for(int c=0;c<256;c++) uses[c]=make_pair(0,c);
+			for(unsigned int t=0;t<uniqueTiles.size();t++){
+				for(int i=0;i<xform.tileWidth*xform.tileHeight;i++) uses[uniqueTiles[t][i]].first++;
+			}
+			sort(uses.rbegin(),uses.rend());
+			printf("Most used colors: %i (%i pixels), %i (%i pixels)\n",uses[0].second,uses[0].first,uses[1].second,uses[1].first);
+		}
 
-				out 0x08,r3
-				ijmp
-				*/
-				
+		//the kernel jumps to tiles by their index, so they need to be aligned
+		if(bf!=NULL){
+			writeBinaryArray(tf,bf,"char",xform.tilesVarName,".progmem.data",columns==60?4:2,tileData);
+		}else{
+		    fprintf(tf,"const char %s[] PROGMEM __attribute__ ((aligned (%i))) ={\n",xform.tilesVarName,columns==60?4:2);
 
-				//pixel 0
-				if((xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]) || tile[pos]==0){
-					fprintf(tf,"0x28,0xb8,"); 										//28 b8			out 0x08,r2
-				}else{
-					fprintf(tf,"0x38,0xb8,"); 										//38 b8			out 0x08,r3
-				}				
-				fprintf(tf,"0x19,0x91,"); 											//19 91       	ld	r17, Y+
-				pos++;
-
-				//pixel 1
-				if((xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]) || tile[pos]==0){
-					fprintf(tf,"0x28,0xb8,"); 										//28 b8			out 0x08,r2
-				}else{
-					fprintf(tf,"0x38,0xb8,"); 										//38 b8			out 0x08,r3
-				}	
-				fprintf(tf,"0x15,0x9f,");									 		//15 9f       	mul	r17, r21
-				pos++;
-
-				//pixel 2
-				if((xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]) || tile[pos]==0){
-					fprintf(tf,"0x28,0xb8,"); 										//28 b8			out 0x08,r2
-				}else{
-					fprintf(tf,"0x38,0xb8,"); 										//38 b8			out 0x08,r3
-				}	
-				fprintf(tf,"0x08,0x0e,"); 											//08 0e       	add	r0, r24
-				fprintf(tf,"0x19,0x1e,"); 											//19 1e       	adc	r1, r25
-				pos++;
-
-				//pixel 3
-				if((xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]) || tile[pos]==0){
-					fprintf(tf,"0x28,0xb8,"); 										//28 b8			out 0x08,r2
-				}else{
-					fprintf(tf,"0x38,0xb8,"); 										//38 b8			out 0x08,r3
-				}	
-				fprintf(tf,"0xf9,0x01,"); 											//f9 01       	movw r30, r18
-				fprintf(tf,"0x4a,0x95,"); 											//4a 95       	dec	r20
-				pos++;
-
-				//pixel 4
-				if((xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]) || tile[pos]==0){
-					fprintf(tf,"0x28,0xb8,"); 										//28 b8			out 0x08,r2
-				}else{
-					fprintf(tf,"0x38,0xb8,"); 										//38 b8			out 0x08,r3
-				}	
-				fprintf(tf,"0x09,0xf0,");											//09 f0       	breq	.+2
-				fprintf(tf,"0xf0,0x01,"); 											//f0 01       	movw	r30, r0
-				pos++;
-
-				//pixel 5
-				if((xform.backgroundColor!=-1 && xform.backgroundColor==tile[pos]) || tile[pos]==0){
-					fprintf(tf,"0x28,0xb8,"); 										//28 b8			out 0x08,r2
-				}else{
-					fprintf(tf,"0x38,0xb8,"); 										//38 b8			out 0x08,r3
+			int rowSize=rowWords*2;	//bytes of code per tile row
+			for(unsigned int t=0;t<uniqueTiles.size();t++){
+				for(int i=tileStarts[t];i<tileStarts[t+1];i++){
+					if(i>0 && (i-tileStarts[t])%rowSize==0) fprintf(tf,",");
+					fprintf(tf,(i+1-tileStarts[t])%rowSize==0?"0x%x ":"0x%x,",tileData[i]);
 				}
-				fprintf(tf,"0x09,0x94 "); 											//09 94       	ijmp
-
-				c++;
+				fprintf(tf,"\t\t //tile:%i\n",t);
 			}
-			fprintf(tf,"\t\t //tile:%i\n",t);
-			t++;
+			fprintf(tf,"};\n");
 		}
-		fprintf(tf,"};\n");
-		totalSize+=(uniqueTiles.size()*xform.tileHeight*21*2);
+		totalSize+=tileData.size();
 	}
 	
 	if(xform.palette.varName && xform.palette.exportPalette){
 		int b,c;
 	    fprintf(tf,"#define %s_SIZE %i\n",toUpperCase(xform.palette.varName),xform.palette.numColors);
-	    fprintf(tf,"const unsigned char %s[] PROGMEM={\n",xform.palette.varName);
-		for(c=0;c < xform.palette.numColors;c++){
-			if(c>0)fprintf(tf,",");
-			b=xform.palette.colors[c];
-			fprintf(tf," 0x%x",b);
+		if(bf!=NULL){
+			vector<unsigned char> data(xform.palette.colors,xform.palette.colors+xform.palette.numColors);
+			writeBinaryArray(tf,bf,"unsigned char",xform.palette.varName,".progmem.data",1,data);
+		}else{
+		    fprintf(tf,"const unsigned char %s[] PROGMEM={\n",xform.palette.varName);
+			for(c=0;c < xform.palette.numColors;c++){
+				if(c>0)fprintf(tf,",");
+				b=xform.palette.colors[c];
+				fprintf(tf," 0x%x",b);
+			}
+			fprintf(tf,"\n};\n");
 		}
-		fprintf(tf,"\n};\n");
 		totalSize+=xform.palette.numColors;
 	}
 	
 	fclose(tf);
-	free(image.buffer);
+	if(bf!=NULL) fclose(bf);
+	for(unsigned int i=0;i<images.size();i++){
+		free(images[i].buffer);
+	}
 	printf("File exported successfully!\nUnique tiles found: %i\nTotal size (tiles + maps): %i bytes\n",uniqueTiles.size(),totalSize);
+	if(xform.removeMirroredTiles){
+		printf("Tiles stored as a mirror of another: %i\n",mirrored);
+	}
+	if(xform.inputsCount>1 && uniqueTiles.size()>0){
+		int shared=separateTiles-uniqueTiles.size();
+		printf("Tiles shared between inputs: %i, saving %i bytes over a tileset each\n",shared,shared*(tilesetSize/(int)uniqueTiles.size()));
+	}
 
 
 	return true;
@@ -830,33 +1348,71 @@ void parseXml(TiXmlDocument* doc){
 	//root
 	TiXmlElement* root=doc->RootElement();
 	root->QueryIntAttribute("version",&xform.version);
-	//input
-	TiXmlElement* input=root->FirstChildElement("input");
-	xform.inputFile=input->Attribute("file");
-	input->QueryIntAttribute("width",&xform.width);
-	input->QueryIntAttribute("height",&xform.height);
-	input->QueryIntAttribute("tileset-height",&xform.tilesetHeight);
-	input->QueryIntAttribute("tile-width",&xform.tileWidth);
-	input->QueryIntAttribute("tile-height",&xform.tileHeight);
-	xform.inputType=input->Attribute("type");
+	//inputs, the first one gives the tile size
+	TiXmlElement* input;
+	for(input=root->FirstChildElement("input");input;input=input->NextSiblingElement("input")) xform.inputsCount++;
+	xform.inputs=new Input[xform.inputsCount];
+	memset(xform.inputs,0,sizeof(Input)*xform.inputsCount);
+
+	Input* in=xform.inputs;
+	for(input=root->FirstChildElement("input");input;input=input->NextSiblingElement("input"),in++){
+		in->file=input->Attribute("file");
+		input->QueryIntAttribute("width",&in->width);
+		input->QueryIntAttribute("height",&in->height);
+		input->QueryIntAttribute("tileset-height",&in->tilesetHeight);
+		in->tileWidth=xform.tileWidth;
+		in->tileHeight=xform.tileHeight;
+		input->QueryIntAttribute("tile-width",&in->tileWidth);
+		input->QueryIntAttribute("tile-height",&in->tileHeight);
+		if(in==xform.inputs){
+			xform.tileWidth=in->tileWidth;
+			xform.tileHeight=in->tileHeight;
+		}
+		in->type=input->Attribute("type");
+		const char* dither=input->Attribute("dither");
+		if(dither==NULL || strcmp(dither,"none")==0){
+			in->dither=DITHER_NONE;
+		}else if(strcmp(dither,"ordered")==0){
+			in->dither=DITHER_ORDERED;
+		}else if(strcmp(dither,"floyd-steinberg")==0){
+			in->dither=DITHER_FLOYD_STEINBERG;
+		}else{
+			printf("Warning: Unknown dither '%s', valid values are 'none', 'ordered' and 'floyd-steinberg'.\n",dither);
+		}
+	}
 
 	//output
 	TiXmlElement* output=root->FirstChildElement("output");
 	xform.outputFile=output->Attribute("file");
+	xform.binaryFile=output->Attribute("binary-file");
 	TiXmlElement* tiles=output->FirstChildElement("tiles");
 	xform.tilesVarName=tiles->Attribute("var-name");
+	const char* compression=tiles->Attribute("compression");
+	xform.compressTiles=compression!=NULL && strcmp(compression,"rle")==0;
     xform.outputType=output->Attribute("type");
 	const char* isBackgroundTiles=output->Attribute("isBackgroundTiles");
     xform.isBackgroundTiles=isBackgroundTiles && (isBackgroundTiles!=NULL && strstr(isBackgroundTiles,"true"));
 	if(output->QueryIntAttribute("background-color",&xform.backgroundColor)==TIXML_NO_ATTRIBUTE){
 		xform.backgroundColor=-1;
 	}
+	if(output->QueryIntAttribute("foreground-color",&xform.foregroundColor)==TIXML_NO_ATTRIBUTE){
+		xform.foregroundColor=-1;
+	}
+	const char* compact=output->Attribute("compact-code-tiles");
+	xform.compactCodeTiles=compact!=NULL && strstr(compact,"true");
 	const char* dups=output->Attribute("remove-duplicate-tiles");
 	if(dups!=NULL && strstr(dups,"false")){
 		xform.removeDuplicateTiles=false;
 	}else{
 		xform.removeDuplicateTiles=true; //default value
 	}
+	const char* order=output->Attribute("order-tiles");
+	xform.orderTilesByUsage=order!=NULL && strcmp(order,"usage")==0;
+	const char* mirrored=output->Attribute("remove-mirrored-tiles");
+	xform.removeMirroredTiles=mirrored!=NULL && strstr(mirrored,"true");
+	if(xform.removeMirroredTiles){
+		xform.removeDuplicateTiles=true; //a mirror is a duplicate too
+	}
 
 	//palette
 	TiXmlElement* paletteElem=output->FirstChildElement("palette");
@@ -866,15 +1422,15 @@ void parseXml(TiXmlDocument* doc){
 		xform.palette.varName=paletteElem->Attribute("var-name");
 		const char* exportPalette=paletteElem->Attribute("exportPalette");
 		xform.palette.exportPalette=exportPalette && strstr(exportPalette,"true");
-		if(paletteElem->QueryIntAttribute("transparent-color",&xform.palette.transparentColor)==TIXML_NO_ATTRIBUTE){
-			xform.palette.transparentColor=254;
-		}
+		paletteElem->QueryIntAttribute("transparent-color",&xform.palette.transparentColor);
 	}
 
 	//maps
 	TiXmlElement* mapsElem=output->FirstChildElement("maps");
 	if(mapsElem!=NULL){
 		mapsElem->QueryIntAttribute("pointers-size",&xform.mapsPointersSize);
+		const char* compression=mapsElem->Attribute("compression");
+		xform.compressMaps=compression!=NULL && strcmp(compression,"rle")==0;
 
 		//count # of map sub-elements
 		const TiXmlNode* node;
@@ -887,6 +1443,12 @@ void parseXml(TiXmlDocument* doc){
 		for(node=mapsElem->FirstChild("map");node;node=node->NextSibling("map")){
 			maps[mapCount].varName=node->ToElement()->Attribute("var-name");
 
+			const char* input=node->ToElement()->Attribute("input");
+			maps[mapCount].input=input==NULL?0:-1;
+			for(int i=0;i<xform.inputsCount && input!=NULL;i++){
+				if(strcmp(xform.inputs[i].file,input)==0) maps[mapCount].input=i;
+			}
+
 			node->ToElement()->QueryIntAttribute("top",&maps[mapCount].top);
 			node->ToElement()->QueryIntAttribute("left",&maps[mapCount].left);
 			node->ToElement()->QueryIntAttribute("width",&maps[mapCount].width);
@@ -905,18 +1467,18 @@ void parseXml(TiXmlDocument* doc){
 }
 
 //load image in a byte arrays
-unsigned char* loadRawImage(){
-	unsigned int fileSize=xform.width*xform.height;
+unsigned char* loadRawImage(Input* input){
+	unsigned int fileSize=input->width*input->height;
 
 	unsigned char* buffer=new unsigned char[fileSize];
 	FILE* inputFile;
     size_t ret;
 
     //Load input image to buffer
-	inputFile=fopen(xform.inputFile,"rb");
+	inputFile=fopen(input->file,"rb");
 	if (!inputFile)
 	{
-		printf("Error: Unable to open input file %s\n", xform.inputFile);
+		printf("Error: Unable to open input file %s\n", input->file);
 		return NULL;
 	}
 
@@ -930,41 +1492,136 @@ unsigned char* loadRawImage(){
 	return buffer;
 }
 
-void loadPalette(){
+/*
+ * Turns RGBA pixels into Uzebox colors (BBGGGRRR). Channels are rounded to the
+ * nearest level of the DAC through a table, optionally dithered, and mostly
+ * transparent pixels get the transparent color.
+ */
+void quantize(unsigned char* rgba,unsigned char* out,int width,int height,int dither){
+	static const int levels[3]={8,8,4};
+	static const int shifts[3]={0,3,6};
+	static const int bayer[4][4]={{0,8,2,10},{12,4,14,6},{3,11,1,9},{15,7,13,5}};
+	int value[3][8];
+	unsigned char nearest[3][256];
+
+	for(int c=0;c<3;c++){
+		//the same levels as the emulator shows
+		for(int l=0;l<levels[c];l++) value[c][l]=l*255/(levels[c]-1);
+		for(int v=0,l=0;v<256;v++){
+			if(l+1<levels[c] && v-value[c][l]>value[c][l+1]-v) l++;
+			nearest[c][v]=l;
+		}
+	}
+
+	//Floyd-Steinberg errors of this row and the next, with a pixel of margin on both sides
+	vector<int> errors[2];
+	errors[0].assign((width+2)*3,0);
+	errors[1].assign((width+2)*3,0);
+
+	for(int y=0;y<height;y++){
+		vector<int> &error=errors[y&1],&below=errors[(y+1)&1];
+		fill(below.begin(),below.end(),0);
+
+		for(int x=0;x<width;x++){
+			unsigned char* pixel=&rgba[(y*width+x)*4];
+			if(pixel[3]<128){
+				*out++=xform.palette.transparentColor;
+				continue;
+			}
+
+			unsigned char color=0;
+			for(int c=0;c<3;c++){
+				int v=pixel[c];
+				if(dither==DITHER_ORDERED){
+					//spread over the 16 thresholds between two levels
+					v+=(2*bayer[y&3][x&3]-15)*(255/(levels[c]-1))/32;
+				}else if(dither==DITHER_FLOYD_STEINBERG){
+					v+=error[(x+1)*3+c]/16;
+				}
+				v=v<0?0:(v>255?255:v);
+
+				int l=nearest[c][v];
+				color|=l<<shifts[c];
+
+				if(dither==DITHER_FLOYD_STEINBERG){
+					int e=v-value[c][l];
+					error[(x+2)*3+c]+=e*7;
+					below[x*3+c]+=e*3;
+					below[(x+1)*3+c]+=e*5;
+					below[(x+2)*3+c]+=e;
+				}
+			}
+			*out++=color;
+		}
+	}
+}
+
+/*
+ * Loads a PNG as Uzebox colors. An 8 bit palette PNG holds them as its color
+ * indexes, any other kind (8 bit greyscale too) is converted from its RGB
+ * values.
+ */
+unsigned char* loadPng(const char* filename,const char* what,int* width,int* height,int dither){
 
 	  unsigned char* buffer;
 	  unsigned char* image;
 	  size_t buffersize, imagesize;
 	  LodePNG_Decoder decoder;
 
-	  LodePNG_loadFile(&buffer, &buffersize, xform.palette.filename); /*load the image file with given filename*/
+	  LodePNG_loadFile(&buffer, &buffersize, filename); /*load the image file with given filename*/
 	  LodePNG_Decoder_init(&decoder);
 	  decoder.settings.color_convert=0; //dont't convert to RGBA
 	  LodePNG_decode(&decoder, &image, &imagesize, buffer, buffersize); /*decode the png*/
 
+	  const LodePNG_InfoColor* color=&decoder.infoPng.color;
+	  if(!decoder.error && !(color->colorType==3 && color->bitDepth==8)){
+		  //not indexes, decode again as RGBA
+		  free(image);
+		  LodePNG_Decoder_cleanup(&decoder);
+		  LodePNG_Decoder_init(&decoder);
+		  LodePNG_decode(&decoder, &image, &imagesize, buffer, buffersize);
+
+		  if(!decoder.error){
+			  unsigned char* rgba=image;
+			  image=(unsigned char*)malloc(decoder.infoPng.width*decoder.infoPng.height);
+			  quantize(rgba,image,decoder.infoPng.width,decoder.infoPng.height,dither);
+			  free(rgba);
+			  printf("%s: converted from %i bits per pixel to the Uzebox colors\n",what,LodePNG_InfoColor_getBpp(&decoder.infoPng.color));
+		  }
+	  }
+
 	  if(decoder.error){
 		  if(decoder.error==48){
-			  printf("Error in decoding palette PNG: the input data is empty. Maybe a PNG file you tried to load doesn't exist or is in the wrong path.\n");
+			  printf("Error in decoding %s: the input data is empty. Maybe a PNG file you tried to load doesn't exist or is in the wrong path.\n",what);
 		  }else{
-			  printf("Error in decoding palette PNG: %d\n", decoder.error);
+			  printf("Error in decoding %s: %d\n",what,decoder.error);
 		  }
 		  /*cleanup decoder*/
 		  free(buffer);
 		  free(image);
 		  LodePNG_Decoder_cleanup(&decoder);
-		  return;
+		  return NULL;
 	  }
 
-	  if( LodePNG_InfoColor_getBpp(&decoder.infoPng.color)!=8){
-		  printf("Error: Invalid palette PNG image type. Must be PNG-8 with a 256 colors palette.\n");
-		  /*cleanup decoder*/
-		  free(buffer);
-		  free(image);
-		  LodePNG_Decoder_cleanup(&decoder);
+	  *width=decoder.infoPng.width;
+	  *height=decoder.infoPng.height;
+
+	  /*cleanup decoder*/
+	  free(buffer);
+	  LodePNG_Decoder_cleanup(&decoder);
+
+	  return image;
+}
+
+void loadPalette(){
+
+	  int width,height;
+	  unsigned char* image=loadPng(xform.palette.filename,"palette PNG",&width,&height,DITHER_NONE);
+	  if(image==NULL){
 		  return;
 	  }
 
-	  for(unsigned int n = 0; n < imagesize; n++){
+	  for(int n = 0; n < width*height; n++){
 		  int paletteIndex = paletteIndexFromColor(image[n]);
 		  if(paletteIndex == -1 && image[n] != xform.palette.transparentColor){
 			  if(xform.palette.numColors == xform.palette.maxColors){
@@ -972,76 +1629,34 @@ void loadPalette(){
 			  }
 			  else {
 			  	xform.palette.colors[xform.palette.numColors] = image[n];
+			  	xform.palette.indexes[image[n]] = xform.palette.numColors;
 			  	xform.palette.numColors++;
 			  }
 		  }	  
 	  }
 
-	  /*cleanup decoder*/
-	  free(buffer);
-	  LodePNG_Decoder_cleanup(&decoder);
-
 	  free(image);
 }
 
-unsigned char* loadPngImage(){
-
-	  unsigned char* buffer;
-	  unsigned char* image;
-	  size_t buffersize, imagesize;
-	  LodePNG_Decoder decoder;
-
-	  LodePNG_loadFile(&buffer, &buffersize, xform.inputFile); /*load the image file with given filename*/
-	  LodePNG_Decoder_init(&decoder);
-	  decoder.settings.color_convert=0; //dont't convert to RGBA
-	  LodePNG_decode(&decoder, &image, &imagesize, buffer, buffersize); /*decode the png*/
-
-	  if(decoder.error){
-		  if(decoder.error==48){
-			  printf("Error in decoding PNG: the input data is empty. Maybe a PNG file you tried to load doesn't exist or is in the wrong path.\n");
-		  }else{
-			  printf("Error in decoding PNG: %d\n", decoder.error);
-		  }
-		  /*cleanup decoder*/
-		  free(buffer);
-		  free(image);
-		  LodePNG_Decoder_cleanup(&decoder);
-		  return NULL;
-	  }
-
-	  if( LodePNG_InfoColor_getBpp(&decoder.infoPng.color)!=8){
-		  printf("Error: Invalid PNG image type. Must be PNG-8 with a 256 colors palette.\n");
-		  /*cleanup decoder*/
-		  free(buffer);
-		  free(image);
-		  LodePNG_Decoder_cleanup(&decoder);
-		  return NULL;
-	  }
-
-	  xform.width=decoder.infoPng.width;
-	  xform.height=decoder.infoPng.height;
-
-	  /*cleanup decoder*/
-	  free(buffer);
-	  LodePNG_Decoder_cleanup(&decoder);
-
-	return image;
+unsigned char* loadPngImage(Input* input){
+	//also sets its height and width
+	return loadPng(input->file,"PNG",&input->width,&input->height,input->dither);
 }
 
-unsigned char* loadImage(){
+unsigned char* loadImage(Input* input){
 	unsigned char* buffer;
 
 	//load the source image
-	if(strcmp(xform.inputType,"raw")==0){
-		buffer=loadRawImage();
+	if(strcmp(input->type,"raw")==0){
+		buffer=loadRawImage(input);
 
-	}else if(strcmp(xform.inputType,"png")==0){
-		//load image and set height and width in xform struct
-		buffer=loadPngImage();
+	}else if(strcmp(input->type,"png")==0){
+		//load image and set its height and width
+		buffer=loadPngImage(input);
 
 	}else{
-		printf( "Unsupported input file type '%s'. Valid values: 'raw' and 'png' \n", xform.inputType );
-		return false;
+		printf( "Unsupported input file type '%s'. Valid values: 'raw' and 'png' \n", input->type );
+		return NULL;
 	}
 
 	return buffer;
@@ -25,6 +25,29 @@
  * Revisions:
  * ----------
  * 1.3: 4/9/2012 - Fixed parse_hex_nibble bug (s >= 'a' && s <= 'f')
+ * 1.4: Added -c to write version 2 files with LZ compressed blocks
+ * 1.5: HEX files are read with uzem's loader: checksums are verified,
+ *      extended address records are supported and the used ranges reported
+ */
+
+/* Version 2 .UZE files keep the version 1 header, with progSize and crc32
+ * describing the unpacked program, and store the program as a sequence of
+ * blocks, each unpacking to PACK_BLOCK_SIZE bytes (the last one may be
+ * shorter). Every block starts with an 8 byte little endian header:
+ *
+ *   u16 size    - unpacked size of the block
+ *   u16 packed  - bytes of block data following this header
+ *   u32 crc32   - CRC32 of the unpacked block
+ *
+ * When packed equals size the block is stored as is, otherwise it is a
+ * stream of tokens:
+ *
+ *   0x00-0x7f  literal run, the next (token+1) bytes are copied to the output
+ *   0x80-0xff  match, a little endian u16 distance follows and (token-0x80+4)
+ *              bytes are copied from that distance back in the output
+ *
+ * A match may reach back into any previous block, so a loader writing
+ * straight to flash only needs to buffer the page being filled.
  */
 
 #include <iostream>
@@ -33,14 +56,26 @@
 #include <string.h>
 #include <stdint.h>
 #include <fstream>
+#include "hexloader.h"
 
 #define HEADER_VERSION 1
+#define HEADER_VERSION_PACKED 2
 #define VERSION_MAJOR 1
-#define VERSION_MINOR 3
+#define VERSION_MINOR 5
 #define MAX_PROG_SIZE 61440 //65536-4096
 #define HEADER_SIZE 512
 #define MARKER_SIZE 6
 
+#define PACK_BLOCK_SIZE 4096
+#define PACK_BLOCK_HEADER 8
+#define PACK_BLOCKS ((MAX_PROG_SIZE+PACK_BLOCK_SIZE-1)/PACK_BLOCK_SIZE)
+#define PACK_MIN_MATCH 4
+#define PACK_MAX_MATCH (0x7f+PACK_MIN_MATCH)
+#define PACK_MAX_LITERALS 0x80
+#define PACK_MAX_DISTANCE 0xffff
+#define PACK_HASH_BITS 14
+#define PACK_MAX_CHAIN 512
+
 #if defined (_MSC_VER) && _MSC_VER >= 1400
 // don't whine about sprintf and fopen.
 // could switch to sprintf_s but that's not standard.
@@ -69,6 +104,7 @@ typedef struct{
 	u32 crc32;
 	u8 mouse;
 	u8 description[64];
+	u32 packedSize;	//bytes of block data following the header (version 2)
 }RomHeader;
 
 union ROM{
@@ -79,6 +115,8 @@ union ROM{
 
 ROM rom;
 
+u8 packed[PACK_BLOCKS*(PACK_BLOCK_HEADER+PACK_BLOCK_SIZE)];
+
 /* crc_tab[] -- this crcTable is being build by chksum_crc32GenTab().
  *		so make sure, you call it before using the other
  *		functions!
@@ -146,115 +184,199 @@ static void strcpy2(char* dest, char* src, int maxsize)
 	}
 }
 
-static inline int parse_hex_nibble(char s)
+bool load_hex(const char *in_filename)
 {
-	if (s >= '0' && s <= '9')
-		return s - '0';
-	else if (s >= 'A' && s <= 'F')
-		return s - 'A' + 10;
-	else if (s >= 'a' && s <= 'f')
-		return s - 'a' + 10;
-	else
-		return -1;
-}
+	HexInfo info;
 
-static int parse_hex_byte(const char *s)
-{
-	return (parse_hex_nibble(s[0])<<4) | parse_hex_nibble(s[1]);
+	// Set entire memory out first in case new image is shorter than last one (0xff == NOP)
+	memset(rom.progmem+HEADER_SIZE, 0xff , MAX_PROG_SIZE);
+
+	if (!loadHexFile(in_filename, rom.progmem+HEADER_SIZE, MAX_PROG_SIZE, &info)) return false;
+
+	fprintf(stderr,"\tUsed ranges: ");
+	printHexRanges(stderr,&info);
+	fprintf(stderr,"\n");
+
+	if (info.dropped)
+	{
+		fprintf(stderr, "\n\t***Warning***: The hex file has %lu bytes after\n "
+			"\tthe 60KB mark, which are being ignored and is, probably, incompatible with the\n"
+			"\tbootloader. Note: This might not be a problem if your hex is a dump from the\n "
+			"\tchip's flash.\n\n", (long unsigned int) info.dropped);
+	}
+
+	rom.header.progSize=info.end;
+
+	return true;
 }
 
-static int parse_hex_word(const char *s)
+static void put16(u8 *p, u32 value)
 {
-	return (parse_hex_nibble(s[0])<<12) | (parse_hex_nibble(s[1]) << 8) |
-		(parse_hex_nibble(s[2])<<4) | parse_hex_nibble(s[3]);
+	p[0]=value;
+	p[1]=value>>8;
 }
 
-bool load_hex(const char *in_filename)
+static void put32(u8 *p, u32 value)
 {
-	
-	//http://en.wikipedia.org/wiki/.hex
+	put16(p,value);
+	put16(p+2,value>>16);
+}
 
-	//(I've added the spaces for clarity, they don't exist in the real files)
-	//:10 65B0 00 661F771F881F991F1A9469F760957095 59
-	//:10 65C0 00 809590959B01AC01BD01CF010895F894 91
-	//:02 65D0 00 FFCF FB
-	//:02 65D2 00 0100 C6
-	//:00 0000 01 FF [EOF marker]
+/* Hash chains over the whole program: head[] holds the latest position
+ * for each hash of PACK_MIN_MATCH bytes, chain[] the previous one with the
+ * same hash. Positions are inserted in order as the packer moves along.
+ */
+static int head[1<<PACK_HASH_BITS];
+static int chain[MAX_PROG_SIZE];
+static int inserted;
 
-	//First field is the byte count. Second field is the 16-bit address. Third field is the record type; 
-	//00 is data, 01 is EOF.	For record type zero, next "wide" field is the actual data, followed by a 
-	//checksum.
-	u16 progmemLast=0;
-	char line[128];
-	int lineNumber = 1;
-    bool warned = false;
+static inline u32 pack_hash(const u8 *p)
+{
+	u32 v = p[0] | (p[1]<<8) | (p[2]<<16) | ((u32)p[3]<<24);
+	return (v*2654435761u) >> (32-PACK_HASH_BITS);
+}
 
-	FILE *in_file = fopen(in_filename,"r");
+static void pack_insert(const u8 *data, int size, int pos)
+{
+	while(inserted < pos)
+	{
+		if(inserted+PACK_MIN_MATCH <= size)
+		{
+			u32 h=pack_hash(data+inserted);
+			chain[inserted]=head[h];
+			head[h]=inserted;
+		}
+		inserted++;
+	}
+}
 
+// Longest earlier match for the bytes at pos, not going past end
+static int pack_find(const u8 *data, int size, int pos, int end, int *distance)
+{
+	int best=0;
+	int max=end-pos;
+	if(max > PACK_MAX_MATCH) max=PACK_MAX_MATCH;
+	if(max < PACK_MIN_MATCH) return 0;
+
+	pack_insert(data,size,pos);
+	int candidate=head[pack_hash(data+pos)];
+	for(int steps=0; candidate>=0 && pos-candidate<=PACK_MAX_DISTANCE && steps<PACK_MAX_CHAIN; steps++)
+	{
+		int len=0;
+		while(len<max && data[candidate+len]==data[pos+len]) len++;
+		if(len>best)
+		{
+			best=len;
+			*distance=pos-candidate;
+			if(len==max) break;
+		}
+		candidate=chain[candidate];
+	}
+	return best;
+}
 
-	if (!in_file) return false;
+static u8 *pack_literals(u8 *out, const u8 *data, int count)
+{
+	while(count > 0)
+	{
+		int run = count < PACK_MAX_LITERALS? count : PACK_MAX_LITERALS;
+		*out++=run-1;
+		memcpy(out,data,run);
+		out+=run;
+		data+=run;
+		count-=run;
+	}
+	return out;
+}
 
-	// Set entire memory out first in case new image is shorter than last one (0xff == NOP)
-	memset(rom.progmem+HEADER_SIZE, 0xff , MAX_PROG_SIZE);
+/* pack_block() -- packs the block of the program going from start to end
+ *		into out, with one step lazy matching. Returns the packed
+ *		size, which is only meaningful when smaller than the block.
+ */
+static int pack_block(u8 *out, const u8 *data, int size, int start, int end)
+{
+	u8 *o=out;
+	int literals=start;
+	int pos=start;
 
-	while (fgets(line, sizeof(line), in_file) && line[0]==':')
+	while(pos < end)
 	{
-		int bytes = parse_hex_byte(line+1);
-		int addr = parse_hex_word(line+3);
-		int recordType = parse_hex_byte(line+7);
-		if (recordType == 0)
+		int distance=0,nextDistance=0;
+		int len=pack_find(data,size,pos,end,&distance);
+		if(len >= PACK_MIN_MATCH && len < PACK_MAX_MATCH &&
+			pack_find(data,size,pos+1,end,&nextDistance) > len)
 		{
-			char *lp = line + 9;
-			while (bytes > 0)
-			{
-                // Check if it went past the 60KB
-                if(addr < MAX_PROG_SIZE)
-                {
-                    rom.progmem[addr+HEADER_SIZE] = parse_hex_byte(lp);
-                    addr ++;
-                    if (addr > progmemLast){
-                        progmemLast = addr;
-                    }
-                }
-                else if(!warned)
-                {
-                    fprintf(stderr, "\n\t***Warning***: The hex file has instructions after\n "
-                        "\tthe 60KB mark, which are being ignored and is, probably, incompatible with the\n"
-                        "\tbootloader. Note: This might not be a problem if your hex is a dump from the\n "
-                        "\tchip's flash.\n\n");
-
-                    warned = true;
-                }
-
-				lp += 2;
-				bytes -= 1;
-			}
+			len=0;
 		}
-		else if (recordType == 1)
+		if(len < PACK_MIN_MATCH)
 		{
-			break;
+			pos++;
+			continue;
 		}
-		else
-			fprintf(stderr,"ignoring unknown record type %d in line %d of %s\n",recordType,lineNumber,in_filename);
 
-		++lineNumber;
+		o=pack_literals(o,data+literals,pos-literals);
+		*o++=0x80+len-PACK_MIN_MATCH;
+		put16(o,distance);
+		o+=2;
+		pos+=len;
+		literals=pos;
 	}
-    
-	rom.header.progSize=progmemLast;
+	o=pack_literals(o,data+literals,pos-literals);
+	return o-out;
+}
+
+/* pack() -- packs the program loaded in rom into packed[] as a sequence
+ *		of blocks and returns the total size.
+ */
+u32 pack()
+{
+	static u8 block[PACK_BLOCK_SIZE+PACK_BLOCK_SIZE/PACK_MAX_LITERALS+1];
+	const u8 *data=rom.progmem+HEADER_SIZE;
+	int size=rom.header.progSize;
+	u8 *out=packed;
 
-	fclose(in_file);
+	memset(head,0xff,sizeof(head));
+	inserted=0;
 
-	return true;
+	for(int start=0; start<size; start+=PACK_BLOCK_SIZE)
+	{
+		int end = start+PACK_BLOCK_SIZE < size? start+PACK_BLOCK_SIZE : size;
+		int len=pack_block(block,data,size,start,end);
+
+		if(len >= end-start)
+		{
+			len=end-start;
+			memcpy(out+PACK_BLOCK_HEADER,data+start,len);
+		}
+		else
+		{
+			memcpy(out+PACK_BLOCK_HEADER,block,len);
+		}
+		put16(out,end-start);
+		put16(out+2,len);
+		put32(out+4,chksum_crc32((unsigned char*)data+start,end-start));
+		out+=PACK_BLOCK_HEADER+len;
+	}
+	return out-packed;
 }
 
 int main(int argc,char **argv)
 {
 
+	bool compress=false;
+	if (argc>1 && !strcmp(argv[1],"-c"))
+	{
+		compress=true;
+		argc--;
+		argv++;
+	}
+
 	if (argc!=4)
 	{
 		fprintf(stderr,"%s ver %i.%i -- Packs a HEX file to binary and adds a header.\n",argv[0],VERSION_MAJOR,VERSION_MINOR);
-		fprintf(stderr,"usage: %s <input.hex> <ouput.uze> <gameinfo.properties>\n",argv[0]);
+		fprintf(stderr,"usage: %s [-c] <input.hex> <ouput.uze> <gameinfo.properties>\n",argv[0]);
 		fprintf(stderr,"example: %s halloween.hex halloween.uze gameinfo.properties\n",argv[0]);
+		fprintf(stderr,"  -c: compress the program (version 2 file, needs GameLoader 0.4.6 or later)\n");
 		return 1;
 	}
 
@@ -311,9 +433,24 @@ int main(int argc,char **argv)
 	fprintf(stderr,"\tProgram size: %li \n",
         (long unsigned int) rom.header.progSize);
 
+	if(compress){
+		rom.header.version=HEADER_VERSION_PACKED;
+		rom.header.packedSize=pack();
+		fprintf(stderr,"\tPacked size: %lu (%lu%%)\n",
+			(long unsigned int) rom.header.packedSize,
+			rom.header.progSize? (long unsigned int) rom.header.packedSize*100/rom.header.progSize : 0);
+	}
+
 	//write the output file
 	FILE *out_file = fopen(argv[2],"wb");
-	if(!fwrite(&rom.progmem,rom.header.progSize+HEADER_SIZE,1,out_file)){
+	bool written;
+	if(compress){
+		written=fwrite(&rom.progmem,HEADER_SIZE,1,out_file) &&
+			(!rom.header.packedSize || fwrite(packed,rom.header.packedSize,1,out_file));
+	}else{
+		written=fwrite(&rom.progmem,rom.header.progSize+HEADER_SIZE,1,out_file);
+	}
+	if(!written){
 
 		fprintf(stderr,"Could not process output file.\n");
 		return 1;
@@ -39,6 +39,10 @@ More info at uzebox.org
 #include <string.h>
 
 #include "avr8.h"
+#include "ntsc.h"
+#include "recorder.h"
+#include "regress.h"
+#include "presenter.h"
 #include "gdbserver.h"
 #include "SDEmulator.h"
 #include "Keyboard.h"
@@ -46,6 +50,9 @@ More info at uzebox.org
 #include "SDL_framerate.h"
 #include <iostream>
 #include <queue>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 
@@ -61,10 +68,13 @@ using namespace std;
 #define Z		((ZL)|(ZH<<8))
 #define DEC_Z	(ZL-- || ZH--)
 #define INC_Z	(++ZL || ++ZH)
+#define RAMPZ_Z	((RAMPZ<<16)|Z)
+#define INC_RAMPZ_Z	(++ZL || ++ZH || ++RAMPZ)
 
 #define SP		(SPL | (SPH<<8))
 #define DEC_SP	(SPL-- || SPH--)
 #define INC_SP	(++SPL || ++SPH)
+#define WATCH_SP	if (SP < spLow) watch_stack()	// --ram, never true while it's off
 
 #define SREG_I 7
 #define SREG_T 6
@@ -116,6 +126,26 @@ using namespace std;
 
 static const char *port_name(int);
 
+const Mcu mcus[] =
+{
+	{ "ATmega644", 65536, 4096, 2048 },
+	{ "ATmega1284", 131072, 16384, 4096 },
+};
+
+void avr8::set_mcu(int type)
+{
+	mcu = &mcus[type];
+	progSize = mcu->progSize;
+	sramSize = mcu->sramSize;
+	eepromSize = mcu->eepromSize;
+	progMask = progSize/2 - 1;
+	sramMask = sramSize - 1;
+
+	SPL = (SRAMBASE+sramSize-1) & 0x00ff;
+	SPH = (SRAMBASE+sramSize-1) >> 8;
+	memset(decoded,0,maxProgSize/2*sizeof(Insn));
+}
+
 #if GUI
 static const char* joySettingsFilename = "joystick-settings";
 #endif
@@ -134,7 +164,7 @@ static const char* joySettingsFilename = "joystick-settings";
 #define k12	((s16)(insn<<4)>>4)
 
 #define BIT(x,b)	(((x)>>(b))&1)
-#define C			BIT(SREG,SREG_C)
+#define C			(sync_flags(), BIT(SREG,SREG_C))
 
 inline void set_bit(u8 &dest,int bit,int value)
 {
@@ -148,39 +178,54 @@ inline void set_bit(u8 &dest,int bit,int value)
 #define BORROWS		(~Rd&Rr)|(Rr&R)|(R&~Rd)
 #define CARRIES		((Rd&Rr)|(Rr&~R)|(~R&Rd))
 
-#define UPDATE_HC_SUB \
-	CH = BORROWS; \
-	set_bit(SREG, SREG_H, CH & 0x8); \
-	set_bit(SREG, SREG_C, CH & 0x80)
-#define UPDATE_HC_ADD \
-	CH = CARRIES; \
-	set_bit(SREG, SREG_H, CH & 0x8); \
-	set_bit(SREG, SREG_C, CH & 0x80)
+#define V_ADD		((Rd&Rr&~R)|(~Rd&~Rr&R))
+#define V_SUB		((Rd&~Rr&~R)|(~Rd&Rr&R))
+
+// Flag classes for the lazily evaluated SREG bits, see eval_flags()
+#define FLAGS_ADD		0	// H S V N Z C of R = Rd + Rr (+ C)
+#define FLAGS_SUB		1	// H S V N Z C of R = Rd - Rr
+#define FLAGS_SUBC		2	// same, but Z can only be cleared (CPC, SBC, SBCI)
+#define FLAGS_LOGIC		3	// S V N Z, V cleared
+#define FLAGS_INC		4	// S V N Z, V set on 0x7F -> 0x80
+#define FLAGS_DEC		5	// S V N Z, V set on 0x80 -> 0x7F
 
-#define UPDATE_H		set_bit(SREG, SREG_H, (CARRIES & 0x8))
+#define ARITH_FLAGS		((1<<SREG_H)|(1<<SREG_S)|(1<<SREG_V)|(1<<SREG_N)|(1<<SREG_Z)|(1<<SREG_C))
+#define LOGIC_FLAGS		((1<<SREG_S)|(1<<SREG_V)|(1<<SREG_N)|(1<<SREG_Z))
+
+// Replaces all owed flags, so nothing pending needs evaluating first
+#define LAZY_ARITH(op) \
+	flagOp = op; flagMask = ARITH_FLAGS; flagRd = Rd; flagRr = Rr; flagR = R
+
+// Leaves H and C alone, so those must be settled if still owed
+#define LAZY_LOGIC(op) \
+	if (flagMask & ~LOGIC_FLAGS) eval_flags(); \
+	flagOp = op; flagMask = LOGIC_FLAGS; flagR = R
+
+// Insns that set their flags directly take the bits off the owed set
 #define UPDATE_Z		set_bit(SREG, SREG_Z, !R)
-#define UPDATE_V_ADD	set_bit(SREG, SREG_V, ((Rd&Rr&~R)|(~Rd&~Rr&R)) & 0x80)
-#define UPDATE_V_SUB	set_bit(SREG, SREG_V, ((Rd&~Rr&~R)|(~Rd&Rr&R)) & 0x80)
 #define UPDATE_N		set_bit(SREG, SREG_N, R & 0x80)
 #define UPDATE_S		set_bit(SREG, SREG_S, BIT(SREG,SREG_N) ^ BIT(SREG,SREG_V))
+#define OWN_FLAGS(mask)	(flagMask &= ~(mask))
 
-#define UPDATE_SVN_SUB	UPDATE_V_SUB; UPDATE_N; UPDATE_S
-#define UPDATE_SVN_ADD	UPDATE_V_ADD; UPDATE_N; UPDATE_S
-
-// Simplified version for logical insns.
-#define UPDATE_SVN_LOGICAL \
-	if (R & 0x80) { /* Set N and S, clear V */ \
-		SREG = (SREG | (1<<SREG_N) | (1<<SREG_S)) & ~(1<<SREG_V); \
-	} else { /* Clear N and S and V */ \
-		SREG = (SREG & ~((1<<SREG_S)|(1<<SREG_V)|(1<<SREG_N))); \
-	}
-
-#define UPDATE_CZ_MUL(x)		set_bit(SREG,SREG_C,x & 0x8000); set_bit(SREG,SREG_Z,!x)
+#define UPDATE_CZ_MUL(x)		set_bit(SREG,SREG_C,x & 0x8000); set_bit(SREG,SREG_Z,!x); OWN_FLAGS((1<<SREG_C)|(1<<SREG_Z))
 
-#define CLEAR_Z		(SREG &= ~(1<<SREG_Z))
 #define SET_C		(SREG |= (1<<SREG_C))
 
-#define ILLEGAL_OP fprintf(stderr,"invalid insn %x\n",insn); shutdown(1);
+#define ILLEGAL_OP fprintf(stderr,"invalid insn %x\n",progmem[addr]); shutdown(1);
+// Second half of a fused "out PORTC" pair, once the first took its cycles
+#define OUT_PORTC(first) \
+	cycles = first; \
+	if (hwPending + first < hwQuiet) \
+	{ \
+		hwPending += first; \
+		write_io(ports::PORTC, r[insn.d]); \
+		pc++; \
+		if (++hwPending >= hwQuiet) \
+			sync_hardware(); \
+		return first + 1; \
+	}
+// Taken jumps back into a loop look for a busy-wait now and then, see idle_skip()
+#define IDLE_CHECK	if (insn.k <= addr && !--idleCountdown) cycles += idle_skip()
 
 #if defined(_DEBUG)
 #define DISASM 1
@@ -236,29 +281,147 @@ void avr8::spi_calculateClock(){
     SPI_DEBUG("SPI divider set to : %d (%d cycles per byte)\n",spiClockDivider,spiCycleWait);
 }
 
-void avr8::write_io(u8 addr,u8 value)
+// Most I/O registers are plain storage. The ones the hardware model reads
+// or changes bring it up to date first, and writes that can start, stop or
+// move an event have it look again right after the current insn.
+void avr8::init_io()
 {
-	if (addr == ports::PORTC)
-	{
-	     pixel = palette[value & DDRC];
-	}
-	// p106 in 644 manual; 16-bit values are latched
-	else if (addr == ports::TCNT1H || addr == ports::ICR1H)
-		TEMP = value;
-	else if (addr == ports::TCNT1L || addr == ports::ICR1L)
-	{
-		io[addr] = value;
-		io[addr+1] = TEMP;
-	}
-	else if (addr == ports::PORTD)
-	{
-        // write value with respect to DDRD register
-        io[addr] = value & DDRD;
+	for (int i=0; i<256; i++)
+		set_io_handler(i, &avr8::io_store, &avr8::io_load);
+
+	set_io_handler(ports::PORTA, &avr8::io_write_porta, &avr8::io_load);
+	set_io_handler(ports::PORTB, &avr8::io_write_portb, &avr8::io_load);
+	set_io_handler(ports::PORTC, &avr8::io_write_portc, &avr8::io_load);
+	set_io_handler(ports::PORTD, &avr8::io_write_portd, &avr8::io_load);
+
+	set_io_handler(ports::TCCR1B, &avr8::io_store_hw, &avr8::io_load);
+	set_io_handler(ports::TCNT1L, &avr8::io_write_tcnt1l, &avr8::io_read_tcnt1l);
+	set_io_handler(ports::TCNT1H, &avr8::io_write_tcnt1h, &avr8::io_read_tcnt1h);
+	set_io_handler(ports::ICR1L, &avr8::io_write_tcnt1l, &avr8::io_read_tcnt1l);
+	set_io_handler(ports::ICR1H, &avr8::io_write_tcnt1h, &avr8::io_read_tcnt1h);
+	set_io_handler(ports::OCR1AL, &avr8::io_store_hw, &avr8::io_load);
+	set_io_handler(ports::OCR1AH, &avr8::io_store_hw, &avr8::io_load);
+	set_io_handler(ports::OCR1BL, &avr8::io_store_hw, &avr8::io_load);
+	set_io_handler(ports::OCR1BH, &avr8::io_store_hw, &avr8::io_load);
+	set_io_handler(ports::TIMSK1, &avr8::io_store_hw, &avr8::io_load);
+	set_io_handler(ports::TIFR1, &avr8::io_write_tifr1, &avr8::io_load_hw);
+	set_io_handler(ports::WDTCSR, &avr8::io_store_hw, &avr8::io_load_hw);
+	set_io_handler(ports::SPMCSR, &avr8::io_store_hw, &avr8::io_load_hw);
+
+	set_io_handler(ports::OCR2A, &avr8::io_write_ocr2a, &avr8::io_load);
+
+	set_io_handler(ports::SPDR, &avr8::io_write_spdr, &avr8::io_load_hw);
+	set_io_handler(ports::SPCR, &avr8::io_write_spcr, &avr8::io_load);
+	set_io_handler(ports::SPSR, &avr8::io_write_spcr, &avr8::io_load_hw);
+
+	set_io_handler(ports::EECR, &avr8::io_write_eecr, &avr8::io_load_hw);
+	set_io_handler(ports::EEDR, &avr8::io_store_hw, &avr8::io_load_hw);
+	set_io_handler(ports::EEARL, &avr8::io_store_hw, &avr8::io_load);
+	set_io_handler(ports::EEARH, &avr8::io_store_hw, &avr8::io_load);
+
+	set_io_handler(ports::SREG, &avr8::io_write_sreg, &avr8::io_read_sreg);
+
+#ifdef USE_PORT_PRINT
+	set_io_handler(ports::res3A, &avr8::io_write_whisper, &avr8::io_load);
+	set_io_handler(ports::res39, &avr8::io_write_whisper, &avr8::io_load);
+#endif
+}
 
-    }
+void avr8::set_io_handler(u8 addr,IoWrite write,IoRead read)
+{
+	ioWrite[addr] = write;
+	ioRead[addr] = read;
+}
+
+void avr8::io_store(u8 addr,u8 value)
+{
+	io[addr] = value;
+}
+
+u8 avr8::io_load(u8 addr)
+{
+	return io[addr];
+}
+
+void avr8::io_store_hw(u8 addr,u8 value)
+{
+	sync_hardware();
+	io[addr] = value;
+	hwQuiet = 0;
+}
+
+u8 avr8::io_load_hw(u8 addr)
+{
+	sync_hardware();
+	return io[addr];
+}
+
+void avr8::io_write_portc(u8 addr,u8 value)
+{
+	// Fill the scanline up to here with the old color
+	sync_hardware();
+	pixel = value & DDRC;
+}
+
+void avr8::io_write_portd(u8 addr,u8 value)
+{
+	// write value with respect to DDRD register
+	io[addr] = value & DDRD;
+}
+
+// p106 in 644 manual; 16-bit values are latched
+void avr8::io_write_tcnt1h(u8 addr,u8 value)
+{
+	TEMP = value;
+}
+
+void avr8::io_write_tcnt1l(u8 addr,u8 value)
+{
+	sync_hardware();
+	io[addr] = value;
+	io[addr+1] = TEMP;
+	hwQuiet = 0;
+}
+
+u8 avr8::io_read_tcnt1l(u8 addr)
+{
+	sync_hardware();
+	TEMP = io[addr+1];
+	return io[addr];
+}
+
+u8 avr8::io_read_tcnt1h(u8 addr)
+{
+	return TEMP;
+}
+
+void avr8::io_write_tifr1(u8 addr,u8 value)
+{
+	sync_hardware();
+	//clear flags by writing logical one
+	io[addr] &= ~(value);
+	hwQuiet = 0;
+}
+
+void avr8::io_write_sreg(u8 addr,u8 value)
+{
+	sync_hardware();
+	flagMask = 0;
+	io[addr] = value;
+	hwQuiet = 0;			// pending interrupts are taken right after
+}
+
+u8 avr8::io_read_sreg(u8 addr)
+{
+	sync_hardware();
+	sync_flags();
+	return io[addr];
+}
+
+void avr8::io_write_portb(u8 addr,u8 value)
+{
+	sync_hardware();
 
-	else if (addr == ports::PORTB)
-	{
         u32 elapsed = cycleCounter - prevPortB;
         prevPortB = cycleCounter;
 
@@ -272,17 +435,26 @@ void avr8::write_io(u8 addr,u8 value)
             scanline_count++;
             current_cycle = left_edge;
 
-            current_scanline = (u32*)((u8*)screen->pixels + scanline_count * 2 * screen->pitch + inset);
-            next_scanline = current_scanline + (screen->pitch>>2);
+            current_scanline = framebuffer + scanline_count * VIDEO_LINE_CYCLES;
 
-            if (scanline_count == 224)
+            if (scanline_count == VIDEO_LINES)
             {
-            	if (SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
-            	SDL_Flip(screen);
-            	SDL_framerateDelay(&fpsmanager);
+            	if (speculating)
+            	{
+            		scanline_count = -999;
+            		++frameCounter;
+            		return;
+            	}
 
+            	if (recorder)
+            		recorder->submit_frame(framebuffer);
+
+            	if (!headless && !runAhead)
+            		present_frame(framebuffer);
+
+                // shutdown() returns with a presenter, then there's no more frame
                 SDL_Event event;
-                while (singleStep? SDL_WaitEvent(&event) : SDL_PollEvent(&event))
+                while (state != CPU_STOPPED && next_event(event))
                 {
 					switch (event.type) {
 						case SDL_KEYDOWN:
@@ -307,6 +479,8 @@ void avr8::write_io(u8 addr,u8 value)
 							break;
 					}
                 }
+                if (state == CPU_STOPPED)
+                    return;
 
                 //capture or replay controlelr capture data
                 if(captureMode==CAPTURE_WRITE){
@@ -324,7 +498,8 @@ void avr8::write_io(u8 addr,u8 value)
                     // http://www.repairfaq.org/REPAIR/F_SNES.html
                     // we always report "low sensitivity"
                     int mouse_dx, mouse_dy;
-                    u8 mouse_buttons = SDL_GetRelativeMouseState(&mouse_dx,&mouse_dy);
+                    u8 mouse_buttons = presenter? presenter->read_mouse(&mouse_dx,&mouse_dy) :
+                        SDL_GetRelativeMouseState(&mouse_dx,&mouse_dy);
                     mouse_dx >>= mouse_scale;
                     mouse_dy >>= mouse_scale;
                     // clear high bit so we know it's the mouse
@@ -336,7 +511,7 @@ void avr8::write_io(u8 addr,u8 value)
                         buttons[0] &= ~(1<<10);
                     // keep mouse centered so it doesn't get stuck on edge of screen.
                     // ...and immediately consume the bogus motion event it generated.
-                    if (fullscreen)
+                    if (fullscreen && !presenter)
                     {
                         SDL_WarpMouse(400,300);
                         SDL_GetRelativeMouseState(&mouse_dx,&mouse_dy);
@@ -346,126 +521,442 @@ void avr8::write_io(u8 addr,u8 value)
                     buttons[0] |= 0xFFFF8000;
                 singleStep = nextSingleStep;
 
-                if (SDL_MUSTLOCK(screen))
-                    SDL_LockSurface(screen);
                 scanline_count = -999;
                 ++frameCounter;
+                if (ramMonitor)
+                    ram_frame();
+
+                // shutdown() picks up the regression result as exit code
+                if (regress && regress->frame(frameCounter, framebuffer))
+                {
+                    shutdown(0);
+                    return;
+                }
+                if (frameLimit && frameCounter >= frameLimit)
+                {
+                    shutdown(0);
+                    return;
+                }
+
+                // Not from in here, the insn isn't done yet
+                if (runAhead)
+                {
+                    aheadPending = true;
+                    hwQuiet = 0;
+                }
             }
         }
-    }
-	else if (addr == ports::PORTA)
+}
+
+// Scalars a Snapshot carries besides the memories, see save_state()
+#define SNAPSHOT_FIELDS(FIELD) \
+	FIELD(pc) FIELD(TEMP) FIELD(flagOp) FIELD(flagMask) FIELD(flagRd) FIELD(flagRr) FIELD(flagR) \
+	FIELD(hwPending) FIELD(hwQuiet) FIELD(TCNT1) FIELD(OCR1A) FIELD(OCR1B) \
+	FIELD(watchdogTimer) FIELD(cycleCounter) FIELD(prevPortB) FIELD(prevWDR) FIELD(interruptLevel) \
+	FIELD(new_input_mode) FIELD(frameCounter) FIELD(scanline_count) FIELD(current_cycle) \
+	FIELD(pixel) \
+	FIELD(uzeKbState) FIELD(uzeKbDataOut) FIELD(uzeKbDataIn) FIELD(uzeKbClock) FIELD(uzeKbEnabled) \
+	FIELD(spiByte) FIELD(spiTransfer) FIELD(spiClock) FIELD(spiCycleWait) FIELD(spiState) \
+	FIELD(spiCommand) FIELD(spiCommandDelay) FIELD(spiArg) FIELD(spiByteCount) \
+	FIELD(emulatedReadPos) FIELD(eeClock)
+
+void avr8::save_state(Snapshot &s)
+{
+#define FIELD(f) s.f = f;
+	SNAPSHOT_FIELDS(FIELD)
+#undef FIELD
+	memcpy(s.r, r, sizeof(r));
+	memcpy(s.io, io, sizeof(io));
+	memcpy(s.sram, sram, sramSize);
+	memcpy(s.eeprom, eeprom, eepromSize);
+	memcpy(s.progmem, progmem, progSize);
+	memcpy(s.latched_buttons, latched_buttons, sizeof(latched_buttons));
+	memcpy(s.spiResponseBuffer, spiResponseBuffer, sizeof(spiResponseBuffer));
+	s.sdPosition = SDemulator.position;
+
+	s.scanlineOffset = current_scanline - framebuffer;
+	s.spiResponsePos = spiResponsePtr? spiResponsePtr - spiResponseBuffer : -1;
+	s.spiResponseLength = spiResponseEnd? spiResponseEnd - spiResponseBuffer : -1;
+
+	queue <u8> scanCodes = uzeKbScanCodeQueue;
+	for (s.uzeKbQueueLength = 0; !scanCodes.empty() && s.uzeKbQueueLength < (int)SNAPSHOT_KB_QUEUE; scanCodes.pop())
+		s.uzeKbQueue[s.uzeKbQueueLength++] = scanCodes.front();
+}
+
+void avr8::load_state(const Snapshot &s)
+{
+#define FIELD(f) f = s.f;
+	SNAPSHOT_FIELDS(FIELD)
+#undef FIELD
+	memcpy(r, s.r, sizeof(r));
+	memcpy(io, s.io, sizeof(io));
+	memcpy(sram, s.sram, sramSize);
+	memcpy(eeprom, s.eeprom, eepromSize);
+	memcpy(latched_buttons, s.latched_buttons, sizeof(latched_buttons));
+	memcpy(spiResponseBuffer, s.spiResponseBuffer, sizeof(spiResponseBuffer));
+	SDemulator.position = s.sdPosition;
+
+	current_scanline = framebuffer + s.scanlineOffset;
+	spiResponsePtr = s.spiResponsePos < 0? NULL : spiResponseBuffer + s.spiResponsePos;
+	spiResponseEnd = s.spiResponseLength < 0? NULL : spiResponseBuffer + s.spiResponseLength;
+
+	uzeKbScanCodeQueue = queue <u8>();
+	for (int i=0; i<s.uzeKbQueueLength; i++)
+		uzeKbScanCodeQueue.push(s.uzeKbQueue[i]);
+
+	// Only a bootloader writes progmem, so look before redecoding
+	if (memcmp(progmem, s.progmem, progSize))
 	{
-		u8 changed = value ^ io[addr];
-		u8 went_low = changed & io[addr];
+		for (unsigned i=0; i<progSize/2; i++)
+		{
+			if (progmem[i] != s.progmem[i])
+			{
+				progmem[i] = s.progmem[i];
+				invalidate_insn(i);
+			}
+		}
+	}
+
+	// The loop being watched may be one that only ran ahead
+	idleStage = IDLE_NONE;
+}
+
+// Called from exec() when a frame is done, see io_write_portb()
+void avr8::run_ahead()
+{
+	aheadPending = false;
+	save_state(*ahead);
+
+	u8 *shown = framebuffer;
+	framebuffer = aheadBuffer;
+	speculating = true;
 
-		if (went_low == (1<<2))		// LATCH
+	// Give up on the frames ahead if the game stops sending them
+	int target = frameCounter + runAhead;
+	u32 start = cycleCounter;
+	while (frameCounter < target && cycleCounter - start < u32(runAhead) * AHEAD_MAX_FRAME_CYCLES)
+		exec();
+
+	if (!headless)
+	{
+		if (frameCounter == target)
+			present_frame(framebuffer);
+		else if (!presenter)
+			SDL_framerateDelay(&fpsmanager);
+	}
+
+	speculating = false;
+	framebuffer = shown;
+	load_state(*ahead);
+}
+
+// RAM ends where avr-libc would start the heap. Every game has one of these
+// in its .elf, and in its .map when linked with -Wl,-Map.
+static const char *const dataEndSymbols[] = { "__heap_start", "_end", "__noinit_end", "__bss_end" };
+#define DATA_END_SYMBOLS (sizeof(dataEndSymbols)/sizeof(dataEndSymbols[0]))
+
+static inline u32 get_le(const u8 *p, int size)
+{
+	u32 value = 0;
+	while (size--)
+		value = (value << 8) | p[size];
+	return value;
+}
+
+// Takes the end of the static data from an .elf or a linker .map
+bool avr8::load_symbols(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	u8 *file = (u8*)malloc(size + 1);
+	if (!file || fread(file, 1, size, f) != (size_t)size)
+	{
+		free(file);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	file[size] = 0;
+
+	u32 found[DATA_END_SYMBOLS];
+	memset(found, 0xFF, sizeof(found));
+
+	if (size > 0x34 && !memcmp(file, "\177ELF\1\1", 6))
+	{
+		// 32-bit little endian, look for the symbols in every symbol table
+		u32 shoff = get_le(file + 0x20, 4);
+		u32 shentsize = get_le(file + 0x2E, 2), shnum = get_le(file + 0x30, 2);
+		for (u32 i = 0; i < shnum && shoff + (i+1)*shentsize <= (u32)size; i++)
 		{
-			for (int i=0; i<2; i++)
+			const u8 *sh = file + shoff + i*shentsize;
+			if (get_le(sh + 4, 4) != 2)		// SHT_SYMTAB
+				continue;
+			u32 symoff = get_le(sh + 16, 4), symsize = get_le(sh + 20, 4);
+			u32 link = get_le(sh + 24, 4);
+			if (link >= shnum || symoff + symsize > (u32)size || shoff + (link+1)*shentsize > (u32)size)
+				continue;
+			const u8 *strh = file + shoff + link*shentsize;
+			u32 stroff = get_le(strh + 16, 4), strsize = get_le(strh + 20, 4);
+			if (stroff + strsize > (u32)size)
+				continue;
+			for (u32 s = 0; s + 16 <= symsize; s += 16)
 			{
-				latched_buttons[i] = buttons[i];
-				// don't let UP+DOWN register at same time
-				if ((latched_buttons[i] & ((1<<PAD_LEFT)|(1<<PAD_RIGHT))) == 0)
-					latched_buttons[i] |= (1<<PAD_RIGHT);
-				// same for LEFT+RIGHT
-				if ((latched_buttons[i] & ((1<<PAD_UP)|(1<<PAD_DOWN))) == 0)
-					latched_buttons[i] |= (1<<PAD_DOWN);
+				u32 name = get_le(file + symoff + s, 4);
+				if (name >= strsize)
+					continue;
+				for (u32 j = 0; j < DATA_END_SYMBOLS; j++)
+					if (!strcmp((const char*)file + stroff + name, dataEndSymbols[j]))
+						found[j] = get_le(file + symoff + s + 4, 4);
 			}
 		}
-		else if (went_low == (1<<3))	// CLOCK
+	}
+	else
+	{
+		// Lines like "  0x00800a52    PROVIDE (__heap_start = .)"
+		for (char *line = (char*)file; line && *line; )
 		{
-			if (new_input_mode)	PINA = u8((latched_buttons[0] & 1) | ((latched_buttons[1] & 1) << 1));
-			latched_buttons[0] >>= 1;
-			latched_buttons[1] >>= 1;
-
-			if ((latched_buttons[1] < 0xFFFFF) && !new_input_mode)
+			char *next = strchr(line, '\n');
+			if (next)
+				*next++ = 0;
+			char *hex = strstr(line, "0x");
+			if (hex)
 			{
-				printf("New input routines detected, switching emulation method.\n");
-				new_input_mode = true;
+				char *rest;
+				u32 value = strtoul(hex, &rest, 16);
+				for (u32 j = 0; j < DATA_END_SYMBOLS; j++)
+				{
+					char *name = strstr(rest, dataEndSymbols[j]);
+					size_t length = strlen(dataEndSymbols[j]);
+					if (name && (name[-1] == ' ' || name[-1] == '(') &&
+						(name[length] == ' ' || name[length] == '=' || name[length] == 0 || name[length] == '\r'))
+						found[j] = value;
+				}
 			}
+			line = next;
+		}
+	}
+	free(file);
+
+	for (u32 j = 0; j < DATA_END_SYMBOLS; j++)
+	{
+		if (found[j] != 0xFFFFFFFF)
+		{
+			dataEnd = found[j] & 0xFFFF;	// the data space starts at 0x800000
+			return true;
 		}
-		if (!new_input_mode) PINA = u8((latched_buttons[0] & 1) | ((latched_buttons[1] & 1) << 1));
+	}
+	return false;
+}
 
+void avr8::start_ram_monitor()
+{
+	ramMonitor = true;
+	spLow = spFrameLow = spLowest = SP;
+	dataHigh = ramWatch = SRAMBASE - 1;
+	set_io_handler(ports::SPL, &avr8::io_write_spl, &avr8::io_load);
+}
 
-		//Uzebox keyboard (always on P2 port)
-		switch(uzeKbState){
-			case KB_STOP:
-				//check uzekeyboard start condition: clock=low & latch=high simultaneously
-				if((value&0x0c)==0x04){
-					uzeKbState=KB_TX_START;
-					if(!uzeKbEnabled) SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY,SDL_DEFAULT_REPEAT_INTERVAL);
-					uzeKbEnabled=true;	//enable keyboard capture for Uzebox Keyboard
-				}
-				break;
+// Bytes between the highest data and the stack at sp, negative when they overlap
+int avr8::ram_free(u16 sp)
+{
+	int top = dataHigh;
+	if (dataEnd && dataEnd - 1 > top)
+		top = dataEnd - 1;
+	return sp - top;
+}
 
-			case KB_TX_START:
-				//check start condition pulse completed: clock=high & latch=low (normal state)
-				if((value&0x0c)==0x08){
-					uzeKbState=KB_TX_READY;
-					uzeKbClock=8;
-				}
-				break;
+void avr8::ram_fault(u32 &count, const char *fmt, u16 a, u16 b)
+{
+	if (++count <= 10)
+	{
+		printf("RAM: ");
+		printf(fmt, a, b);
+		printf(" near pc 0x%04X%s\n", (pc-1)<<1, count == 10 ? " (no more of these)" : "");
+	}
+	if (enableGdb)
+		gdbBreakpointFound = true;
+}
 
-			case KB_TX_READY:
-				if (went_low == (1<<3))	// CLOCK
-				{
-					if(uzeKbClock==8){
-						uzeKbDataOut=0;
-						//returns only keys (no commands response yet)
-						if(uzeKbScanCodeQueue.empty()){
-							uzeKbDataIn=0;
-						}else{
-							uzeKbDataIn=uzeKbScanCodeQueue.front();
-							uzeKbScanCodeQueue.pop();
-						}
-					}
+// SP went below spLow
+void avr8::watch_stack()
+{
+	if (speculating)
+		return;
+	u16 sp = SP;
+	spLow = sp;
+	if (sp < spLowest)
+	{
+		spLowest = sp;
+		if (ram_free(sp) < 0)
+			ram_fault(ramCollisions, "stack at 0x%04X ran into the data up to 0x%04X", sp, sp - ram_free(sp));
+	}
+}
 
+// A write to SRAM above ramWatch
+void avr8::watch_write(u16 addr)
+{
+	if (speculating)
+		return;
+	if (u16(addr - SRAMBASE) > sramMask)
+		ram_fault(ramWraps, "write to 0x%04X is past the end of SRAM, it lands on 0x%04X",
+			addr, SRAMBASE + ((addr - SRAMBASE) & sramMask));
+	else if (addr < SP)
+	{
+		dataHigh = ramWatch = addr;
+		if (addr > spLowest)
+			ram_fault(ramCollisions, "data written at 0x%04X where the stack had been (down to 0x%04X)", addr, spLowest);
+	}
+}
 
-					//shift data out to keyboard
-					//latch pin is used as "Data Out"
-					uzeKbDataOut<<=1;
-					if(value&0x04){ //latch pin=1?
-						uzeKbDataOut|=1;
-					}
+// Compilers set SPH first, so the pair is only looked at once SPL is in
+void avr8::io_write_spl(u8 addr,u8 value)
+{
+	io[addr] = value;
+	WATCH_SP;
+}
 
-					//shift data in from keyboard
-					if(uzeKbDataIn&0x80){
-						PINA|=(0x02); //set P2 data bit
-					}else{
-						PINA&=~(0x02); //clear P2 data bit
-					}
-					uzeKbDataIn<<=1;
-
-					uzeKbClock--;
-					if(uzeKbClock==0){
-						if(uzeKbDataOut==KB_SEND_END){
-							uzeKbState=KB_STOP;
-						}else{
-							uzeKbClock=8;
-						}
-					}
-				}
-				break;
-		}
+void avr8::ram_frame()
+{
+	spFrameLow = spLow;
+	spLow = SP;
+}
 
+void avr8::ram_report()
+{
+	printf("RAM: lowest SP 0x%04X, data up to 0x%04X", spLowest, spLowest - ram_free(spLowest));
+	if (dataEnd)
+		printf(" (static data ends at 0x%04X)", dataEnd - 1);
+	printf(", %d bytes never used", ram_free(spLowest));
+	if (ramCollisions || ramWraps)
+		printf(", %u collisions, %u writes past the end", ramCollisions, ramWraps);
+	printf("\n");
+}
+
+void avr8::io_write_porta(u8 addr,u8 value)
+{
+	u8 changed = value ^ io[addr];
+	u8 went_low = changed & io[addr];
 
-		io[addr] = value;
+	if (went_low == (1<<2))		// LATCH
+	{
+		for (int i=0; i<2; i++)
+		{
+			latched_buttons[i] = buttons[i];
+			// don't let UP+DOWN register at same time
+			if ((latched_buttons[i] & ((1<<PAD_LEFT)|(1<<PAD_RIGHT))) == 0)
+				latched_buttons[i] |= (1<<PAD_RIGHT);
+			// same for LEFT+RIGHT
+			if ((latched_buttons[i] & ((1<<PAD_UP)|(1<<PAD_DOWN))) == 0)
+				latched_buttons[i] |= (1<<PAD_DOWN);
+		}
 	}
-	else if (addr == ports::OCR2A)
+	else if (went_low == (1<<3))	// CLOCK
 	{
-		if (enableSound && TCCR2B)
+		if (new_input_mode)	PINA = u8((latched_buttons[0] & 1) | ((latched_buttons[1] & 1) << 1));
+		latched_buttons[0] >>= 1;
+		latched_buttons[1] >>= 1;
+
+		if ((latched_buttons[1] < 0xFFFFF) && !new_input_mode)
 		{
-			// raw pcm sample at 15.7khz
-			while (audioRing.isFull()) SDL_Delay(1);
-			SDL_LockAudio();
-			audioRing.push(value);
-			SDL_UnlockAudio();
+			if (!speculating)
+				printf("New input routines detected, switching emulation method.\n");
+			new_input_mode = true;
 		}
 	}
+	if (!new_input_mode) PINA = u8((latched_buttons[0] & 1) | ((latched_buttons[1] & 1) << 1));
+
+
+	//Uzebox keyboard (always on P2 port)
+	switch(uzeKbState){
+		case KB_STOP:
+			//check uzekeyboard start condition: clock=low & latch=high simultaneously
+			if((value&0x0c)==0x04){
+				uzeKbState=KB_TX_START;
+				if(!uzeKbEnabled && presenter) presenter->enable_key_repeat();
+				else if(!uzeKbEnabled) SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY,SDL_DEFAULT_REPEAT_INTERVAL);
+				uzeKbEnabled=true;	//enable keyboard capture for Uzebox Keyboard
+			}
+			break;
+
+		case KB_TX_START:
+			//check start condition pulse completed: clock=high & latch=low (normal state)
+			if((value&0x0c)==0x08){
+				uzeKbState=KB_TX_READY;
+				uzeKbClock=8;
+			}
+			break;
+
+		case KB_TX_READY:
+			if (went_low == (1<<3))	// CLOCK
+			{
+				if(uzeKbClock==8){
+					uzeKbDataOut=0;
+					//returns only keys (no commands response yet)
+					if(uzeKbScanCodeQueue.empty()){
+						uzeKbDataIn=0;
+					}else{
+						uzeKbDataIn=uzeKbScanCodeQueue.front();
+						uzeKbScanCodeQueue.pop();
+					}
+				}
+
 
+				//shift data out to keyboard
+				//latch pin is used as "Data Out"
+				uzeKbDataOut<<=1;
+				if(value&0x04){ //latch pin=1?
+					uzeKbDataOut|=1;
+				}
 
+				//shift data in from keyboard
+				if(uzeKbDataIn&0x80){
+					PINA|=(0x02); //set P2 data bit
+				}else{
+					PINA&=~(0x02); //clear P2 data bit
+				}
+				uzeKbDataIn<<=1;
 
-    else if(addr == ports::SPDR)
-    {
+				uzeKbClock--;
+				if(uzeKbClock==0){
+					if(uzeKbDataOut==KB_SEND_END){
+						uzeKbState=KB_STOP;
+					}else{
+						uzeKbClock=8;
+					}
+				}
+			}
+			break;
+	}
+
+
+	io[addr] = value;
+}
+
+void avr8::io_write_ocr2a(u8 addr,u8 value)
+{
+	if (speculating)
+		return;
+	if (audioCapture && TCCR2B && audioCaptureCount < AUDIO_CAPTURE_MAX)
+		audioCapture[audioCaptureCount++] = value;
+	if (recorder && TCCR2B)
+		recorder->audio_sample(value);
+	if (enableSound && TCCR2B)
+	{
+		// raw pcm sample at 15.7khz
+		while (audioRing.isFull()) SDL_Delay(1);
+		SDL_LockAudio();
+		audioRing.push(value);
+		SDL_UnlockAudio();
+	}
+}
+
+void avr8::io_write_spdr(u8 addr,u8 value)
+{
+	sync_hardware();
         if((SPCR & 0x40) && SD_ENABLED()){ // only if SPI is enabled and card is present
             spiByte = value;
             //TODO: flag collision if x-fer in progress
@@ -476,20 +967,21 @@ void avr8::write_io(u8 addr,u8 value)
         }
        // SPI_DEBUG("SPDR: %0.2X\n",value);
         io[addr] = value;
-    }
-    else if(addr == ports::SPCR)
-    {
-        SPI_DEBUG("SPCR: %02X\n",value);
-        io[addr] = value;
-        if(SD_ENABLED()) spi_calculateClock();
-    }
-    else if(addr == ports::SPSR){
-        SPI_DEBUG("SPSR: %02X\n",value);
-        io[addr] = value;
-        if(SD_ENABLED()) spi_calculateClock();
-    }
+	hwQuiet = 0;
+}
+
+void avr8::io_write_spcr(u8 addr,u8 value)
+{
+	sync_hardware();
+	SPI_DEBUG("%s: %02X\n",addr == ports::SPCR? "SPCR" : "SPSR",value);
+	io[addr] = value;
+	if(SD_ENABLED()) spi_calculateClock();
+	hwQuiet = 0;
+}
 
-    else if(addr == ports::EECR){
+void avr8::io_write_eecr(u8 addr,u8 value)
+{
+	sync_hardware();
         //printf("writing to port %s (%x) pc = %x\n",port_name(addr),value,pc-1);
         //EEPROM can only be put into either read or write mode, and the master bit must be set
 
@@ -516,80 +1008,58 @@ void avr8::write_io(u8 addr,u8 value)
         else{
             io[addr] = value;
         }
-    }
-    else if(addr == ports::EEARH || addr == ports::EEARL || addr == ports::EEDR){
-        //printf("writing to port %s (%x) pc = %x\n",port_name(addr),value,pc-1);
-		io[addr] = value;
-    }
-    else if(addr == ports::TIFR1){
-		//clear flags by writing logical one
-		io[addr] &= ~(value);
-    }
-
-	#ifdef USE_PORT_PRINT
-    else if(addr == ports::res3A){
-        // emulator-only whisper support
-        printf("%c",value);
-    }
-    else if(addr == ports::res39){
-        // emulator-only whisper support
-        printf("%02x",value);
-    }
-	#endif
-
-	else
-		io[addr] = value;
+	hwQuiet = 0;
 }
 
-
-u8 avr8::read_io(u8 addr)
+#ifdef USE_PORT_PRINT
+void avr8::io_write_whisper(u8 addr,u8 value)
 {
-	// p106 in 644 manual; 16-bit values are latched
-	if (addr == ports::TCNT1L || addr == ports::ICR1L)
-	{
-		TEMP = io[addr+1];
-		return io[addr];
-	}
-	else if (addr == ports::TCNT1H || addr == ports::ICR1H){
-		return TEMP;
-    }
+	// emulator-only whisper support
+	if (speculating)
+		return;
+	if (addr == ports::res3A)
+		printf("%c",value);
 	else
-	{
-		return io[addr];
-	}
+		printf("%02x",value);
 }
+#endif
 
 
-
-u8 avr8::exec()
+// Predecoded instruction handlers, see decode()
+enum
 {
+	OP_DECODE = 0,	// not decoded yet, or progmem changed underneath
+	OP_ILLEGAL,
+	OP_NOP, OP_MOVW, OP_MULS, OP_MULSU, OP_FMUL, OP_FMULS, OP_FMULSU, OP_MUL,
+	OP_CPC, OP_SBC, OP_ADD, OP_CPSE, OP_CP, OP_SUB, OP_ADC,
+	OP_AND, OP_EOR, OP_OR, OP_MOV,
+	OP_CPI, OP_SBCI, OP_SUBI, OP_ORI, OP_ANDI, OP_LDI,
+	OP_LDD_Y, OP_LDD_Z, OP_STD_Y, OP_STD_Z,
+	OP_LDS, OP_LD_ZINC, OP_LD_ZDEC, OP_LD_YINC, OP_LD_YDEC, OP_LD_X, OP_LD_XINC, OP_LD_XDEC, OP_POP,
+	OP_STS, OP_ST_ZINC, OP_ST_ZDEC, OP_ST_YINC, OP_ST_YDEC, OP_ST_X, OP_ST_XINC, OP_ST_XDEC, OP_PUSH,
+	OP_LPM, OP_LPM_INC, OP_LPM_R0, OP_ELPM, OP_ELPM_INC, OP_ELPM_R0, OP_SPM,
+	OP_IJMP, OP_JMP, OP_CALL, OP_RET, OP_ICALL, OP_RETI, OP_WDR,
+	OP_COM, OP_NEG, OP_SWAP, OP_INC, OP_ASR, OP_LSR, OP_ROR, OP_DEC,
+	OP_BSET, OP_BCLR, OP_BLD, OP_BST,
+	OP_ADIW, OP_SBIW, OP_CBI, OP_SBI, OP_SBIC, OP_SBIS, OP_SBRC, OP_SBRS,
+	OP_IN, OP_OUT, OP_RJMP, OP_RCALL, OP_BRBS, OP_BRBC,
+	// "load Rd; out PORTC,Rd" pairs, see decode()
+	OP_LDI_PORTC, OP_MOV_PORTC, OP_LD_XINC_PORTC, OP_LD_YINC_PORTC, OP_LD_ZINC_PORTC, OP_LPM_INC_PORTC,
+};
 
-	u16 lastpc = pc;
-	u16 insn = progmem[pc++];
-	u8 cycles = 1;				// Most insns run in one cycle, so assume that
-	u8 Rd, Rr, R, d, CH;
-	u16 uTmp, Rd16, R16;
-	s16 sTmp;
-
-	if (enableGdb == true)
-	{
-		gdb->exec();
-	
-		// Check if the next instruction match a GDB breakpoint
-		Breakpoints::iterator ii;
-  		if ((ii= find(gdb->BP.begin(), gdb->BP.end(), pc)) != gdb->BP.end())
-		{
-			gdbBreakpointFound = true;
-			return 0;
-		}
-	}
-
-	if (state == CPU_STOPPED)
-		return 0;
-
-
+// Splits a program word into handler and operands once, so exec() only
+// has to dispatch. Two word insns take their second word along, and skips
+// take the size of the insn they skip; both are why invalidate_insn() also
+// drops the word before the one that changed.
+void avr8::decode(u16 addr)
+{
+	u16 insn = progmem[addr];
+	u16 next = progmem[(addr + 1) & progMask];
+	Insn &dec = decoded[addr];
+	u8 op = OP_ILLEGAL, d = 0, r = 0;
+	u16 k = 0;
 
-	switch (insn >> 12) 
+	switch (insn >> 12)
 	{
 	case 0:
 	  /*0000 0000 0000 0000		NOP
@@ -602,87 +1072,21 @@ u8 avr8::exec()
 		0000 01rd dddd rrrr		CPC Rd,Rr
 		0000 10rd dddd rrrr		SBC Rd,Rr
 		0000 11rd dddd rrrr		ADD Rd,Rr (LSL is ADD Rd,Rd)*/
-		switch(insn >> 8)
+		switch (insn >> 8)
 		{
-		case 0: /*NOP*/; 
-			break;
-		case 1: /*MOVW*/ 
-			// Don't use tab because the operand is really wide
-			Rd = D4 << 1; 
-			Rr = R4 << 1; 
-			r[Rd] = r[Rr]; 
-			r[Rd+1] = r[Rr+1]; 
-			break;
-		case 2: /*MULS*/ 
-			Rd = r[D4 + 16]; 
-			Rr = r[R4 + 16];
-			sTmp = (s8)Rd * (s8)Rr; 
-			r0 = (u8)sTmp; 
-			r1 = (u8)(sTmp >> 8);
-			UPDATE_CZ_MUL(sTmp);
-			cycles=2;
-			break;
-		case 3: /*MULSU/FMULS/FMULSU*/ 
-			switch (insn & 0x88)
-			{
-			case 0x00:/*MULSU*/
-				Rd = r[D3 + 16];
-				Rr = r[R3 + 16]; 
-				sTmp = (s8)Rd * (u8)Rr; 
-				r0 = (u8)sTmp; 
-				r1 = (u8)(sTmp >> 8);
-				UPDATE_CZ_MUL(sTmp);
-				cycles=2;
-				break;
-			case 0x08:/*FMUL*/
-				Rd = r[D3 + 16];
-				Rr = r[R3 + 16]; 
-				uTmp = (u8)Rd * (u8)Rr; 
-				r0 = (u8)(uTmp << 1); 
-				r1 = (u8)(uTmp >> 7);
-				UPDATE_CZ_MUL(uTmp);
-				cycles=2;
-				break;
-			case 0x80:/*FMULS*/
-				Rd = r[D3 + 16];
-				Rr = r[R3 + 16]; 
-				sTmp = (s8)Rd * (s8)Rr; 
-				r0 = (u8)(sTmp << 1); 
-				r1 = (u8)(sTmp >> 7);
-				UPDATE_CZ_MUL(sTmp);
-				cycles=2;
-				break;
-			case 0x88:/*FMULSU*/
-				Rd = r[D3 + 16];
-				Rr = r[R3 + 16]; 
-				sTmp = (s8)Rd * (u8)Rr; 
-				r0 = (u8)(sTmp << 1); 
-				r1 = (u8)(sTmp >> 7);
-				UPDATE_CZ_MUL(sTmp);
-				cycles=2;
-				break;
-			}
-			break;
-		case 4: case 5: case 6: case 7: /*CPC*/
-			Rd = r[D5];
-			Rr = r[R5];
-			R = Rd - Rr - C;
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; if (R) CLEAR_Z;
-			break;
-		case 8: case 9: case 10: case 11: /*SBC*/
-			Rd = r[d = D5];
-			Rr = r[R5];
-			R = Rd - Rr - C;
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; if (R) CLEAR_Z;
-			r[d] = R;
-			break;
-		case 12: case 13: case 14: case 15: /*ADD*/
-			Rd = r[d = D5];
-			Rr = r[R5];
-			R = Rd + Rr;
-			UPDATE_HC_ADD; UPDATE_SVN_ADD; UPDATE_Z; 
-			r[d] = R;
+		case 0: op = OP_NOP; break;
+		// Don't use tab because the operand is really wide
+		case 1: op = OP_MOVW; d = D4 << 1; r = R4 << 1; break;
+		case 2: op = OP_MULS; d = D4 + 16; r = R4 + 16; break;
+		case 3:
+			static const u8 mulOps[4] = { OP_MULSU, OP_FMUL, OP_FMULS, OP_FMULSU };
+			op = mulOps[((insn >> 6) & 2) | ((insn >> 3) & 1)];
+			d = D3 + 16;
+			r = R3 + 16;
 			break;
+		case 4: case 5: case 6: case 7: op = OP_CPC; d = D5; r = R5; break;
+		case 8: case 9: case 10: case 11: op = OP_SBC; d = D5; r = R5; break;
+		default: op = OP_ADD; d = D5; r = R5; break;
 		}
 		break;
 	case 1:
@@ -690,126 +1094,47 @@ u8 avr8::exec()
 		0001 01rd dddd rrrr		CP Rd,Rr
 		0001 10rd dddd rrrr		SUB Rd,Rr
 		0001 11rd dddd rrrr		ADC Rd,Rr (ROL is ADC Rd,Rd)*/
-		switch ((insn >> 10) & 3)
-		{
-		case 0: /*CPSE*/
-			Rd = r[D5];
-			Rr = r[R5];
-			if (Rd == Rr)
-			{
-				uTmp = get_insn_size(progmem[pc]);
-				cycles += uTmp;
-				pc += uTmp;
-			}
-			break;
-		case 1: /*CP*/
-			Rd = r[D5];
-			Rr = r[R5];
-			R = Rd - Rr;
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-			break;
-		case 2: /*SUB*/
-			Rd = r[d = D5];
-			Rr = r[R5];
-			R = Rd - Rr;
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-			r[d] = R;
-			break;
-		case 3: /*ADC*/
-			Rd = r[d = D5];
-			Rr = r[R5];
-			R = Rd + Rr + C;
-			UPDATE_HC_ADD; UPDATE_SVN_ADD; UPDATE_Z; 
-			r[d] = R;
-			break;
-		}
+		static const u8 ops1[4] = { OP_CPSE, OP_CP, OP_SUB, OP_ADC };
+		op = ops1[(insn >> 10) & 3];
+		d = D5;
+		r = R5;
+		k = get_insn_size(next);
 		break;
 	case 2:
 	  /*0010 00rd dddd rrrr		AND Rd,Rr (TST is AND Rd,Rd)
 		0010 01rd dddd rrrr		EOR Rd,Rr (CLR is EOR Rd,Rd)
 		0010 10rd dddd rrrr		OR Rd,Rr
 		0010 11rd dddd rrrr		MOV Rd,Rr*/
-		switch ((insn >> 10) & 3)
-		{
-		case 0: /*AND*/
-			Rd = r[d = D5];
-			Rr = r[R5];
-			R = Rd & Rr;
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
-			r[d] = R;
-			break;
-		case 1: /*EOR*/
-			Rd = r[d = D5];
-			Rr = r[R5];
-			R = Rd ^ Rr;
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
-			r[d] = R;
-			break;
-		case 2: /*OR*/
-			Rd = r[d = D5];
-			Rr = r[R5];
-			R = Rd | Rr;
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
-			r[d] = R;
-			break;
-		case 3: /*MOV*/
-			r[D5]  = r[R5];
-			break;
-		}
+		static const u8 ops2[4] = { OP_AND, OP_EOR, OP_OR, OP_MOV };
+		op = ops2[(insn >> 10) & 3];
+		d = D5;
+		r = R5;
 		break;
 	case 3: /*0011 KKKK dddd KKKK		CPI Rd,K */
-		Rd = r[D4 + 16];
-		Rr = K8;
-		R = Rd - Rr;
-		UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-		break;
 	case 4: /*0100 KKKK dddd KKKK		SBCI Rd,K */
-		Rd = r[d = D4 + 16];
-		Rr = K8;
-		R = Rd - Rr - C;
-		UPDATE_HC_SUB; UPDATE_SVN_SUB; if (R) CLEAR_Z;
-		r[d] = R;
-		break;
 	case 5: /*0101 KKKK dddd KKKK		SUBI Rd,K */
-		Rd = r[d = D4 + 16];
-		Rr = K8;
-		R = Rd - Rr;
-		UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-		r[d] = R;
-		break;
 	case 6: /*0110 KKKK dddd KKKK		ORI Rd,K (same as SBR insn) */
-		Rd = r[d = D4 + 16];
-		Rr = K8;
-		R = Rd | Rr;
-		UPDATE_SVN_LOGICAL; UPDATE_Z;
-		r[d] = R;
-		break;
 	case 7: /*0111 KKKK dddd KKKK		ANDI Rd,K (CBR is ANDI with K complemented) */
-		Rd = r[d = D4 + 16];
-		Rr = K8;
-		R = Rd & Rr;
-		UPDATE_SVN_LOGICAL; UPDATE_Z;
-		r[d] = R;
+	case 14: /*1110 KKKK dddd KKKK		LDI Rd,K (SER is just LDI Rd,255) */
+		static const u8 opsK[16] = { 0, 0, 0, OP_CPI, OP_SBCI, OP_SUBI, OP_ORI, OP_ANDI, 0, 0, 0, 0, 0, 0, OP_LDI, 0 };
+		op = opsK[insn >> 12];
+		d = D4 + 16;
+		r = K8;
 		break;
 	case 8: case 10:
 	  /*10q0 qq0d dddd 0qqq		LD Rd,Z+q
 		10q0 qq0d dddd 1qqq		LD Rd,Y+q
 		10q0 qq1d dddd 0qqq		ST Z+q,Rd
 		10q0 qq1d dddd 1qqq		ST Y+q,Rd */
-		Rd = D5;
-		Rr = (insn & 7) | ((insn >> 7) & 0x18) | ((insn >> 8) & 0x20);
-		uTmp = ((insn & 0x8)? Y : Z) + Rr;
-		if (insn & 0x200)	/*ST*/
-		{
-			write_sram(uTmp, r[Rd]);
-		}
-		else /*LD*/
-		{
-			r[Rd] = read_sram(uTmp);
-		}
-		cycles=2;
+		if (insn & 0x200)
+			op = (insn & 0x8)? OP_STD_Y : OP_STD_Z;
+		else
+			op = (insn & 0x8)? OP_LDD_Y : OP_LDD_Z;
+		d = D5;
+		r = (insn & 7) | ((insn >> 7) & 0x18) | ((insn >> 8) & 0x20);
 		break;
 	case 9:
+		d = D5;
 		switch ((insn>>8) & 15)
 		{
 		case 0: case 1:
@@ -826,73 +1151,11 @@ u8 avr8::exec()
 			1001 000d dddd 1101		LD rd,X+
 			1001 000d dddd 1110		LD rd,-X
 			1001 000d dddd 1111		POP Rd */
-			switch (insn & 15)
-			{
-			case 0: // LDS Rd,k
-				r[D5] = read_sram(progmem[pc++]);
-				cycles=2;
-				break;
-			case 1:	// LD Rd,Z+
-				r[D5] = read_sram(Z);
-				INC_Z;
-				cycles=2;
-				break;
-			case 2: // LD Rd,-Z
-				DEC_Z;
-				r[D5] = read_sram(Z);
-				cycles=2;
-				break;
-			case 4: // LPM Rd,Z
-				r[D5] = read_progmem(Z);
-				cycles=3;
-				break;
-			case 5: //LPM Rd,Z+
-				r[D5] = read_progmem(Z);
-				INC_Z;
-				cycles=3;
-				break;
-			case 6: //ELPM Rd,Z
-				r[D5] = read_progmem(Z);
-				cycles=3;
-				break;
-			case 7: //ELPM Rd,Z+
-				r[D5] = read_progmem(Z);
-				INC_Z;
-				cycles=3;
-				break;
-			case 9: //LD Rd,Y+
-				r[D5] = read_sram(Y);
-				INC_Y;
-				cycles=2;
-				break;
-			case 10: //LD Rd,-Y
-				DEC_Y;
-				r[D5] = read_sram(Y);
-				cycles=2;
-				break;
-			case 12: //LD Rd,X
-				r[D5] = read_sram(X);
-				cycles=2;
-				break;
-			case 13: //LD Rd,X+
-				r[D5] = read_sram(X);
-				INC_X;
-				cycles=2;
-				break;
-			case 14: //LD Rd,-X
-				DEC_X;
-				r[D5] = read_sram(X);
-				cycles=2;
-				break;
-			case 15: //POP Rd
-				INC_SP;
-				r[D5] = read_sram(SP);
-				cycles=2;
-				break;
-			default:
-				ILLEGAL_OP;
-				break;
-			}
+			static const u8 loadOps[16] = {
+				OP_LDS, OP_LD_ZINC, OP_LD_ZDEC, OP_ILLEGAL, OP_LPM, OP_LPM_INC, OP_ELPM, OP_ELPM_INC,
+				OP_ILLEGAL, OP_LD_YINC, OP_LD_YDEC, OP_ILLEGAL, OP_LD_X, OP_LD_XINC, OP_LD_XDEC, OP_POP };
+			op = loadOps[insn & 15];
+			k = next;
 			break;
 		case 2: case 3:
 		  /*1001 001d dddd 0000		STS k,Rr (next word is rest of address)
@@ -904,47 +1167,11 @@ u8 avr8::exec()
 			1001 001r rrrr 1101		ST X+,Rr
 			1001 001r rrrr 1110		ST -X,Rr
 			1001 001d dddd 1111		PUSH Rd */
-			cycles=2;
-			switch (insn & 15)
-			{
-			case 0: //STS
-				write_sram(progmem[pc++],r[D5]);
-				break;
-			case 1: //ST Z+,Rs
-				write_sram(Z,r[D5]);
-				INC_Z;
-				break;
-			case 2: //ST -Z,Rs
-				DEC_Z;
-				write_sram(Z,r[D5]);
-				break;
-			case 9: //ST Y+,Rs
-				write_sram(Y,r[D5]);
-				INC_Y;
-				break;
-			case 10: //ST -Y,Rs
-				DEC_Y;
-				write_sram(Y,r[D5]);
-				break;
-			case 12: //ST X,Rs
-				write_sram(X,r[D5]);
-				break;
-			case 13: //ST X+,Rs
-				write_sram(X,r[D5]);
-				INC_X;
-				break;
-			case 14: //ST -X,Rs
-				DEC_X;
-				write_sram(X,r[D5]);
-				break;
-			case 15: //PUSH Rs
-				write_sram(SP,r[D5]);
-				DEC_SP;
-				break;
-			default:
-				ILLEGAL_OP;
-				break;
-			}
+			static const u8 storeOps[16] = {
+				OP_STS, OP_ST_ZINC, OP_ST_ZDEC, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL,
+				OP_ILLEGAL, OP_ST_YINC, OP_ST_YDEC, OP_ILLEGAL, OP_ST_X, OP_ST_XINC, OP_ST_XDEC, OP_PUSH };
+			op = storeOps[insn & 15];
+			k = next;
 			break;
 		case 4: case 5:
 		  /*1001 0100 0000 1001		IJMP (jump thru Z register)
@@ -975,349 +1202,773 @@ u8 avr8::exec()
 			// Bunch of weird cases here, check for them first and then re-decode.
 			switch (insn)
 			{
-			case 0x9409: //IJMP
-			    pc = Z;
-			    cycles = 2;
-			    break;
-			case 0x940C: // JMP; relies on fact that upper k bits are always zero!
-			    pc = progmem[pc];
-			    cycles = 3;
-			    break;
-			case 0x940E: // CALL; relies on fact that upper k bits are always zero!
-			    write_sram(SP,(pc+1));
-			    DEC_SP;
-			    write_sram(SP,(pc+1)>>8);
-			    DEC_SP;
-			    pc = progmem[pc];
-			    cycles = 4;
-			    break;
-			case 0x9419: //EIJMP
-			    pc = Z;
-			    cycles = 2;
-			    break;
-			case 0x9508: //RET
-			    INC_SP;
-			    pc = read_sram(SP) << 8;
-			    INC_SP;
-			    pc |= read_sram(SP);
-			    cycles = 4;
-			    break;
-			case 0x9509: //ICALL
-			    write_sram(SP,u8(pc));
-			    DEC_SP;
-			    write_sram(SP,(pc)>>8);
-			    DEC_SP;
-			    pc = Z;
-			    cycles = 3;
-			    break;
-			case 0x9518: //RETI
-			    INC_SP;
-			    pc = read_sram(SP) << 8;
-			    INC_SP;
-			    pc |= read_sram(SP);
-			    cycles = 4;
-			    SREG |= (1<<SREG_I);
-			    //--interruptLevel;
-			    break;
-			case 0x9519: //EICALL
-			    write_sram(SP,u8(pc));
-			    DEC_SP;
-			    write_sram(SP,(pc)>>8);
-			    DEC_SP;
-			    pc = Z;
-			    cycles = 3;
-			    break;
-			case 0x9588: //SLEEP
-			    // no operation
-			    break;
-			case 0x9598: //BREAK
-			    // no operation
-			    break;
-			case 0x95A8: //WDR
-
-				//watchdog is based on a RC oscillator
-				//so add some random variation to simulate entropy
-				watchdogTimer=rand()%1024;
-
-			    if(prevWDR){
-			        printf("WDR measured %u cycles\n", cycleCounter - prevWDR);
-			        prevWDR = 0;
-			    }else{
-			    	prevWDR = cycleCounter + 1;
-			    }
+			case 0x9409: op = OP_IJMP; break;
+			case 0x940C: op = OP_JMP; k = next; break;		// relies on fact that upper k bits are always zero!
+			case 0x940E: op = OP_CALL; k = next; break;		// relies on fact that upper k bits are always zero!
+			case 0x9419: op = OP_IJMP; break;		// EIJMP
+			case 0x9508: op = OP_RET; break;
+			case 0x9509: op = OP_ICALL; break;
+			case 0x9518: op = OP_RETI; break;
+			case 0x9519: op = OP_ICALL; break;		// EICALL
+			case 0x9588: op = OP_NOP; break;		// SLEEP
+			case 0x9598: op = OP_NOP; break;		// BREAK
+			case 0x95A8: op = OP_WDR; break;
+			case 0x95C8: op = OP_LPM_R0; break;
+			case 0x95D8: op = OP_ELPM_R0; break;
+			case 0x95E8: op = OP_SPM; break;
+			default:
+				static const u8 unaryOps[16] = {
+					OP_COM, OP_NEG, OP_SWAP, OP_INC, OP_ILLEGAL, OP_ASR, OP_LSR, OP_ROR,
+					OP_BSET, OP_ILLEGAL, OP_DEC, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL };
+				op = unaryOps[insn & 15];
+				if (op == OP_BSET)
+				{
+					//SEx/CLx,"CZNVSHTI"
+					if (insn & 0x80)
+						op = OP_BCLR;
+					d = (insn>>4)&7;
+				}
+				break;
+			}
+			break;
+		case 6:
+		  /*1001 0110 KKdd KKKK		ADIW Rd+1:Rd,K   (16-bit add to upper four register pairs) */
+		case 7:
+		  /*1001 0111 KKdd KKKK		SBIW Rd+1:Rd,K */
+			op = (insn & 0x100)? OP_SBIW : OP_ADIW;
+			d = ((insn >> 3) & 0x6) + 24;
+			r = ((insn >> 2) & 0x30) | (insn & 0xF);
+			break;
+		case 8: /*1001 1000 AAAA Abbb		CBI A,b */
+		case 9: /*1001 1001 AAAA Abbb		SBIC A,b */
+		case 10: /*1001 1010 AAAA Abbb		SBI A,b */
+		case 11: /*1001 1011 AAAA Abbb		SBIS A,b */
+			static const u8 bitOps[4] = { OP_CBI, OP_SBIC, OP_SBI, OP_SBIS };
+			op = bitOps[(insn >> 8) & 3];
+			d = (insn >> 3) & 31;
+			r = insn & 7;
+			k = get_insn_size(next);
+			break;
+		default:
+		  /*1001 11rd dddd rrrr		MUL Rd,Rr */
+			op = OP_MUL;
+			r = R5;
+			break;
+		}
+		break;
+	case 11:
+	  /*1011 0AAd dddd AAAA		IN Rd,A
+		1011 1AAd dddd AAAA		OUT A,Rd */
+		op = (insn & 0x0800)? OP_OUT : OP_IN;
+		d = D5;
+		r = ((insn >> 5) & 0x30) | (insn & 0xF);
+		break;
+	case 12: /*1100 kkkk kkkk kkkk		RJMP k */
+	case 13: /*1101 kkkk kkkk kkkk		RCALL k */
+		op = (insn & 0x1000)? OP_RCALL : OP_RJMP;
+		k = addr + 1 + k12;
+		break;
+	case 15:
+	  /*1111 00kk kkkk ksss		BRBS s,k (same here)
+		1111 01kk kkkk ksss		BRBC s,k (BRCC, etc are aliases for this with sss implicit)
+		1111 100d dddd 0bbb		BLD Rd,b
+		1111 101d dddd 0bbb		BST Rd,b
+		1111 110r rrrr 0bbb		SBRC Rr,b
+		1111 111r rrrr 0bbb		SBRS Rr,b */
+		static const u8 ops15[8] = { OP_BRBS, OP_BRBS, OP_BRBC, OP_BRBC, OP_BLD, OP_BST, OP_SBRC, OP_SBRS };
+		op = ops15[(insn >> 9) & 7];
+		d = D5;
+		r = insn & 7;
+		if (op == OP_BRBS || op == OP_BRBC)
+			k = addr + 1 + k7;
+		else
+			k = get_insn_size(next);
+		break;
+	}
+
+	// The video kernels and mode 9 code tiles put out nearly every pixel as
+	// a load into a register followed by "out PORTC" of it. Such a pair runs
+	// as one op, which falls back to just the load when a hardware event is
+	// due in between, so both halves still see their own cycle.
+	if ((next & 0xF800) == 0xB800 && (((next >> 5) & 0x30) | (next & 0xF)) == ports::PORTC &&
+		((next >> 4) & 0x1F) == d)
+	{
+		switch (op)
+		{
+		case OP_LDI: op = OP_LDI_PORTC; break;
+		case OP_MOV: op = OP_MOV_PORTC; break;
+		case OP_LD_XINC: op = OP_LD_XINC_PORTC; break;
+		case OP_LD_YINC: op = OP_LD_YINC_PORTC; break;
+		case OP_LD_ZINC: op = OP_LD_ZINC_PORTC; break;
+		case OP_LPM_INC: op = OP_LPM_INC_PORTC; break;
+		}
+	}
+
+	dec.d = d;
+	dec.r = r;
+	dec.k = k;
+	dec.op = op;
+}
+
+u32 avr8::exec()
+{
+	u16 addr = pc++;
+	u32 cycles = 1;				// Most insns run in one cycle, so assume that
+	u8 Rd, Rr, R, d;
+	u16 uTmp, Rd16, R16;
+	s16 sTmp;
+
+	if (enableGdb == true)
+	{
+		// The debugger may look at anything, keep the hardware current
+		hwQuiet = 0;
+		gdb->exec();
+
+		// Check if the next instruction match a GDB breakpoint
+		Breakpoints::iterator ii;
+  		if ((ii= find(gdb->BP.begin(), gdb->BP.end(), pc)) != gdb->BP.end())
+		{
+			gdbBreakpointFound = true;
+			return 0;
+		}
+	}
+
+	if (state == CPU_STOPPED)
+		return 0;
+
+	addr &= progMask;
+	if (decoded[addr].op == OP_DECODE)
+		decode(addr);
+	const Insn &insn = decoded[addr];
+
+	switch (insn.op)
+	{
+	case OP_NOP:
+		break;
+	case OP_MOVW:
+		r[insn.d] = r[insn.r];
+		r[insn.d+1] = r[insn.r+1];
+		break;
+	case OP_MULS:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		sTmp = (s8)Rd * (s8)Rr;
+		r0 = (u8)sTmp;
+		r1 = (u8)(sTmp >> 8);
+		UPDATE_CZ_MUL(sTmp);
+		cycles=2;
+		break;
+	case OP_MULSU:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		sTmp = (s8)Rd * (u8)Rr;
+		r0 = (u8)sTmp;
+		r1 = (u8)(sTmp >> 8);
+		UPDATE_CZ_MUL(sTmp);
+		cycles=2;
+		break;
+	case OP_FMUL:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		uTmp = (u8)Rd * (u8)Rr;
+		r0 = (u8)(uTmp << 1);
+		r1 = (u8)(uTmp >> 7);
+		UPDATE_CZ_MUL(uTmp);
+		cycles=2;
+		break;
+	case OP_FMULS:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		sTmp = (s8)Rd * (s8)Rr;
+		r0 = (u8)(sTmp << 1);
+		r1 = (u8)(sTmp >> 7);
+		UPDATE_CZ_MUL(sTmp);
+		cycles=2;
+		break;
+	case OP_FMULSU:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		sTmp = (s8)Rd * (u8)Rr;
+		r0 = (u8)(sTmp << 1);
+		r1 = (u8)(sTmp >> 7);
+		UPDATE_CZ_MUL(sTmp);
+		cycles=2;
+		break;
+	case OP_MUL:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		uTmp = Rd * Rr;
+		r0 = (u8)uTmp;
+		r1 = (u8)(uTmp >> 8);
+		UPDATE_CZ_MUL(uTmp);
+		cycles=2;
+		break;
+
+	case OP_CPC:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		R = Rd - Rr - C;
+		LAZY_ARITH(FLAGS_SUBC);
+		break;
+	case OP_SBC:
+		Rd = r[d = insn.d];
+		Rr = r[insn.r];
+		R = Rd - Rr - C;
+		LAZY_ARITH(FLAGS_SUBC);
+		r[d] = R;
+		break;
+	case OP_ADD:
+		Rd = r[d = insn.d];
+		Rr = r[insn.r];
+		R = Rd + Rr;
+		LAZY_ARITH(FLAGS_ADD);
+		r[d] = R;
+		break;
+	case OP_CPSE:
+		if (r[insn.d] == r[insn.r])
+		{
+			cycles += insn.k;
+			pc += insn.k;
+		}
+		break;
+	case OP_CP:
+		Rd = r[insn.d];
+		Rr = r[insn.r];
+		R = Rd - Rr;
+		LAZY_ARITH(FLAGS_SUB);
+		break;
+	case OP_SUB:
+		Rd = r[d = insn.d];
+		Rr = r[insn.r];
+		R = Rd - Rr;
+		LAZY_ARITH(FLAGS_SUB);
+		r[d] = R;
+		break;
+	case OP_ADC:
+		Rd = r[d = insn.d];
+		Rr = r[insn.r];
+		R = Rd + Rr + C;
+		LAZY_ARITH(FLAGS_ADD);
+		r[d] = R;
+		break;
+	case OP_AND:
+		r[insn.d] = R = r[insn.d] & r[insn.r];
+		LAZY_LOGIC(FLAGS_LOGIC);
+		break;
+	case OP_EOR:
+		r[insn.d] = R = r[insn.d] ^ r[insn.r];
+		LAZY_LOGIC(FLAGS_LOGIC);
+		break;
+	case OP_OR:
+		r[insn.d] = R = r[insn.d] | r[insn.r];
+		LAZY_LOGIC(FLAGS_LOGIC);
+		break;
+	case OP_MOV:
+		r[insn.d] = r[insn.r];
+		break;
+
+	case OP_CPI:
+		Rd = r[insn.d];
+		Rr = insn.r;
+		R = Rd - Rr;
+		LAZY_ARITH(FLAGS_SUB);
+		break;
+	case OP_SBCI:
+		Rd = r[d = insn.d];
+		Rr = insn.r;
+		R = Rd - Rr - C;
+		LAZY_ARITH(FLAGS_SUBC);
+		r[d] = R;
+		break;
+	case OP_SUBI:
+		Rd = r[d = insn.d];
+		Rr = insn.r;
+		R = Rd - Rr;
+		LAZY_ARITH(FLAGS_SUB);
+		r[d] = R;
+		break;
+	case OP_ORI:
+		r[insn.d] = R = r[insn.d] | insn.r;
+		LAZY_LOGIC(FLAGS_LOGIC);
+		break;
+	case OP_ANDI:
+		r[insn.d] = R = r[insn.d] & insn.r;
+		LAZY_LOGIC(FLAGS_LOGIC);
+		break;
+	case OP_LDI:
+		r[insn.d] = insn.r;
+		break;
+
+	case OP_LDD_Y:
+		r[insn.d] = read_sram(Y + insn.r);
+		cycles=2;
+		break;
+	case OP_LDD_Z:
+		r[insn.d] = read_sram(Z + insn.r);
+		cycles=2;
+		break;
+	case OP_STD_Y:
+		write_sram(Y + insn.r, r[insn.d]);
+		cycles=2;
+		break;
+	case OP_STD_Z:
+		write_sram(Z + insn.r, r[insn.d]);
+		cycles=2;
+		break;
+
+	case OP_LDS:
+		r[insn.d] = read_sram(insn.k);
+		pc++;
+		cycles=2;
+		break;
+	case OP_LD_ZINC:
+		r[insn.d] = read_sram(Z);
+		INC_Z;
+		cycles=2;
+		break;
+	case OP_LD_ZDEC:
+		DEC_Z;
+		r[insn.d] = read_sram(Z);
+		cycles=2;
+		break;
+	case OP_LD_YINC:
+		r[insn.d] = read_sram(Y);
+		INC_Y;
+		cycles=2;
+		break;
+	case OP_LD_YDEC:
+		DEC_Y;
+		r[insn.d] = read_sram(Y);
+		cycles=2;
+		break;
+	case OP_LD_X:
+		r[insn.d] = read_sram(X);
+		cycles=2;
+		break;
+	case OP_LD_XINC:
+		r[insn.d] = read_sram(X);
+		INC_X;
+		cycles=2;
+		break;
+	case OP_LD_XDEC:
+		DEC_X;
+		r[insn.d] = read_sram(X);
+		cycles=2;
+		break;
+	case OP_POP:
+		INC_SP;
+		r[insn.d] = read_sram(SP);
+		cycles=2;
+		break;
+
+	case OP_STS:
+		write_sram(insn.k,r[insn.d]);
+		pc++;
+		cycles=2;
+		break;
+	case OP_ST_ZINC:
+		write_sram(Z,r[insn.d]);
+		INC_Z;
+		cycles=2;
+		break;
+	case OP_ST_ZDEC:
+		DEC_Z;
+		write_sram(Z,r[insn.d]);
+		cycles=2;
+		break;
+	case OP_ST_YINC:
+		write_sram(Y,r[insn.d]);
+		INC_Y;
+		cycles=2;
+		break;
+	case OP_ST_YDEC:
+		DEC_Y;
+		write_sram(Y,r[insn.d]);
+		cycles=2;
+		break;
+	case OP_ST_X:
+		write_sram(X,r[insn.d]);
+		cycles=2;
+		break;
+	case OP_ST_XINC:
+		write_sram(X,r[insn.d]);
+		INC_X;
+		cycles=2;
+		break;
+	case OP_ST_XDEC:
+		DEC_X;
+		write_sram(X,r[insn.d]);
+		cycles=2;
+		break;
+	case OP_PUSH:
+		write_sram(SP,r[insn.d]);
+		DEC_SP;
+		WATCH_SP;
+		cycles=2;
+		break;
+
+	case OP_LPM:
+		r[insn.d] = read_progmem(Z);
+		cycles=3;
+		break;
+	case OP_LPM_INC:
+		r[insn.d] = read_progmem(Z);
+		INC_Z;
+		cycles=3;
+		break;
+	case OP_LPM_R0:
+		r0 = read_progmem(Z);
+		cycles = 3;
+		break;
+	case OP_ELPM:
+		r[insn.d] = read_progmem_far(RAMPZ_Z);
+		cycles=3;
+		break;
+	case OP_ELPM_INC:
+		r[insn.d] = read_progmem_far(RAMPZ_Z);
+		INC_RAMPZ_Z;
+		cycles=3;
+		break;
+	case OP_ELPM_R0:
+		r0 = read_progmem_far(RAMPZ_Z);
+		cycles = 3;
+		break;
+	case OP_SPM:
+		if (Z >= progSize/2)
+		{
+			fprintf(stderr,"illegal write to progmem addr %x\n",Z);
+			shutdown(1);
+		}
+		else
+		{
+			progmem[Z] = r0 | (r1<<8);
+			invalidate_insn(Z);
+			idleStage = IDLE_NONE;
+		}
+		cycles = 4; // undocumented?!?!?
+		break;
 
-			break;
-			case 0x95C8: //LPM r0,Z
-			    r0 = read_progmem(Z);
-			    cycles = 3;
-			    break;
-			case 0x95D8: //ELPM r0,Z
-			    r0 = read_progmem(Z);
-			    cycles = 3;
-			    break;
-			case 0x95E8: //SPM
-			    if (Z >= progSize/2)
-				{
-					fprintf(stderr,"illegal write to progmem addr %x\n",Z);
-                    shutdown(1);
-				}
-				else
-					progmem[Z] = r0 | (r1<<8);
-			    cycles = 4; // undocumented?!?!?
-			    break;
-			default:
-			    /*1001 010d dddd 0000		COM Rd
-				1001 010d dddd 0001		NEG Rd
-				1001 010d dddd 0010		SWAP Rd
-				1001 010d dddd 0011		INC Rd
-				1001 010d dddd 0101		ASR Rd
-				1001 010d dddd 0110		LSR Rd
-				1001 010d dddd 0111		ROR Rd
-				1001 0100 0sss 1000		BSET s (SEC, etc are aliases with sss implicit)
-				1001 0100 1sss 1000		BCLR s (CLC, etc are aliases with sss implicit)
-				1001 010d dddd 1010		DEC Rd */
-			    switch (insn & 15)
-				{
-				case 0: //COM Rd
-					r[D5] = R = ~r[D5];
-					UPDATE_SVN_LOGICAL; UPDATE_Z; SET_C;
-					break;
-				case 1: //NEG Rd
-					Rr = r[D5];
-					Rd = 0;
-					r[D5] = R = Rd - Rr;
-					UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-					break;
-				case 2: //SWAP Rd
-					Rd = r[D5];
-					r[D5] = (Rd >> 4) | (Rd << 4);
-					break;
-				case 3: //INC Rd
-					R = ++r[D5];
-					UPDATE_N;
-					set_bit(SREG,SREG_V,R==0x80);
-					UPDATE_S;
-					UPDATE_Z;
-					break;
-				case 5: //ASR Rd
-					Rd = r[D5];
-					set_bit(SREG,SREG_C,Rd&1);
-					r[D5] = R = (Rd >> 1) | (Rd & 0x80);
-					UPDATE_N;
-					set_bit(SREG,SREG_V,(R>>7)^(Rd&1));
-					UPDATE_S;
-					UPDATE_Z;
-					break;
-				case 6: //LSR Rd
-					Rd = r[D5];
-					set_bit(SREG,SREG_C,Rd&1);
-					r[D5] = R = (Rd >> 1);
-					UPDATE_N;
-					set_bit(SREG,SREG_V,Rd&1);
-					UPDATE_S;
-					UPDATE_Z;
-					break;
-				case 7: //ROR Rd
-					Rd = r[D5];
-					r[D5] = R = (Rd >> 1) | ((SREG&1)<<7);
-					set_bit(SREG,SREG_C,Rd&1);
-					UPDATE_N;
-					set_bit(SREG,SREG_V,(R>>7)^(Rd&1));
-					UPDATE_S;
-					UPDATE_Z;
-					break;
-				case 8: //Clear/Set flags
-					Rd = (insn>>4)&7;
-					if (insn & 0x80)
-					{
-						//CLx,"CZNVSHTI"
-						SREG &= ~(1<<Rd);
-					}
-					else
-					{
-						//SEx,"CZNVSHTI"
-						SREG |= (1<<Rd);
-					}
-					break;
-				case 10: //DEC Rd
-					R = --r[D5];
-					UPDATE_N;
-					set_bit(SREG,SREG_V,R==0x7F);
-					UPDATE_S;
-					UPDATE_Z;
-					break;
-				default:
-					ILLEGAL_OP;
-					break;
-				}
-			    break;
-			}
-			break;
-		case 6:
-		  /*1001 0110 KKdd KKKK		ADIW Rd+1:Rd,K   (16-bit add to upper four register pairs) */
-			Rd = ((insn >> 3) & 0x6) + 24;
-			Rr = ((insn >> 2) & 0x30) | (insn & 0xF);
-			Rd16 = r[Rd] | (r[Rd+1]<<8);
-			R16 = Rd16 + Rr;
-			r[Rd] = (u8)R16;
-			r[Rd+1] = (u8)(R16>>8);
-			set_bit(SREG,SREG_V,(~Rd16&R16)&0x8000);
-			set_bit(SREG,SREG_N,R16&0x8000);
-			UPDATE_S;
-			set_bit(SREG,SREG_Z,!R16);
-			set_bit(SREG,SREG_C,(~R16&Rd16)&0x8000);
-			cycles=2;
-			break;
-		case 7:
-		  /*1001 0111 KKdd KKKK		SBIW Rd+1:Rd,K */
-			Rd = ((insn >> 3) & 0x6) + 24;
-			Rr = ((insn >> 2) & 0x30) | (insn & 0xF);
-			Rd16 = r[Rd] | (r[Rd+1]<<8);
-			R16 = Rd16 - Rr;
-			r[Rd] = (u8)R16;
-			r[Rd+1] = (u8)(R16>>8);
-			set_bit(SREG,SREG_V,(Rd16&~R16)&0x8000);
-			set_bit(SREG,SREG_N,R16&0x8000);
-			UPDATE_S;
-			set_bit(SREG,SREG_Z,!R16);
-			set_bit(SREG,SREG_C,(R16&~Rd16)&0x8000);
-			cycles=2;
-			break;
-		case 8:
-		  /*1001 1000 AAAA Abbb		CBI A,b */
-			Rd = (insn >> 3) & 31;
-			write_io(Rd, read_io(Rd) & ~(1<<(insn&7)));
-			cycles=2;
-			break;
-		case 9:
-		  /*1001 1001 AAAA Abbb		SBIC A,b */
-			Rd = (insn >> 3) & 31;
-			if (!(read_io(Rd) & (1<<(insn&7))))
-			{
-				uTmp = get_insn_size(progmem[pc]);
-				cycles += uTmp;
-				pc += uTmp;
-			}
-			break;
-		case 10:
-		  /*1001 1010 AAAA Abbb		SBI A,b */
-			Rd = (insn >> 3) & 31;
-			write_io(Rd, read_io(Rd) | (1<<(insn&7)));
-			cycles=2;
-			break;
-		case 11:
-		  /*1001 1011 AAAA Abbb		SBIS A,b */
-			Rd = (insn >> 3) & 31;
-			if (read_io(Rd) & (1<<(insn&7)))
-			{
-				uTmp = get_insn_size(progmem[pc]);
-				cycles += uTmp;
-				pc += uTmp;
-			}
-			break;
-		case 12: case 13: case 14: case 15:
-		  /*1001 11rd dddd rrrr		MUL Rd,Rr */
-			Rd = r[D5];
-			Rr = r[R5];
-			uTmp = Rd * Rr; 
-			r0 = (u8)uTmp; 
-			r1 = (u8)(uTmp >> 8);
-			UPDATE_CZ_MUL(uTmp);
-			cycles=2;
-			break;
+	case OP_IJMP:
+		pc = Z;
+		cycles = 2;
+		break;
+	case OP_JMP:
+		pc = insn.k;
+		cycles = 3;
+		break;
+	case OP_CALL:
+		write_sram(SP,(pc+1));
+		DEC_SP;
+		write_sram(SP,(pc+1)>>8);
+		DEC_SP;
+		WATCH_SP;
+		pc = insn.k;
+		cycles = 4;
+		break;
+	case OP_RET:
+		INC_SP;
+		pc = read_sram(SP) << 8;
+		INC_SP;
+		pc |= read_sram(SP);
+		cycles = 4;
+		break;
+	case OP_ICALL:
+		write_sram(SP,u8(pc));
+		DEC_SP;
+		write_sram(SP,(pc)>>8);
+		DEC_SP;
+		WATCH_SP;
+		pc = Z;
+		cycles = 3;
+		break;
+	case OP_RETI:
+		INC_SP;
+		pc = read_sram(SP) << 8;
+		INC_SP;
+		pc |= read_sram(SP);
+		cycles = 4;
+		SREG |= (1<<SREG_I);
+		hwQuiet = 0;			// pending interrupts are taken right after
+		//--interruptLevel;
+		break;
+	case OP_WDR:
+		sync_hardware();
+		hwQuiet = 0;
+
+		//watchdog is based on a RC oscillator
+		//so add some random variation to simulate entropy
+		watchdogTimer=rand()%1024;
+
+		if(prevWDR){
+			if (!speculating)
+				printf("WDR measured %u cycles\n", cycleCounter - prevWDR);
+			prevWDR = 0;
+		}else{
+			prevWDR = cycleCounter + 1;
 		}
 		break;
-	case 11:
-	  /*1011 0AAd dddd AAAA		IN Rd,A
-		1011 1AAd dddd AAAA		OUT A,Rd */ 
-		Rd = D5;
-		Rr = ((insn >> 5) & 0x30) | (insn & 0xF);
-		if (insn & 0x0800) // OUT
+
+	case OP_COM:
+		r[insn.d] = R = ~r[insn.d];
+		LAZY_LOGIC(FLAGS_LOGIC); SET_C;
+		break;
+	case OP_NEG:
+		Rr = r[insn.d];
+		Rd = 0;
+		r[insn.d] = R = Rd - Rr;
+		LAZY_ARITH(FLAGS_SUB);
+		break;
+	case OP_SWAP:
+		Rd = r[insn.d];
+		r[insn.d] = (Rd >> 4) | (Rd << 4);
+		break;
+	case OP_INC:
+		R = ++r[insn.d];
+		LAZY_LOGIC(FLAGS_INC);
+		break;
+	case OP_ASR:
+		Rd = r[insn.d];
+		set_bit(SREG,SREG_C,Rd&1);
+		r[insn.d] = R = (Rd >> 1) | (Rd & 0x80);
+		UPDATE_N;
+		set_bit(SREG,SREG_V,(R>>7)^(Rd&1));
+		UPDATE_S;
+		UPDATE_Z;
+		OWN_FLAGS(LOGIC_FLAGS|(1<<SREG_C));
+		break;
+	case OP_LSR:
+		Rd = r[insn.d];
+		set_bit(SREG,SREG_C,Rd&1);
+		r[insn.d] = R = (Rd >> 1);
+		UPDATE_N;
+		set_bit(SREG,SREG_V,Rd&1);
+		UPDATE_S;
+		UPDATE_Z;
+		OWN_FLAGS(LOGIC_FLAGS|(1<<SREG_C));
+		break;
+	case OP_ROR:
+		Rd = r[insn.d];
+		r[insn.d] = R = (Rd >> 1) | (C<<7);
+		set_bit(SREG,SREG_C,Rd&1);
+		UPDATE_N;
+		set_bit(SREG,SREG_V,(R>>7)^(Rd&1));
+		UPDATE_S;
+		UPDATE_Z;
+		OWN_FLAGS(LOGIC_FLAGS|(1<<SREG_C));
+		break;
+	case OP_DEC:
+		R = --r[insn.d];
+		LAZY_LOGIC(FLAGS_DEC);
+		break;
+
+	case OP_BSET:
+		OWN_FLAGS(1<<insn.d);
+		SREG |= (1<<insn.d);
+		if (insn.d == SREG_I)
+			hwQuiet = 0;
+		break;
+	case OP_BCLR:
+		OWN_FLAGS(1<<insn.d);
+		SREG &= ~(1<<insn.d);
+		break;
+	case OP_BLD:
+		set_bit(r[insn.d],insn.r,SREG & (1<<SREG_T));
+		break;
+	case OP_BST:
+		set_bit(SREG,SREG_T,r[insn.d] & (1<<insn.r));
+		break;
+
+	case OP_ADIW:
+		Rd = insn.d;
+		Rd16 = r[Rd] | (r[Rd+1]<<8);
+		R16 = Rd16 + insn.r;
+		r[Rd] = (u8)R16;
+		r[Rd+1] = (u8)(R16>>8);
+		set_bit(SREG,SREG_V,(~Rd16&R16)&0x8000);
+		set_bit(SREG,SREG_N,R16&0x8000);
+		UPDATE_S;
+		set_bit(SREG,SREG_Z,!R16);
+		set_bit(SREG,SREG_C,(~R16&Rd16)&0x8000);
+		OWN_FLAGS(LOGIC_FLAGS|(1<<SREG_C));
+		cycles=2;
+		break;
+	case OP_SBIW:
+		Rd = insn.d;
+		Rd16 = r[Rd] | (r[Rd+1]<<8);
+		R16 = Rd16 - insn.r;
+		r[Rd] = (u8)R16;
+		r[Rd+1] = (u8)(R16>>8);
+		set_bit(SREG,SREG_V,(Rd16&~R16)&0x8000);
+		set_bit(SREG,SREG_N,R16&0x8000);
+		UPDATE_S;
+		set_bit(SREG,SREG_Z,!R16);
+		set_bit(SREG,SREG_C,(R16&~Rd16)&0x8000);
+		OWN_FLAGS(LOGIC_FLAGS|(1<<SREG_C));
+		cycles=2;
+		break;
+
+	case OP_CBI:
+		write_io(insn.d, read_io(insn.d) & ~(1<<insn.r));
+		cycles=2;
+		break;
+	case OP_SBI:
+		write_io(insn.d, read_io(insn.d) | (1<<insn.r));
+		cycles=2;
+		break;
+	case OP_SBIC:
+		if (!(read_io(insn.d) & (1<<insn.r)))
 		{
-			write_io(Rr,r[Rd]);
+			cycles += insn.k;
+			pc += insn.k;
 		}
-		else	// IN
+		break;
+	case OP_SBIS:
+		if (read_io(insn.d) & (1<<insn.r))
 		{
-			r[Rd] = read_io(Rr);
+			cycles += insn.k;
+			pc += insn.k;
 		}
 		break;
-	case 12: /*1100 kkkk kkkk kkkk		RJMP k */
-		pc += k12;
+	case OP_SBRC:
+		if (!(r[insn.d] & (1<<insn.r)))
+		{
+			cycles += insn.k;
+			pc += insn.k;
+		}
+		break;
+	case OP_SBRS:
+		if (r[insn.d] & (1<<insn.r))
+		{
+			cycles += insn.k;
+			pc += insn.k;
+		}
+		break;
+
+	case OP_IN:
+		r[insn.d] = read_io(insn.r);
+		break;
+	case OP_OUT:
+		write_io(insn.r,r[insn.d]);
+		break;
+
+	case OP_RJMP:
+		pc = insn.k;
 		cycles=2;
+		IDLE_CHECK;
 		break;
-	case 13: /*1101 kkkk kkkk kkkk		RCALL k */
+	case OP_RCALL:
 		write_sram(SP,(u8)pc);
 		DEC_SP;
 		write_sram(SP,pc>>8);
 		DEC_SP;
-		pc += k12;
+		WATCH_SP;
+		pc = insn.k;
 		cycles=3;
 		break;
-	case 14: /*1110 KKKK dddd KKKK		LDI Rd,K (SER is just LDI Rd,255) */
-		r[D4 + 16] = K8;
+	case OP_BRBS:
+		sync_flags();
+		if (SREG & (1<<insn.r))
+		{
+			pc = insn.k;
+			cycles=2;
+			IDLE_CHECK;
+		}
 		break;
-	case 15:
-	  /*1111 00kk kkkk ksss		BRBS s,k (same here)
-		1111 01kk kkkk ksss		BRBC s,k (BRCC, etc are aliases for this with sss implicit)
-		1111 100d dddd 0bbb		BLD Rd,b
-		1111 101d dddd 0bbb		BST Rd,b
-		1111 110r rrrr 0bbb		SBRC Rr,b
-		1111 111r rrrr 0bbb		SBRS Rr,b */
-		switch ((insn >> 9) & 7)
+	case OP_BRBC:
+		sync_flags();
+		if (!(SREG & (1<<insn.r)))
 		{
-		case 0: case 1: /*BRBS*/
-			sTmp = k7;
-			if (SREG & (1<<(insn&7)))
-			{
-				pc += sTmp;
-				cycles=2;
-			}
-			break;
-		case 2: case 3: /*BRBC*/
-			sTmp = k7;
-			if (!(SREG & (1<<(insn&7))))
-			{
-				pc += sTmp;
-				cycles=2;
-			}
-			break;
-		case 4: /*BLD*/
-			Rd = D5;
-			set_bit(r[Rd],insn&7,SREG & (1<<SREG_T));
-			break;
-		case 5: /*BST*/
-			Rd = r[D5];
-			set_bit(SREG,SREG_T,Rd & (1<<(insn&7)));
-			break;
-		case 6: /*SBRC*/
-			Rd = r[D5];
-			if (!(Rd & (1<<(insn&7))))
-			{
-				uTmp = get_insn_size(progmem[pc]);
-				cycles += uTmp;
-				pc += uTmp;
-			}
-			break;
-		case 7: /*SBRS*/
-			Rd = r[D5];
-			if (Rd & (1<<(insn&7)))
-			{
-				uTmp = get_insn_size(progmem[pc]);
-				cycles += uTmp;
-				pc += uTmp;
-			}
-			break;
+			pc = insn.k;
+			cycles=2;
+			IDLE_CHECK;
 		}
 		break;
-	}
 
+	case OP_LDI_PORTC:
+		r[insn.d] = insn.r;
+		OUT_PORTC(1);
+		break;
+	case OP_MOV_PORTC:
+		r[insn.d] = r[insn.r];
+		OUT_PORTC(1);
+		break;
+	case OP_LD_XINC_PORTC:
+		r[insn.d] = read_sram(X);
+		INC_X;
+		OUT_PORTC(2);
+		break;
+	case OP_LD_YINC_PORTC:
+		r[insn.d] = read_sram(Y);
+		INC_Y;
+		OUT_PORTC(2);
+		break;
+	case OP_LD_ZINC_PORTC:
+		r[insn.d] = read_sram(Z);
+		INC_Z;
+		OUT_PORTC(2);
+		break;
+	case OP_LPM_INC_PORTC:
+		r[insn.d] = read_progmem(Z);
+		INC_Z;
+		OUT_PORTC(3);
+		break;
+
+	default:
+		ILLEGAL_OP;
+		break;
+	}
 
-	update_hardware(cycles);
+	hwPending += cycles;
+	if (hwPending >= hwQuiet)
+	{
+		sync_hardware();
+		if (aheadPending)
+			run_ahead();
+	}
 
 	return cycles;
 }
 
 
+void avr8::eval_flags()
+{
+	u8 Rd = flagRd, Rr = flagRr, R = flagR;
+	u8 CH, V, flags = 0;
+
+	switch (flagOp)
+	{
+	case FLAGS_ADD:
+		CH = CARRIES;
+		V = BIT(V_ADD, 7);
+		flags = (BIT(CH, 3) << SREG_H) | (BIT(CH, 7) << SREG_C);
+		break;
+	case FLAGS_SUB:
+	case FLAGS_SUBC:
+		CH = BORROWS;
+		V = BIT(V_SUB, 7);
+		flags = (BIT(CH, 3) << SREG_H) | (BIT(CH, 7) << SREG_C);
+		break;
+	case FLAGS_INC:
+		V = (R == 0x80);
+		break;
+	case FLAGS_DEC:
+		V = (R == 0x7F);
+		break;
+	default:
+		V = 0;
+		break;
+	}
+
+	flags |= (V << SREG_V) | (BIT(R, 7) << SREG_N) | ((BIT(R, 7) ^ V) << SREG_S);
+	// The carry chained compares keep Z from the previous byte, which is
+	// current in SREG since reading C settled it
+	if (!R && (flagOp != FLAGS_SUBC || (SREG & (1<<SREG_Z))))
+		flags |= (1<<SREG_Z);
+
+	SREG = (SREG & ~flagMask) | (flags & flagMask);
+	flagMask = 0;
+}
+
 void avr8::trigger_interrupt(int location)
 {
 
@@ -1329,6 +1980,7 @@ void avr8::trigger_interrupt(int location)
 		DEC_SP;
 		write_sram(SP,pc>>8);
 		DEC_SP;
+		WATCH_SP;
 
 		// jump to new location (which jumps to the real handler)
 		pc = location;
@@ -1367,6 +2019,11 @@ bool avr8::init_sd()
 
 bool avr8::init_gui()
 {
+	// SDL's dummy driver still gives us a surface and events (Ctrl-C
+	// arrives as SDL_QUIT), it just never shows anything.
+	if (headless)
+		putenv((char*)"SDL_VIDEODRIVER=dummy");
+
 	if ( SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO | SDL_INIT_JOYSTICK) < 0 )
 	{
 		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
@@ -1386,10 +2043,12 @@ bool avr8::init_gui()
 		return false;
 	}
 	else if (fullscreen)	// Center in fullscreen
-		inset = ((600-448)/2) * screen->pitch + 4 * ((800-630)/2);
+		inset = ((600-VIDEO_HEIGHT)/2) * screen->pitch + 4 * ((800-VIDEO_WIDTH)/2);
 
-	if (SDL_MUSTLOCK(screen) && SDL_LockSurface(screen) < 0)
-		return false;
+	init_video();
+
+	if (ntsc)
+		ntsc->init(screen->format);
 
 	if (fullscreen)
 	{
@@ -1416,19 +2075,8 @@ bool avr8::init_gui()
 			SDL_PauseAudio(0);
 	}
 
-	current_cycle = -999999;
-	scanline_top = -33;
-	scanline_count = -999;
-	//Syncronized with the kernel, this value now results in the image 
-	//being perfectly centered in both the emulator and a real TV
-	left_edge = -166;
-
-	latched_buttons[0] = buttons[0] = ~0;
-	latched_buttons[1] = buttons[1] = ~0;
-	mouse_scale = 1;
-
 	// Precompute final palette for speed.
-	// Should build some NTSC compensation magic in here too.
+	// The optional NTSC filter (--ntsc) does its own encoding in ntsc.cpp.
 	for (int i=0; i<256; i++)
 	{
 		int red = (((i >> 0) & 7) * 255) / 7;
@@ -1451,6 +2099,87 @@ bool avr8::init_gui()
 }
 
 
+// Expands one line of palette indexes to 32-bit pixels, resampling the
+// VIDEO_LINE_CYCLES native cycles down to VIDEO_WIDTH output pixels.
+static inline void expand_scanline(u32 *dest, const u8 *src, const u16 *xmap, const u32 *palette)
+{
+	int x = 0;
+#if defined(__AVX2__)
+	// Two chained gathers: index bytes from the line, then colors from the palette.
+	const __m256i lowByte = _mm256_set1_epi32(0xff);
+	for (; x + 8 <= VIDEO_WIDTH; x += 8)
+	{
+		__m256i cols = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(xmap + x)));
+		__m256i idx = _mm256_and_si256(_mm256_i32gather_epi32((const int*)src, cols, 1), lowByte);
+		__m256i rgb = _mm256_i32gather_epi32((const int*)palette, idx, 4);
+		_mm256_storeu_si256((__m256i*)(dest + x), rgb);
+	}
+#endif
+	for (; x < VIDEO_WIDTH; x++)
+		dest[x] = palette[src[xmap[x]]];
+}
+
+// Shows a finished frame, or hands it to the presenter thread if there is one
+void avr8::present_frame(const u8 *frame)
+{
+	if (presenter)
+	{
+		presenter->submit_frame(frame, frameCounter);
+		return;
+	}
+
+	render_frame(frame, frameCounter);
+	SDL_Flip(screen);
+	SDL_framerateDelay(&fpsmanager);
+}
+
+// With a presenter thread SDL's event queue is pumped over there
+bool avr8::next_event(SDL_Event &event)
+{
+	if (embedded)
+		return false;
+	if (presenter)
+		return presenter->poll_event(event, singleStep);
+	return singleStep? SDL_WaitEvent(&event) : SDL_PollEvent(&event);
+}
+
+// Also called on the presenter thread, so only touch the frame and the
+// display settings
+void avr8::render_frame(const u8 *frame, int frame_no)
+{
+	if (SDL_MUSTLOCK(screen) && SDL_LockSurface(screen) < 0)
+		return;
+
+	u32 pitch = screen->pitch >> 2;
+	u32 *dest = (u32*)((u8*)screen->pixels + inset);
+	const u8 *src = frame;
+
+	if (ntsc)
+	{
+		ntsc->render(dest, pitch, frame, scanline_xmap, frame_no, interlaced);
+		if (SDL_MUSTLOCK(screen))
+			SDL_UnlockSurface(screen);
+		return;
+	}
+
+	for (int y = 0; y < VIDEO_LINES; y++, dest += pitch * 2, src += VIDEO_LINE_CYCLES)
+	{
+		if (interlaced)
+		{
+			// Only refresh the current field, the other one keeps last frame's lines
+			expand_scanline(dest + (frame_no & 1) * pitch, src, scanline_xmap, palette);
+		}
+		else
+		{
+			expand_scanline(dest, src, scanline_xmap, palette);
+			memcpy(dest + pitch, dest, VIDEO_WIDTH * sizeof(u32));
+		}
+	}
+
+	if (SDL_MUSTLOCK(screen))
+		SDL_UnlockSurface(screen);
+}
+
 void avr8::uzekb_handle_key(SDL_Event &ev)
 {
 	if(ev.type==SDL_KEYUP)uzeKbScanCodeQueue.push(0xf0);
@@ -1518,11 +2247,14 @@ void avr8::handle_key_down(SDL_Event &ev)
 			case SDLK_ESCAPE:
 				printf("user abort (pressed ESC).\n");
                 shutdown(0);
-                /* no break */
+                break;
 			case SDLK_PRINT:
 				sprintf(ssbuf,"uzem_%03d.bmp",ssnum++);
 				printf("saving screenshot to '%s'...\n",ssbuf);
-				SDL_SaveBMP(screen,ssbuf);
+				if (presenter)
+					presenter->save_screenshot(ssbuf);
+				else
+					SDL_SaveBMP(screen,ssbuf);
 				break;
 			case SDLK_0:
 				PIND = PIND & ~0b00001100;
@@ -1639,6 +2371,37 @@ struct joyButton joy_btns_p2[] =
 
 struct joyButton *joyButtons[] =  { joy_btns_p1, joy_btns_p2 };
 
+// The part of init_gui() that doesn't need SDL, libuzem only calls this
+void avr8::init_video()
+{
+	// Padded so the vectorized expansion can read a full dword at the last index
+	framebuffer = new u8[VIDEO_LINES * VIDEO_LINE_CYCLES + 4];
+	memset(framebuffer, 0, VIDEO_LINES * VIDEO_LINE_CYCLES + 4);
+	current_scanline = framebuffer;
+	if (runAhead)
+	{
+		aheadBuffer = new u8[VIDEO_LINES * VIDEO_LINE_CYCLES + 4];
+		memset(aheadBuffer, 0, VIDEO_LINES * VIDEO_LINE_CYCLES + 4);
+		ahead = new Snapshot;
+	}
+
+	// Horizontal 7/16 resampling: each output pixel shows the last cycle
+	// that lands on it, same as when cycles were plotted straight to the surface.
+	for (int c=0; c<VIDEO_LINE_CYCLES; c++)
+		scanline_xmap[(c*7)>>4] = c;
+
+	current_cycle = -999999;
+	scanline_top = -33;
+	scanline_count = -999;
+	//Syncronized with the kernel, this value now results in the image 
+	//being perfectly centered in both the emulator and a real TV
+	left_edge = -166;
+
+	latched_buttons[0] = buttons[0] = ~0;
+	latched_buttons[1] = buttons[1] = ~0;
+	mouse_scale = 1;
+}
+
 void avr8::init_joysticks() {
 	if (SDL_JoystickEventState(SDL_QUERY) != SDL_ENABLE && SDL_JoystickEventState(SDL_ENABLE) != SDL_ENABLE)
 	{
@@ -2039,21 +2802,106 @@ void avr8::update_hardware(int cycles)
 	}
 
     //draw pixels on scanline
-	if (scanline_count >= 0 && current_cycle < 1440)
+	if (scanline_count >= 0 && current_cycle < VIDEO_LINE_CYCLES)
+	{
+		int start = current_cycle < 0 ? 0 : current_cycle;
+		current_cycle += cycles;
+		int end = current_cycle < VIDEO_LINE_CYCLES ? current_cycle : VIDEO_LINE_CYCLES;
+		for (int i = start; i < end; i++)
+			current_scanline[i] = pixel;
+	}
+
+	hwQuiet = quiet_cycles();
+}
+
+// How many cycles update_hardware() can be put off for without missing
+// anything: none of the events it checks for can happen sooner.
+u32 avr8::quiet_cycles()
+{
+	u32 quiet = 0xFFFFFFFF;
+
+	if (TCCR1B & 7)
 	{
-		while (cycles)
+		u16 count = TCNT1L | (TCNT1H<<8);
+		quiet = 0x10000 - count;
+		if (TCCR1B & WGM12)
 		{
-			if (current_cycle >= 0 && current_cycle < 1440)
-			{
-				current_scanline[(current_cycle*7)>>4] = pixel;
-				next_scanline[(current_cycle*7)>>4] = pixel;
-			}
-			current_cycle++;
-			--cycles;
+			u16 compareA = OCR1AL | (OCR1AH<<8);
+			u16 compareB = OCR1BL | (OCR1BH<<8);
+			if (count < compareA && (u32)(compareA - count) < quiet)
+				quiet = compareA - count;
+			if (count < compareB && (u32)(compareB - count) < quiet)
+				quiet = compareB - count;
 		}
 	}
 
+	if ((WDTCSR & (WDE|WDIE)) == (WDE|WDIE))
+	{
+		if (watchdogTimer >= DELAY16MS)
+			return 0;
+		if (DELAY16MS - watchdogTimer < quiet)
+			quiet = DELAY16MS - watchdogTimer;
+	}
+
+	if ((SPCR & 0x40) && SD_ENABLED() && spiTransfer && spiClock < quiet)
+		quiet = spiClock;
+
+	if (EECR & (EEPE|EERE))
+		return 0;
+
+	return quiet;
+}
+
+// Called on a taken backward branch, with pc at its target. The I/O space
+// only changes through write_io() or the hardware, which both drop the
+// snapshot, so apart from the stack pointer and SREG it needs no compare.
+// SRAM is only copied once the registers have come round again, and a
+// loop that fails the compare is looked at less often, so ordinary loops
+// with a counter in a register stay cheap.
+// Returns the number of cycles skipped, for exec() to charge.
+u32 avr8::idle_skip()
+{
+	idleCountdown = IDLE_CHECK_INTERVAL;
+	if (!idleSkip)
+		return 0;
+
+	sync_flags();
+	if (idleStage != IDLE_NONE && pc == idlePc)
+	{
+		if (SREG != idleSreg || SPL != idleSpl || SPH != idleSph ||
+			memcmp(idleRegs, r, sizeof(idleRegs)))
+		{
+			idleCountdown = IDLE_BACKOFF_INTERVAL;
+		}
+		else if (idleStage == IDLE_REGS)
+		{
+			memcpy(idleSram, sram, sramSize);
+			idleStage = IDLE_SRAM;
+			idleStart = hwPending;
+			return 0;
+		}
+		else if (!memcmp(idleSram, sram, sramSize))
+		{
+			// Same state as period cycles ago: keep the next hardware event
+			// ahead of the last skipped insn, so it still lands on the same one
+			u32 period = hwPending - idleStart;
+			u32 skip = 0;
+			if (period && hwQuiet > hwPending)
+				skip = (hwQuiet - 1 - hwPending) / period * period;
+			if (skip > IDLE_MAX_SKIP)
+				skip = IDLE_MAX_SKIP / period * period;
+			idleStart = hwPending + skip;
+			return skip;
+		}
+	}
 
+	memcpy(idleRegs, r, sizeof(idleRegs));
+	idleSreg = SREG;
+	idleSpl = SPL;
+	idleSph = SPH;
+	idlePc = pc;
+	idleStage = IDLE_REGS;
+	return 0;
 }
 
 #ifdef SPI_DEBUG
@@ -2451,15 +3299,15 @@ void avr8::SDSeekToOffset(u32 pos){
 
 void avr8::LoadEEPROMFile(const char* filename){
     eepromFile = filename;
-    memset(eeprom,0xff,eepromSize);
+    memset(eeprom,0xff,sizeof(eeprom));
     FILE* f = fopen(filename,"rb");
     if(f){
 
         fseek(f,0,SEEK_END);
         size_t size = ftell(f);
-        if(size < eepromSize) printf("Warning: EEPROM file is smaller than 2k.\n");
+        if(size < eepromSize) printf("Warning: EEPROM file is smaller than %uk.\n",eepromSize/1024);
         if(size > eepromSize){
-            printf("Warning: EEPROM file is larger than 2k.\n");
+            printf("Warning: EEPROM file is larger than %uk.\n",eepromSize/1024);
             size = eepromSize;
         }
         fseek(f, 0, SEEK_SET);
@@ -2476,17 +3324,40 @@ void avr8::LoadEEPROMFile(const char* filename){
 }
 
 void avr8::shutdown(int errcode){
+    // Already done: with a presenter or when embedded, this returns and the
+    // CPU stays stopped (gdb may stop it too, but there is no presenter then)
+    if((presenter || embedded) && state == CPU_STOPPED){
+        return;
+    }
+
+    if(ramMonitor){
+        ram_report();
+    }
+
+    // Leave it to the program that embeds us, see uzem_step_frame()
+    if(embedded){
+        state = CPU_STOPPED;
+        return;
+    }
+
+    // Get the display thread out of SDL before anything is torn down
+    if(presenter){
+        presenter->stop();
+    }
 #if defined(__WIN32__)
     if(hDisk != INVALID_HANDLE_VALUE){
         CloseHandle (hDisk);        
         VirtualFree (lpSector, 0, MEM_RELEASE);
+        hDisk = INVALID_HANDLE_VALUE;
     }        
 #endif
     if(sdImage){
         fclose(sdImage);
+        sdImage = NULL;
     }
     if(emulatedMBR){
         free(emulatedMBR);
+        emulatedMBR = NULL;
     }
     if(eepromFile){
         FILE* f = fopen(eepromFile,"wb+");
@@ -2498,6 +3369,21 @@ void avr8::shutdown(int errcode){
 
     if(captureMode==CAPTURE_WRITE && captureFile!=NULL){
     	fclose(captureFile);
+    	captureFile = NULL;
+    }
+
+    if(recorder){
+    	recorder->close();
+    	delete recorder;
+    	recorder = NULL;
+    }
+
+    if(regress){
+    	int result = regress->close();
+    	if(!errcode)
+    		errcode = result;
+    	delete regress;
+    	regress = NULL;
     }
 
 #if GUI
@@ -2517,6 +3403,13 @@ void avr8::shutdown(int errcode){
 	}
 #endif
 
+    // The main thread exits once the emulation thread is out, see main()
+    if(presenter){
+        exitCode = errcode;
+        state = CPU_STOPPED;
+        return;
+    }
+
     exit(errcode);
 }
 
@@ -118,19 +118,46 @@ enum { SNES_B, SNES_Y, SNES_A=8, SNES_X, SNES_LSH, SNES_RSH };
 
 enum {CAPTURE_NONE,CAPTURE_READ,CAPTURE_WRITE};
 
-#if 1	// 644P
-const unsigned eepromSize = 2048;
-const unsigned sramSize = 4096;
-const unsigned progSize = 65536;
-#else	// 1284P
-const unsigned eepromSize = 4096;
-const unsigned sramSize = 16384;
-const unsigned progSize = 131072;
-#endif
+// The parts a Uzebox can be built around, picked by the .uze header's
+// target. Memory is allocated for the largest one and the core masks
+// addresses down to the sizes of the one selected with set_mcu(). Both
+// keep a 16 bit word PC and the same interrupt vectors, the 1284P only
+// adds RAMPZ for ELPM to reach its upper 64K.
+struct Mcu
+{
+	const char *name;
+	unsigned progSize;		// bytes
+	unsigned sramSize;
+	unsigned eepromSize;
+};
+enum { MCU_644, MCU_1284 };
+extern const Mcu mcus[];
+
+const unsigned maxEepromSize = 4096;
+const unsigned maxSramSize = 16384;
+const unsigned maxProgSize = 131072;
 
 #define IOBASE		32
+
+#define IDLE_CHECK_INTERVAL	4
+#define IDLE_BACKOFF_INTERVAL	64
+#define IDLE_MAX_SKIP		(1<<20)
+enum { IDLE_NONE, IDLE_REGS, IDLE_SRAM };
 #define SRAMBASE	256
 
+// Video is captured at native resolution: one palette index per CPU cycle
+// of the visible part of a scanline. Once per frame the index buffer is
+// expanded to the 630x448 (2x vertical) RGB surface.
+#define VIDEO_LINE_CYCLES	1440
+#define VIDEO_LINES			224
+#define VIDEO_WIDTH			630
+#define VIDEO_HEIGHT		(VIDEO_LINES*2)
+
+#define AUDIO_CAPTURE_MAX	1024	// samples a frame, the kernel outputs one per line
+
+// Two NTSC frames of 262 lines, run_ahead() stops waiting for one after that
+#define AHEAD_MAX_FRAME_CYCLES	(2*262*1820)
+
 namespace ports 
 {
 	enum
@@ -142,7 +169,7 @@ namespace ports
 		EEDR,  EEARL, EEARH, GTCCR, TCCR0A,TCCR0B,TCNT0, OCR0A,
 		OCR0B, res49, GPIOR1,GPIOR2,SPCR,  SPSR,  SPDR,  res4f,
 		ACSR,  OCDR,  res52, SMCR,  MCUSR, MCUCR, res56, SPMCSR,
-		res58, res59, res5A, res5B, res5C, SPL,   SPH,  SREG,
+		res58, res59, res5A, RAMPZ, res5C, SPL,   SPH,  SREG,
 		WDTCSR, CLKPR, res62, res63, PRR, res65, OSCCAL, res67,
 		PCICR, EICRA, res6a, PCMSK0, PCMSK1, PCMSK2, TIMSK0, TIMSK1,
 		TIMSK2, res71, res72, PCMSK3, res74, res75, res76, res77,
@@ -233,7 +260,7 @@ struct SDPartitionEntry{
 class ringBuffer
 {
 public:
-	ringBuffer(int s) : head(0), tail(0), avail(s), size(s)
+	ringBuffer(int s) : head(0), tail(0), size(s), avail(s)
 	{
 		buffer = new u8[size];
 	}
@@ -283,38 +310,102 @@ private:
 
 
 
-struct avr8
+// A program word split into handler and operands by avr8::decode()
+struct Insn
 {
-	avr8() : pc(0), cycleCounter(0), singleStep(0), nextSingleStep(0), interruptLevel(0), breakpoint(0xFFFF), audioRing(2048), 
-		enableSound(true), fullscreen(false), interlaced(false), lastFlip(0), inset(0), prevPortB(0), 
-		prevWDR(0), frameCounter(0),  new_input_mode(false),gdb(0),enableGdb(false), SDpath(NULL), gdbBreakpointFound(false),gdbInvalidOpcode(false),gdbPort(1284),state(CPU_STOPPED),
-        spiByte(0), spiClock(0), spiTransfer(0), spiState(SPI_IDLE_STATE), spiResponsePtr(0), spiResponseEnd(0),eepromFile("eeprom.bin"),joystickFile(0),captureFile(NULL),
-		captureMode(CAPTURE_NONE),watchdogTimer(0),
+	u8 op;		// handler, 0 until decoded
+	u8 d, r;	// registers, I/O address, bit number or immediate
+	u16 k;		// second word, branch target or size of the insn a skip skips
+};
 
+#define SNAPSHOT_KB_QUEUE	64		// Uzebox keyboard scan codes kept, the rest are lost
 
+// What avr8::run_ahead() puts back after emulating frames that are thrown
+// away: the CPU, its memories and the peripherals. Host side state like the
+// window, sound and the pads is left alone. Pointers are kept as offsets,
+// so libuzem can hand it out as a plain buffer.
+struct Snapshot
+{
+	u8 r[32], io[256], sram[maxSramSize], eeprom[maxEepromSize];
+	u16 progmem[maxProgSize/2];
+	u16 pc;
+	u8 TEMP, flagOp, flagMask, flagRd, flagRr, flagR;
+	u32 hwPending, hwQuiet;
+	u16 TCNT1, OCR1A, OCR1B;
+	u32 watchdogTimer, cycleCounter, prevPortB, prevWDR;
+	int interruptLevel;
+	bool new_input_mode;
+	int frameCounter, scanline_count, current_cycle;
+	int scanlineOffset;				// current_scanline - framebuffer
+	u8 pixel;
+	u32 latched_buttons[2];
+	u8 uzeKbState, uzeKbDataOut, uzeKbDataIn, uzeKbClock;
+	bool uzeKbEnabled;
+	u8 uzeKbQueue[SNAPSHOT_KB_QUEUE];
+	int uzeKbQueueLength;
+	u8 spiByte, spiTransfer;
+	u16 spiClock, spiCycleWait;
+	u8 spiState, spiCommand, spiCommandDelay;
+	u32 spiArg, spiByteCount;
+	u8 spiResponseBuffer[12];
+	int spiResponsePos, spiResponseLength;	// -1 for NULL
+	u32 emulatedReadPos;
+	int sdPosition;
+	u8 eeClock;
+};
+
+struct NtscFilter;
+struct Recorder;
+struct Regression;
+struct Presenter;
+
+struct avr8
+{
+	avr8() : pc(0), breakpoint(0xFFFF), SDpath(NULL), gdb(0), enableGdb(false), gdbBreakpointFound(false), gdbInvalidOpcode(false), gdbPort(1284),
+		state(CPU_STOPPED), flagOp(0), flagMask(0), hwPending(0), hwQuiet(0), idleSkip(true), idleCountdown(IDLE_CHECK_INTERVAL), idleStage(IDLE_NONE),
+		watchdogTimer(0), cycleCounter(0), prevPortB(0), prevWDR(0), singleStep(0), nextSingleStep(0), enableSound(true), fullscreen(false),
+		interlaced(false), new_input_mode(false), interruptLevel(0), lastFlip(0), inset(0), frameCounter(0),
+		framebuffer(0), ntsc(0), recorder(0), headless(false), regress(0), presenter(0), exitCode(0), embedded(false), audioCapture(0), audioCaptureCount(0),
+		frameLimit(0), runAhead(0), speculating(false), aheadPending(false), aheadBuffer(0), ahead(0),
+		ramMonitor(false), spLow(0), ramWatch(0xFFFF), dataEnd(0), ramWraps(0), ramCollisions(0), audioRing(2048),
+        spiByte(0), spiTransfer(0), spiClock(0), spiState(SPI_IDLE_STATE), spiResponsePtr(0), spiResponseEnd(0),
     #if defined(__WIN32__)
         hDisk(INVALID_HANDLE_VALUE),
     #endif
-
-        sdImage(0),emulatedMBR(0)
+        captureFile(NULL), captureMode(CAPTURE_NONE), sdImage(0), emulatedMBR(0), eepromFile("eeprom.bin"), joystickFile(0)
 	{
 		memset(r, 0, sizeof(r));
 		memset(io, 0, sizeof(io));
 		memset(sram, 0, sizeof(sram));
 		memset(eeprom, 0, sizeof(eeprom));
-		memset(progmem,0,progSize);
+		memset(progmem,0,sizeof(progmem));
+		decoded = new Insn[maxProgSize/2];
+		init_io();
+		set_mcu(MCU_644);
 
 		PIND = 0b00001100;		//set soft power switch to up (pullup) (both avcore and uzebox)
-		SPL = (SRAMBASE+sramSize-1) & 0x00ff;
-		SPH = (SRAMBASE+sramSize-1) >> 8;
         spiTransfer = 0;
 
         uzeKbState=0;
         uzeKbEnabled=false;
 		pad_mode = SNES_PAD;
 	}
+	~avr8()
+	{
+		delete[] decoded;
+		delete[] framebuffer;
+		delete[] aheadBuffer;
+		delete ahead;
+	}
+
+	u16 progmem[maxProgSize/2];
 
-	u16 progmem[progSize/2];
+	// Sizes of the selected part, see Mcu
+	const Mcu *mcu;
+	unsigned progSize, sramSize, eepromSize;
+	u16 progMask, sramMask;		// in words and bytes
+	void set_mcu(int type);
+	Insn *decoded;				// one per progmem word, decoded on first use
 	u16 pc;
 	u16 breakpoint;
 	bool run;
@@ -329,6 +420,51 @@ struct avr8
 	cpu_state state;
 
 	u8 TEMP;				// for 16-bit timers
+
+	// SREG H, S, V, N, Z and C are evaluated lazily: ALU insns record their
+	// operands and result, and the bits are only computed when something
+	// reads SREG. Anything outside the core must call sync_flags() first.
+	u8 flagOp;				// which insn class last set the flags
+	u8 flagMask;			// SREG bits owed by flagOp, 0 when SREG is current
+	u8 flagRd, flagRr, flagR;
+	inline void sync_flags()
+	{
+		if (flagMask)
+			eval_flags();
+	}
+	void eval_flags();
+
+	// Hardware updates are batched: exec() only runs update_hardware() once
+	// the cycles it owes reach hwQuiet, the distance to the next timer, SPI
+	// or watchdog event. I/O accesses settle the owed cycles first, so the
+	// program never sees the difference.
+	u32 hwPending, hwQuiet;
+	inline void sync_hardware()
+	{
+		if (hwPending)
+		{
+			u32 cycles = hwPending;
+			hwPending = 0;
+			idleStage = IDLE_NONE;
+			update_hardware(cycles);
+		}
+	}
+	u32 quiet_cycles();
+
+	// Busy-wait loops like the one in WaitVsync() are fast-forwarded: every
+	// IDLE_CHECK_INTERVAL taken backward branches the CPU state is compared
+	// with a snapshot from an earlier pass over the same branch. If nothing
+	// changed and neither I/O nor the hardware got involved in between, the
+	// loop can only repeat itself until the next hardware event, so whole
+	// periods of it are skipped and their cycles charged to hwPending.
+	bool idleSkip;
+	u8 idleCountdown;
+	u8 idleStage;			// IDLE_NONE, IDLE_REGS or IDLE_SRAM
+	u16 idlePc;
+	u32 idleStart;			// hwPending when the snapshot was taken
+	u8 idleRegs[32], idleSreg, idleSpl, idleSph, idleSram[maxSramSize];
+	u32 idle_skip();
+
 	u16 TCNT1;
 	u16 OCR1A;
 	u16 OCR1B;
@@ -351,11 +487,59 @@ struct avr8
 	int current_cycle;
 	int scanline_top;
 	int left_edge;
-	u32 *current_scanline, *next_scanline;
+	u8 *current_scanline;
+	u8 *framebuffer;				// VIDEO_LINES rows of VIDEO_LINE_CYCLES palette indexes
+	u16 scanline_xmap[VIDEO_WIDTH];	// framebuffer column sampled for each output pixel
+	NtscFilter *ntsc;				// composite filter, NULL when disabled
+	Recorder *recorder;				// --record output, NULL when disabled
+	bool headless;					// no window, no sound, no frame rate limit
+	Regression *regress;			// --golden checks, NULL when disabled
+	Presenter *presenter;			// display thread, NULL to draw from the emulation
+	int exitCode;					// from shutdown() when it leaves exiting to the main thread
+	bool embedded;					// driven through libuzem, SDL is never initialized
+	u8 *audioCapture;				// OCR2A samples for libuzem, NULL when disabled
+	int audioCaptureCount;
+	int frameLimit;					// quit after this many frames, 0 to run forever
+
+	// Run-ahead: at the end of each frame the machine is saved, runAhead
+	// more frames are emulated with the input just read and the last of
+	// them is shown, then the machine goes back to where it was. The game
+	// seems to react that many frames sooner, at the cost of emulating
+	// every frame 1+runAhead times.
+	int runAhead;					// frames, 0 to disable
+	bool speculating;				// in frames run_ahead() will throw away
+	bool aheadPending;				// run_ahead() once the current insn is done
+	u8 *aheadBuffer;				// framebuffer for the frames ahead
+	Snapshot *ahead;
+	void save_state(Snapshot &s);
+	void load_state(const Snapshot &s);
+	void run_ahead();
+
+	// --ram: how deep the stack gets and whether it meets the data below.
+	// Writes under SP that aren't the stack's own are data, so the highest
+	// of them is where .data/.bss (and anything past it) ends; the symbols
+	// from the .elf or .map add the parts nobody wrote. While the monitor
+	// is off spLow and ramWatch are set so the hot path checks never fire.
+	bool ramMonitor;
+	u16 spLow;						// lowest SP this frame, 0 when off
+	u16 spFrameLow;					// lowest SP of the last complete frame
+	u16 spLowest;					// lowest SP of the whole run
+	u16 ramWatch;					// SRAM writes above this go to watch_write(), 0xFFFF when off
+	u16 dataHigh;					// highest data address written
+	u16 dataEnd;					// __heap_start from the symbols, 0 when unknown
+	u32 ramWraps, ramCollisions;
+	bool load_symbols(const char *path);
+	void start_ram_monitor();
+	void watch_stack();
+	void watch_write(u16 addr);
+	void ram_frame();
+	void ram_report();
+	void ram_fault(u32 &count, const char *fmt, u16 a, u16 b);
+	int ram_free(u16 sp);
 
 	FPSmanager fpsmanager;
 
-	u32 pixel;
+	u8 pixel;
 	u32 palette[256];
 	// SNES bit order:  B, Y, Select, Start, Up, Down, Left, Right, A, X, L, R
 	// NES bit order:  A, B, Select, Start, Up, Down, Left, Right
@@ -429,7 +613,7 @@ struct avr8
     u32 sectorSize;
     const char* eepromFile;
 	const char* joystickFile;
-    u8 eeprom[eepromSize];
+    u8 eeprom[maxEepromSize];
     u8 eeClock;
 
 	struct
@@ -455,7 +639,7 @@ struct avr8
 				u8 EEDR,  EEARL, EEARH, GTCCR, TCCR0A,TCCR0B,TCNT0, OCR0A;
 				u8 OCR0B, res49, GPIOR1,GPIOR2,SPCR,  SPSR,  SPDR,  res4f;
 				u8 ACSR,  OCDR,  res52, SMCR,  MCUSR, MCUCR, res56, SPMCSR;
-				u8 res58, res59, res5A, res5B, res5C, SPL,   SPH,   SREG;
+				u8 res58, res59, res5A, RAMPZ, res5C, SPL,   SPH,   SREG;
 				u8 WDTCSR, CLKPR, res62, res63, PRR, res65, OSCCAL, res67;
 				u8 PCICR, EICRA, res6a, PCMSK0, PCMSK1, PCMSK2, TIMSK0, TIMSK1;
 				u8 TIMSK2, res71, res72, PCMSK3, res74, res75, res76, res77;
@@ -478,11 +662,51 @@ struct avr8
 				u8 resf8, resf9, resfa, resfb, resfc, resfd, resfe, resff;
 			};
 		};
-		u8 sram[sramSize];
+		u8 sram[maxSramSize];
 	};
 
-	void write_io(u8 addr,u8 value);
-	u8 read_io(u8 addr);
+	// I/O registers dispatch through a handler per address, see init_io().
+	// Peripheral models can hook their registers with set_io_handler().
+	typedef void (avr8::*IoWrite)(u8 addr,u8 value);
+	typedef u8 (avr8::*IoRead)(u8 addr);
+	IoWrite ioWrite[256];
+	IoRead ioRead[256];
+	void init_io();
+	void set_io_handler(u8 addr,IoWrite write,IoRead read);
+
+	inline void write_io(u8 addr,u8 value)
+	{
+		idleStage = IDLE_NONE;
+		(this->*ioWrite[addr])(addr,value);
+	}
+	inline u8 read_io(u8 addr)
+	{
+		return (this->*ioRead[addr])(addr);
+	}
+
+	void io_store(u8 addr,u8 value);
+	u8 io_load(u8 addr);
+	void io_store_hw(u8 addr,u8 value);
+	u8 io_load_hw(u8 addr);
+	void io_write_porta(u8 addr,u8 value);
+	void io_write_portb(u8 addr,u8 value);
+	void io_write_portc(u8 addr,u8 value);
+	void io_write_portd(u8 addr,u8 value);
+	void io_write_tcnt1l(u8 addr,u8 value);
+	void io_write_tcnt1h(u8 addr,u8 value);
+	u8 io_read_tcnt1l(u8 addr);
+	u8 io_read_tcnt1h(u8 addr);
+	void io_write_tifr1(u8 addr,u8 value);
+	void io_write_ocr2a(u8 addr,u8 value);
+	void io_write_spdr(u8 addr,u8 value);
+	void io_write_spcr(u8 addr,u8 value);
+	void io_write_eecr(u8 addr,u8 value);
+	void io_write_sreg(u8 addr,u8 value);
+	u8 io_read_sreg(u8 addr);
+	void io_write_spl(u8 addr,u8 value);
+#ifdef USE_PORT_PRINT
+	void io_write_whisper(u8 addr,u8 value);
+#endif
 
 	inline u8 read_progmem(u16 addr)
 	{
@@ -490,10 +714,19 @@ struct avr8
 		return (addr&1)? word>>8 : word;
 	}
 
+	// ELPM, RAMPZ:Z
+	inline u8 read_progmem_far(u32 addr)
+	{
+		u16 word = progmem[(addr>>1) & progMask];
+		return (addr&1)? word>>8 : word;
+	}
+
 	inline void write_sram(u16 addr,u8 value)
 	{
 		if(addr>=SRAMBASE){
-			sram[(addr - SRAMBASE) & (sramSize-1)] = value;
+			if(addr > ramWatch)
+				watch_write(addr);
+			sram[(addr - SRAMBASE) & sramMask] = value;
 		}else if (addr >= IOBASE ){
 			write_io(addr - IOBASE, value);
 		}else{
@@ -506,7 +739,7 @@ struct avr8
 
 		if(addr>=SRAMBASE)
 		{
-			return sram[(addr - SRAMBASE) & (sramSize-1)];
+			return sram[(addr - SRAMBASE) & sramMask];
 		}
 		else if (addr >= IOBASE)
 		{
@@ -534,6 +767,7 @@ struct avr8
 
 	bool init_sd();
 	bool init_gui();
+	void init_video();
 	void init_joysticks();
 	void handle_key_down(SDL_Event &ev);
 	void handle_key_up(SDL_Event &ev);
@@ -543,8 +777,19 @@ struct avr8
 	void map_joysticks(SDL_Event &ev);
 	void load_joystick_file(const char* filename);
 	void draw_memorymap();
+	void render_frame(const u8 *frame, int frame_no);
+	void present_frame(const u8 *frame);
+	bool next_event(SDL_Event &event);
 	void trigger_interrupt(int location);
-	u8 exec();
+	u32 exec();
+	void decode(u16 addr);
+	// Call after changing progmem, so the word and any two word insn or
+	// skip in front of it get decoded again
+	inline void invalidate_insn(u16 addr)
+	{
+		decoded[addr & progMask].op = 0;
+		decoded[(addr - 1) & progMask].op = 0;
+	}
     void spi_calculateClock();    
 	void update_hardware(int cycles);    
     void update_spi();
@@ -0,0 +1,442 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+/*
+ * CPU core benchmarks for uzem, built and run with 'make bench'.
+ *
+ * Each synthetic program below (assembly in the comment, Intel hex in
+ * the string) loops forever and is run for a fixed number of emulated
+ * cycles, several times. Any .hex files given on the command line are
+ * run the same way headless, for the real mix of a game.
+ *
+ * Results are printed as a table, and with --json also appended to a file
+ * as one JSON object per line, for tracking across commits:
+ *   {"tag":"...","name":"alu","runs":5,"cycles":20000000,"mhz":123.4,
+ *    "mhz_stdev":0.8,"ns_per_insn":5.12,"ns_per_insn_stdev":0.03,
+ *    "cycles_per_insn":1.14}
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__WIN32__)
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "avr8.h"
+#include "hexloader.h"
+
+#define MAX_RUNS	32
+
+struct Program
+{
+	const char *name;
+	const char *hex;
+	bool sd;		// SPI only clocks with an SD card present
+};
+
+/* alu: ALU ops and a taken branch per 14 insns
+	ldi r16,1
+	ldi r17,3
+loop:
+	add r16,r17
+	eor r17,r16
+	adc r18,r16
+	sub r19,r17
+	and r20,r16
+	or r21,r17
+	lsr r22
+	swap r23
+	mov r2,r16
+	mul r16,r17
+	subi r24,1
+	sbci r25,0
+	cpi r24,0x80
+	brne loop
+	inc r26
+	rjmp loop
+*/
+static const char alu_hex[] =
+	":1000000001E013E0010F1027201F311B4023512B6B\n"
+	":1000100066957295202E019F81509040803891F70F\n"
+	":04002000A395F0CFE5\n"
+	":00000001FF\n";
+
+/* ldst: LD/ST, LDD/STD, PUSH/POP and LDS/STS to SRAM
+	ldi r30,0x00
+	ldi r31,0x0a
+outer:
+	ldi r26,0x00
+	ldi r27,0x01
+	ldi r28,0x00
+	ldi r29,0x08
+	ldi r24,0
+inner:
+	ld r0,X+
+	st Y+,r0
+	ldd r1,Z+1
+	std Z+2,r1
+	push r0
+	pop r1
+	lds r2,0x200
+	sts 0x201,r2
+	dec r24
+	brne inner
+	rjmp outer
+*/
+static const char ldst_hex[] =
+	":10000000E0E0FAE0A0E0B1E0C0E0D8E080E00D90F0\n"
+	":100010000992118012820F921F902090000220926C\n"
+	":0800200001028A95A1F7EECF61\n"
+	":00000001FF\n";
+
+/* lpm: LPM Z+ walk through flash
+outer:
+	ldi r30,0
+	ldi r31,0
+	ldi r24,0
+inner:
+	lpm r0,Z+
+	lpm r1,Z+
+	add r2,r0
+	adc r3,r1
+	dec r24
+	brne inner
+	rjmp outer
+*/
+static const char lpm_hex[] =
+	":10000000E0E0F0E080E005901590200C311C8A952E\n"
+	":04001000D1F7F6CF5F\n"
+	":00000001FF\n";
+
+/* video: OUT PORTC pixel loop with real hsync pulses, so pixels are drawn
+; 774 cycles per PORTB sync pulse, which uzem takes as hsync
+	ldi r16,0xff
+	out 0x07,r16		; DDRC
+	ldi r18,1
+line:
+	out 0x05,r18		; PORTB
+	ldi r24,110
+pixels:
+	out 0x08,r16		; PORTC
+	inc r16
+	out 0x08,r16
+	inc r16
+	dec r24
+	brne pixels
+	nop
+	rjmp line
+*/
+static const char video_hex[] =
+	":100000000FEF07B921E025B98EE608B9039508B9C5\n"
+	":0A00100003958A95D1F70000F6CFA2\n"
+	":00000001FF\n";
+
+/* timer: Timer 1 CTC interrupt every 100 cycles
+	jmp start
+.org 0x1a
+	jmp isr
+start:
+	ldi r16,0
+	sts 0x89,r16		; OCR1AH
+	ldi r16,99
+	sts 0x88,r16		; OCR1AL
+	ldi r16,0x09
+	sts 0x81,r16		; TCCR1B = WGM12 | CS10
+	ldi r16,0x02
+	sts 0x6f,r16		; TIMSK1 = OCIE1A
+	sei
+loop:
+	add r2,r3
+	inc r3
+	rjmp loop
+isr:
+	push r16
+	in r16,0x3f		; SREG
+	inc r4
+	out 0x3f,r16
+	pop r16
+	reti
+*/
+static const char timer_hex[] =
+	":040000000C941C0040\n"
+	":100034000C942C0000E00093890003E600938800F0\n"
+	":1000440009E00093810002E000936F007894230C90\n"
+	":100054003394FDCF0F930FB743940FBF0F911895AF\n"
+	":00000001FF\n";
+
+/* spi: SPDR writes polling SPIF, SD emulation enabled
+	ldi r16,0x50
+	out 0x2c,r16		; SPCR = SPE | MSTR
+	ldi r16,0x01
+	out 0x2d,r16		; SPSR = SPI2X
+	ldi r17,0xff
+loop:
+	out 0x2e,r17		; SPDR
+wait:
+	in r16,0x2d
+	sbrs r16,7
+	rjmp wait
+	in r0,0x2e
+	rjmp loop
+*/
+static const char spi_hex[] =
+	":1000000000E50CBD01E00DBD1FEF1EBD0DB507FFE6\n"
+	":06001000FDCF0EB4FACF93\n"
+	":00000001FF\n";
+
+/* vsync: WaitVsync() style busy-wait on a flag set by a line interrupt
+	jmp start
+.org 0x1a
+	jmp isr
+start:
+	ldi r16,0x07
+	sts 0x89,r16		; OCR1AH
+	ldi r16,0x1b
+	sts 0x88,r16		; OCR1AL = 1819, one NTSC line
+	ldi r16,0x09
+	sts 0x81,r16		; TCCR1B = WGM12 | CS10
+	ldi r16,0x02
+	sts 0x6f,r16		; TIMSK1 = OCIE1A
+	sei
+wait:
+	rcall getflag
+	and r24,r24
+	breq wait
+	sts 0x100,r1
+	ldi r17,100
+work:
+	add r2,r17
+	dec r17
+	brne work
+	rjmp wait
+getflag:
+	lds r24,0x100
+	andi r24,1
+	ret
+isr:
+	push r16
+	in r16,0x3f		; SREG
+	push r16
+	lds r16,0x101
+	inc r16
+	sts 0x101,r16
+	brne done
+	ldi r16,1
+	sts 0x100,r16		; flag every 256 lines
+done:
+	pop r16
+	out 0x3f,r16
+	pop r16
+	reti
+*/
+static const char vsync_hex[] =
+	":040000000C941C0040\n"
+	":100034000C94370007E0009389000BE100938800DB\n"
+	":1000440009E00093810002E000936F00789409D0E6\n"
+	":100054008823E9F31092000114E6210E1A95E9F7BA\n"
+	":10006400F6CF80910001817008950F930FB70F931D\n"
+	":100074000091010103950093010119F401E000933B\n"
+	":0A00840000010F910FBF0F911895B6\n"
+	":00000001FF\n";
+
+static const Program programs[] =
+{
+	{ "alu", alu_hex, false },
+	{ "ldst", ldst_hex, false },
+	{ "lpm", lpm_hex, false },
+	{ "video", video_hex, false },
+	{ "timer", timer_hex, false },
+	{ "spi", spi_hex, true },
+	{ "vsync", vsync_hex, false },
+};
+
+static double seconds()
+{
+#if defined(__WIN32__)
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / freq.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static void mean_stdev(const double *values, int count, double &mean, double &stdev)
+{
+	mean = 0;
+	for (int i=0; i<count; i++)
+		mean += values[i];
+	mean /= count;
+
+	stdev = 0;
+	for (int i=0; i<count; i++)
+		stdev += (values[i] - mean) * (values[i] - mean);
+	stdev = count > 1 ? sqrt(stdev / (count - 1)) : 0;
+}
+
+static avr8 *create_cpu(bool sd)
+{
+	avr8 *cpu = new avr8();
+	cpu->headless = true;
+	cpu->enableSound = false;
+	cpu->sdl_flags = SDL_SWSURFACE;
+	cpu->eepromFile = NULL;
+	cpu->state = CPU_RUNNING;
+	if (sd)
+		cpu->SDpath = (char*)".";
+	if (!cpu->init_gui())
+	{
+		fprintf(stderr, "Unable to init SDL.\n");
+		exit(1);
+	}
+	return cpu;
+}
+
+static void run(FILE *json, const char *tag, const char *name, avr8 *cpu, int runs, u32 cycles)
+{
+	double mhz[MAX_RUNS], ns[MAX_RUNS];
+	double totalCycles = 0, totalInsns = 0;
+
+	// Untimed warm-up, so the first run isn't paying for cold caches
+	for (u32 done=0; done<cycles/4; )
+		done += cpu->exec();
+
+	for (int r=0; r<runs; r++)
+	{
+		u32 done = 0, insns = 0;
+		double start = seconds();
+		while (done < cycles)
+		{
+			done += cpu->exec();
+			insns++;
+		}
+		double elapsed = seconds() - start;
+
+		mhz[r] = done / elapsed / 1e6;
+		ns[r] = elapsed * 1e9 / insns;
+		totalCycles += done;
+		totalInsns += insns;
+	}
+
+	double mhzMean, mhzStdev, nsMean, nsStdev;
+	mean_stdev(mhz, runs, mhzMean, mhzStdev);
+	mean_stdev(ns, runs, nsMean, nsStdev);
+
+	printf("%-16s %9.2f MHz %5.1f%% %8.2f ns/insn %5.1f%%\n", name,
+		mhzMean, 100 * mhzStdev / mhzMean, nsMean, 100 * nsStdev / nsMean);
+	fflush(stdout);
+
+	if (!json)
+		return;
+	fprintf(json, "{\"tag\":\"%s\",\"name\":\"%s\",\"runs\":%d,\"cycles\":%u,\"mhz\":%.3f,\"mhz_stdev\":%.3f,"
+		"\"ns_per_insn\":%.3f,\"ns_per_insn_stdev\":%.3f,\"cycles_per_insn\":%.3f}\n",
+		tag, name, runs, cycles, mhzMean, mhzStdev, nsMean, nsStdev, totalCycles / totalInsns);
+	fflush(json);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [--runs n] [--cycles n] [--tag text] [--json file] [rom.hex ...]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 5;
+	u32 cycles = 20000000;
+	const char *tag = "";
+	FILE *json = NULL;
+	int first = 1;
+
+	for (; first<argc && !strncmp(argv[first], "--", 2); first += 2)
+	{
+		if (first + 1 >= argc)
+			usage(argv[0]);
+		if (!strcmp(argv[first], "--runs"))
+			runs = atoi(argv[first + 1]);
+		else if (!strcmp(argv[first], "--cycles"))
+			cycles = strtoul(argv[first + 1], NULL, 10);
+		else if (!strcmp(argv[first], "--tag"))
+			tag = argv[first + 1];
+		else if (!strcmp(argv[first], "--json"))
+		{
+			json = fopen(argv[first + 1], "a");
+			if (!json)
+			{
+				fprintf(stderr, "Cannot open '%s'.\n", argv[first + 1]);
+				return 1;
+			}
+		}
+		else
+			usage(argv[0]);
+	}
+	if (runs < 1 || runs > MAX_RUNS || cycles == 0)
+		usage(argv[0]);
+
+	printf("%d runs of %u cycles each\n", runs, cycles);
+
+	for (unsigned i=0; i<sizeof(programs)/sizeof(programs[0]); i++)
+	{
+		avr8 *cpu = create_cpu(programs[i].sd);
+		const char *hex = programs[i].hex;
+		if (!loadHexBuffer(hex, strlen(hex), programs[i].name, (unsigned char*)cpu->progmem, sizeof(cpu->progmem)))
+		{
+			fprintf(stderr, "Bad hex image for %s.\n", programs[i].name);
+			return 1;
+		}
+		run(json, tag, programs[i].name, cpu, runs, cycles);
+		delete cpu;
+	}
+
+	for (int i=first; i<argc; i++)
+	{
+		// Named after the file, without directory or extension
+		const char *name = argv[i];
+		for (const char *p = argv[i]; *p; p++)
+			if (*p == '/' || *p == '\\')
+				name = p + 1;
+		char label[64];
+		snprintf(label, sizeof(label), "%s", name);
+		char *dot = strrchr(label, '.');
+		if (dot)
+			*dot = 0;
+
+		avr8 *cpu = create_cpu(false);
+		if (!loadHexFile(argv[i], (unsigned char*)cpu->progmem, sizeof(cpu->progmem)))
+		{
+			fprintf(stderr, "Cannot load '%s'.\n", argv[i]);
+			return 1;
+		}
+		run(json, tag, label, cpu, runs, cycles);
+		delete cpu;
+	}
+
+	if (json)
+		fclose(json);
+	return 0;
+}
@@ -139,30 +139,33 @@ word GdbServer::avr_core_flash_read(int addr) {
 }
 
 void GdbServer::avr_core_flash_write( unsigned int addr, word val) {
-    if (addr>= progSize) {
+    if (addr>= core->progSize) {
         cerr << "try to write in flash after last valid address!" << endl;
         exit(0);
     }
 
     core->progmem[addr]=val;
+    core->invalidate_insn(addr);
 }
 
 void GdbServer::avr_core_flash_write_hi8( unsigned int addr, byte val) {
-    if ((addr*2)>= progSize) {
+    if ((addr*2)>= core->progSize) {
         cerr << "try to write in flash after last valid address!" << endl;
         exit(0);
     }
     u16 tmp = (core->progmem[addr] & 0x00FF) | (val << 8);
     core->progmem[addr] = tmp;
+    core->invalidate_insn(addr);
 }
 
 void GdbServer::avr_core_flash_write_lo8( unsigned int addr, byte val) {
-    if (addr>=progSize) {
+    if (addr>=core->progSize) {
         cerr << "try to write in flash after last valid address!" << endl;
         exit(0);
     }
     u16 tmp = (core->progmem[addr] & 0xFF00) | (val);
     core->progmem[addr] = tmp;
+    core->invalidate_insn(addr);
 }
 
 void GdbServer::avr_core_remove_breakpoint(dword pc) {
@@ -381,6 +384,7 @@ void GdbServer::gdb_read_registers( )
     }
 
     /* GDB thinks SREG is register number 32 */
+    core->sync_flags();
     val = core->SREG;
     buf[i*2]   = HEX_DIGIT[(val >> 4) & 0xf];
     buf[i*2+1] = HEX_DIGIT[val & 0xf];
@@ -445,6 +449,7 @@ void GdbServer::gdb_write_registers( char *pkt )
     /* GDB thinks SREG is register number 32 */
     bval  = hex2nib(*pkt++) << 4;
     bval += hex2nib(*pkt++);
+    core->sync_flags();
     core->SREG=bval;
 
     /* GDB thinks SP is register number 33 */
@@ -527,6 +532,7 @@ void GdbServer::gdb_read_register( char *pkt )
     }
     else if (reg == 32)         /* sreg */
     {
+        core->sync_flags();
         byte val = core->SREG;
         snprintf( reply, sizeof(reply)-1, "%02x", val );
     }
@@ -578,6 +584,7 @@ void GdbServer::gdb_write_register( char *pkt )
         /* r0 to r31 and SREG */
         if (reg == 32)          /* gdb thinks SREG is register 32 */
         {
+            core->sync_flags();
             core->SREG=val&0xff;
         }
         else
@@ -690,7 +697,7 @@ void GdbServer::gdb_read_memory( char *pkt )
 
         addr = addr & ~MEM_SPACE_MASK; /* remove the offset bits */
 
-	if (addr >= (SRAMBASE+sramSize))
+	if (addr >= (SRAMBASE+core->sramSize))
 	{
 	    if (global_debug_on)
 	        printf("Sram address:%x invalid\n",addr);
@@ -821,7 +828,7 @@ void GdbServer::gdb_write_memory( char *pkt )
 
         addr = addr & ~MEM_SPACE_MASK; /* remove the offset bits */
 
-	if (addr >= (SRAMBASE+sramSize))
+	if (addr >= (SRAMBASE+core->sramSize))
 	{
 	    if (global_debug_on)
 	        printf("Sram address:%x invalid\n",addr);
@@ -938,7 +945,7 @@ void GdbServer::gdb_break_point( char *pkt )
     switch (t) {
         case '0':               /* software breakpoint */
             /* addr/2 since addr refers to PC */
-            if ( addr >= progSize )
+            if ( addr >= core->progSize )
             {
                 printf( "Attempt to set break at invalid addr\n" );
                 gdb_send_reply( "E01" );
@@ -1363,6 +1370,7 @@ void GdbServer::SendPosition(int signo) {
     bytes = snprintf( reply, MAX_BUF, "T%02x", signo );
 
     /* SREG, SP & PC */
+    core->sync_flags();
     snprintf( reply+bytes, MAX_BUF-bytes,
             "20:%02x;" "21:%02x%02x;" "22:%02x%02x%02x%02x;",
             ((int)(core->SREG)),
@@ -0,0 +1,270 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#include <string.h>
+#include "hexloader.h"
+
+#if defined(__WIN32__) || defined(_MSC_VER)
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+#endif
+
+//http://en.wikipedia.org/wiki/.hex
+
+//(I've added the spaces for clarity, they don't exist in the real files)
+//:10 65B0 00 661F771F881F991F1A9469F760957095 59
+//:02 0000 04 0001 F9 [upper 16 bits of the following addresses]
+//:00 0000 01 FF [EOF marker]
+
+//First field is the byte count, then the 16-bit address, the record type and
+//the data. The checksum makes all the bytes of the record sum to zero.
+
+enum { HEX_DATA, HEX_EOF, HEX_SEGMENT, HEX_START_SEGMENT, HEX_LINEAR, HEX_START_LINEAR };
+
+// Value of each character as a hex digit, -1 if it isn't one
+static const signed char nibbles[256] =
+{
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+	-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+// Adds [start,end) to the sorted ranges, joining the ones it touches
+static void addRange(HexInfo *info, uint32_t start, uint32_t end)
+{
+	HexRange *r = info->ranges;
+	int i = info->rangeCount;
+
+	// records mostly follow each other, so look from the top down
+	while (i > 0 && r[i-1].end >= start)
+		i--;
+	if (i < info->rangeCount && r[i].start <= end)
+	{
+		if (start < r[i].start)
+			r[i].start = start;
+		if (end > r[i].end)
+			r[i].end = end;
+		int j = i+1;
+		while (j < info->rangeCount && r[j].start <= r[i].end)
+		{
+			if (r[j].end > r[i].end)
+				r[i].end = r[j].end;
+			j++;
+		}
+		memmove(r+i+1, r+j, (info->rangeCount-j)*sizeof(HexRange));
+		info->rangeCount -= j-i-1;
+		return;
+	}
+
+	if (info->rangeCount == HEX_MAX_RANGES)
+	{
+		// no room, grow whichever neighbour is closest
+		info->rangesMerged = true;
+		if (i == info->rangeCount || (i > 0 && start-r[i-1].end < r[i].start-end))
+			r[i-1].end = end;
+		else
+			r[i].start = start;
+		return;
+	}
+	memmove(r+i+1, r+i, (info->rangeCount-i)*sizeof(HexRange));
+	r[i].start = start;
+	r[i].end = end;
+	info->rangeCount++;
+}
+
+bool loadHexBuffer(const char *text,size_t size,const char *name,unsigned char *buffer,size_t bufferSize,HexInfo *info)
+{
+	HexInfo local;
+	if (!info)
+		info = &local;
+	memset(info, 0, sizeof(*info));
+
+	const unsigned char *p = (const unsigned char*)text;
+	const unsigned char *end = p + size;
+	unsigned char record[255+5];
+	uint32_t base = 0;
+	int line = 1;
+
+	for (;;)
+	{
+		while (p < end && *p != ':')
+		{
+			if (*p == '\n')
+				line++;
+			else if (*p != '\r' && *p != ' ' && *p != '\t')
+			{
+				fprintf(stderr, "%s:%d: expected a record\n", name, line);
+				return false;
+			}
+			p++;
+		}
+		if (p == end)
+		{
+			fprintf(stderr, "%s:%d: no end of file record\n", name, line);
+			return false;
+		}
+		p++;
+
+		// byte count, address, type, data and checksum, two digits each
+		int length = end-p >= 2 && (nibbles[p[0]] | nibbles[p[1]]) >= 0? (nibbles[p[0]] << 4) | nibbles[p[1]] : 0;
+		if (end-p < 2*(length+5))
+		{
+			fprintf(stderr, "%s:%d: truncated record\n", name, line);
+			return false;
+		}
+		unsigned char sum = 0;
+		for (int i=0; i<length+5; i++, p+=2)
+		{
+			int hi = nibbles[p[0]], lo = nibbles[p[1]];
+			if ((hi | lo) < 0)
+			{
+				fprintf(stderr, "%s:%d: bad hex digit\n", name, line);
+				return false;
+			}
+			record[i] = (hi << 4) | lo;
+			sum += record[i];
+		}
+		if (sum)
+		{
+			fprintf(stderr, "%s:%d: bad checksum\n", name, line);
+			return false;
+		}
+
+		uint32_t addr = base + ((record[1] << 8) | record[2]);
+		const unsigned char *data = record + 4;
+		switch (record[3])
+		{
+		case HEX_DATA:
+			if (addr + length > bufferSize)
+			{
+				uint32_t kept = addr < bufferSize? bufferSize - addr : 0;
+				info->dropped += length - kept;
+				length = kept;
+			}
+			if (length)
+			{
+				memcpy(buffer + addr, data, length);
+				addRange(info, addr, addr + length);
+			}
+			break;
+		case HEX_EOF:
+			for (int i=0; i<info->rangeCount; i++)
+				info->bytes += info->ranges[i].end - info->ranges[i].start;
+			if (info->rangeCount)
+				info->end = info->ranges[info->rangeCount-1].end;
+			return true;
+		case HEX_SEGMENT:
+		case HEX_LINEAR:
+			if (length != 2)
+			{
+				fprintf(stderr, "%s:%d: bad address record\n", name, line);
+				return false;
+			}
+			base = (data[0] << 8) | data[1];
+			base <<= record[3] == HEX_SEGMENT? 4 : 16;
+			break;
+		case HEX_START_SEGMENT:
+		case HEX_START_LINEAR:
+			// entry point, the AVR always starts at 0
+			break;
+		default:
+			fprintf(stderr, "%s:%d: ignoring unknown record type %d\n", name, line, record[3]);
+			break;
+		}
+	}
+}
+
+bool loadHexFile(const char *filename,unsigned char *buffer,size_t bufferSize,HexInfo *info)
+{
+	const char *text = NULL;
+	size_t size = 0;
+
+#if defined(__WIN32__) || defined(_MSC_VER)
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	size = GetFileSize(file, NULL);
+	HANDLE mapping = size? CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	if (mapping)
+		text = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		size = st.st_size;
+		void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED)
+			text = (const char*)mapped;
+	}
+	close(fd);
+#endif
+
+	bool result;
+	if (text || !size)
+		result = loadHexBuffer(text? text : "", size, filename, buffer, bufferSize, info);
+	else
+	{
+		fprintf(stderr, "%s: cannot map the file\n", filename);
+		result = false;
+	}
+
+#if defined(__WIN32__) || defined(_MSC_VER)
+	if (text)
+		UnmapViewOfFile(text);
+	if (mapping)
+		CloseHandle(mapping);
+	CloseHandle(file);
+#else
+	if (text)
+		munmap((void*)text, size);
+#endif
+	return result;
+}
+
+void printHexRanges(FILE *out,const HexInfo *info)
+{
+	for (int i=0; i<info->rangeCount; i++)
+		fprintf(out, "%s0x%04X-0x%04X", i? ", " : "", (unsigned)info->ranges[i].start, (unsigned)info->ranges[i].end-1);
+	if (!info->rangeCount)
+		fprintf(out, "none");
+}
@@ -0,0 +1,76 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#ifndef HEXLOADER_H
+#define HEXLOADER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Intel hex loader, shared by uzem and packrom.
+ *
+ * The image is parsed in one pass straight from memory, files being mapped
+ * rather than read line by line. Every record's checksum is checked, and
+ * extended segment (02) and linear (04) address records set the upper
+ * address bits, so ATmega1284 images past 64K land where they belong.
+ * Data past the end of the buffer is counted but not stored. The end of
+ * file (01) record is required; anything after it is ignored.
+ *
+ * Errors are printed to stderr as "<name>:<line>: <problem>".
+ */
+
+#define HEX_MAX_RANGES 16
+
+struct HexRange
+{
+	uint32_t start, end;	// end is one past the last byte
+};
+
+struct HexInfo
+{
+	uint32_t bytes;		// bytes stored in the buffer
+	uint32_t end;		// one past the highest byte stored
+	uint32_t dropped;	// data bytes past the end of the buffer
+	int rangeCount;
+	HexRange ranges[HEX_MAX_RANGES];	// bytes stored, by address
+	bool rangesMerged;	// more ranges than fit: gaps were joined in, and count in bytes
+};
+
+/*
+    loadHexBuffer - loads the hex image held in text into buffer, size being the length of text.
+*/
+bool loadHexBuffer(const char *text,size_t size,const char *name,unsigned char *buffer,size_t bufferSize,HexInfo *info = 0);
+
+/*
+    loadHexFile - same as loadHexBuffer for a hex file, false if it can't be opened.
+*/
+bool loadHexFile(const char *filename,unsigned char *buffer,size_t bufferSize,HexInfo *info = 0);
+
+/*
+    printHexRanges - prints the ranges stored as "0x0000-0x1FFF, ...", without a newline.
+*/
+void printHexRanges(FILE *out,const HexInfo *info);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "libuzem.h"
+#include "avr8.h"
+#include "ntsc.h"
+#include "uzerom.h"
+#include "hexloader.h"
+
+struct StateHeader
+{
+	char magic[4];			// "UZS1"
+	u32 size;				// sizeof(Snapshot), tells builds apart
+	u32 mcu;
+};
+
+struct uzem
+{
+	avr8 cpu;
+	Snapshot snapshot;		// staging for the state calls, the buffer may be unaligned
+	u8 audio[AUDIO_CAPTURE_MAX];
+	u32 palette[256];		// 0x00RRGGBB for uzem_render()
+	NtscFilter *ntsc;
+};
+
+uzem *uzem_create(void)
+{
+	uzem *emu = new uzem();
+	avr8 &cpu = emu->cpu;
+
+	cpu.embedded = true;
+	cpu.headless = true;
+	cpu.enableSound = false;
+	cpu.eepromFile = NULL;
+	cpu.state = CPU_RUNNING;
+	cpu.audioCapture = emu->audio;
+	memset(cpu.eeprom, 0xff, sizeof(cpu.eeprom));	// erased, like LoadEEPROMFile() without a file
+	cpu.init_video();
+
+	// Same 3:3:2 expansion as uzem's window
+	for (int i=0; i<256; i++)
+	{
+		int red = (((i >> 0) & 7) * 255) / 7;
+		int green = (((i >> 3) & 7) * 255) / 7;
+		int blue = (((i >> 6) & 3) * 255) / 3;
+		emu->palette[i] = (red << 16) | (green << 8) | blue;
+	}
+	emu->ntsc = NULL;
+	return emu;
+}
+
+void uzem_destroy(uzem *emu)
+{
+	delete emu->ntsc;
+	delete emu;
+}
+
+int uzem_load_rom(uzem *emu, const void *data, size_t size)
+{
+	avr8 &cpu = emu->cpu;
+	u8 *buffer = (u8*)cpu.progmem;
+	const u8 *bytes = (const u8*)data;
+
+	memset(cpu.progmem, 0, sizeof(cpu.progmem));
+	if (size >= 6 && !memcmp(bytes, "UZEBOX", 6))
+	{
+		RomHeader header;
+		if (!loadUzeBuffer(bytes, size, &header, buffer))
+			return -1;
+		cpu.set_mcu(header.target);
+		return 0;
+	}
+
+	HexInfo info;
+	if (!loadHexBuffer((const char*)data, size, "rom", buffer, sizeof(cpu.progmem), &info))
+		return -1;
+	// only the 1284 has flash past 64K
+	cpu.set_mcu(info.end > 65536? MCU_1284 : MCU_644);
+	return 0;
+}
+
+int uzem_step_frame(uzem *emu, unsigned p1, unsigned p2)
+{
+	avr8 &cpu = emu->cpu;
+
+	// Active low, and io_write_portb() keeps the unused bits set
+	cpu.buttons[0] = ~p1 | 0xFFFF8000;
+	cpu.buttons[1] = ~p2 | 0xFFFF8000;
+	cpu.audioCaptureCount = 0;
+
+	int frame = cpu.frameCounter;
+	u32 start = cpu.cycleCounter;
+	while (cpu.frameCounter == frame)
+	{
+		if (cpu.state == CPU_STOPPED)
+			return -1;
+		if (cpu.cycleCounter - start >= AHEAD_MAX_FRAME_CYCLES)
+			return 0;
+		cpu.exec();
+	}
+	return 1;
+}
+
+int uzem_frame_count(uzem *emu)
+{
+	return emu->cpu.frameCounter;
+}
+
+const uint8_t *uzem_framebuffer(uzem *emu)
+{
+	return emu->cpu.framebuffer;
+}
+
+const uint16_t *uzem_frame_columns(uzem *emu)
+{
+	return emu->cpu.scanline_xmap;
+}
+
+void uzem_render(uzem *emu, uint32_t *pixels, int pitch)
+{
+	avr8 &cpu = emu->cpu;
+	if (emu->ntsc)
+	{
+		emu->ntsc->render(pixels, pitch, cpu.framebuffer, cpu.scanline_xmap, cpu.frameCounter, false);
+		return;
+	}
+
+	const u8 *src = cpu.framebuffer;
+	for (int y=0; y<VIDEO_LINES; y++, pixels += 2 * pitch, src += VIDEO_LINE_CYCLES)
+	{
+		for (int x=0; x<VIDEO_WIDTH; x++)
+			pixels[x] = emu->palette[src[cpu.scanline_xmap[x]]];
+		memcpy(pixels + pitch, pixels, VIDEO_WIDTH * sizeof(u32));
+	}
+}
+
+int uzem_set_ntsc(uzem *emu, const char *options)
+{
+	delete emu->ntsc;
+	emu->ntsc = NULL;
+	if (!options)
+		return 0;
+
+	NtscFilter *ntsc = new NtscFilter();
+	if (!ntsc->configure(options))
+	{
+		delete ntsc;
+		return -1;
+	}
+
+	// Only the channel shifts matter, for 0x00RRGGBB
+	SDL_PixelFormat format;
+	memset(&format, 0, sizeof(format));
+	format.Rshift = 16;
+	format.Gshift = 8;
+	format.Bshift = 0;
+	ntsc->init(&format);
+	emu->ntsc = ntsc;
+	return 0;
+}
+
+const uint8_t *uzem_audio(uzem *emu, int *count)
+{
+	*count = emu->cpu.audioCaptureCount;
+	return emu->audio;
+}
+
+size_t uzem_state_size(void)
+{
+	return sizeof(StateHeader) + sizeof(Snapshot);
+}
+
+int uzem_save_state(uzem *emu, void *buffer, size_t size)
+{
+	if (size < uzem_state_size())
+		return -1;
+
+	StateHeader header;
+	memcpy(header.magic, "UZS1", 4);
+	header.size = sizeof(Snapshot);
+	header.mcu = emu->cpu.mcu - mcus;
+	emu->cpu.save_state(emu->snapshot);
+
+	memcpy(buffer, &header, sizeof(header));
+	memcpy((u8*)buffer + sizeof(header), &emu->snapshot, sizeof(Snapshot));
+	return 0;
+}
+
+int uzem_load_state(uzem *emu, const void *buffer, size_t size)
+{
+	StateHeader header;
+	if (size < uzem_state_size())
+		return -1;
+	memcpy(&header, buffer, sizeof(header));
+	if (memcmp(header.magic, "UZS1", 4) || header.size != sizeof(Snapshot) || header.mcu > MCU_1284)
+		return -1;
+
+	avr8 &cpu = emu->cpu;
+	if (cpu.mcu != &mcus[header.mcu])
+		cpu.set_mcu(header.mcu);
+	memcpy(&emu->snapshot, (const u8*)buffer + sizeof(header), sizeof(Snapshot));
+	cpu.load_state(emu->snapshot);
+	return 0;
+}
+
+// Register, I/O or SRAM byte at a data space address, NULL past the end
+static u8 *data_byte(avr8 &cpu, u32 address)
+{
+	if (address < IOBASE)
+		return &cpu.r[address];
+	if (address < SRAMBASE)
+		return &cpu.io[address - IOBASE];
+	if (address - SRAMBASE < cpu.sramSize)
+		return &cpu.sram[address - SRAMBASE];
+	return NULL;
+}
+
+size_t uzem_read_memory(uzem *emu, int space, uint32_t address, void *buffer, size_t length)
+{
+	avr8 &cpu = emu->cpu;
+	u8 *dest = (u8*)buffer;
+	size_t i;
+
+	// Settle the batched hardware and the lazy SREG bits first
+	cpu.sync_hardware();
+	cpu.sync_flags();
+
+	for (i = 0; i < length; i++)
+	{
+		u32 at = address + i;
+		if (space == UZEM_DATA)
+		{
+			u8 *byte = data_byte(cpu, at);
+			if (!byte)
+				break;
+			dest[i] = *byte;
+		}
+		else if (space == UZEM_PROGRAM && at < cpu.progSize)
+			dest[i] = cpu.read_progmem_far(at);
+		else if (space == UZEM_EEPROM && at < cpu.eepromSize)
+			dest[i] = cpu.eeprom[at];
+		else
+			break;
+	}
+	return i;
+}
+
+size_t uzem_write_memory(uzem *emu, int space, uint32_t address, const void *buffer, size_t length)
+{
+	avr8 &cpu = emu->cpu;
+	const u8 *src = (const u8*)buffer;
+	size_t i;
+
+	cpu.sync_hardware();
+	cpu.sync_flags();
+
+	for (i = 0; i < length; i++)
+	{
+		u32 at = address + i;
+		if (space == UZEM_DATA)
+		{
+			u8 *byte = data_byte(cpu, at);
+			if (!byte)
+				break;
+			*byte = src[i];
+		}
+		else if (space == UZEM_PROGRAM && at < cpu.progSize)
+		{
+			u16 &word = cpu.progmem[at >> 1];
+			word = (at & 1)? (word & 0x00ff) | (src[i] << 8) : (word & 0xff00) | src[i];
+			cpu.invalidate_insn(at >> 1);
+		}
+		else if (space == UZEM_EEPROM && at < cpu.eepromSize)
+			cpu.eeprom[at] = src[i];
+		else
+			break;
+	}
+
+	// The next hardware update has to see what changed
+	cpu.hwQuiet = 0;
+	return i;
+}
+
+uint8_t *uzem_sram(uzem *emu, size_t *size)
+{
+	*size = emu->cpu.sramSize;
+	return emu->cpu.sram;
+}
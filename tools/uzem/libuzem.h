@@ -0,0 +1,131 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#ifndef LIBUZEM_H
+#define LIBUZEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libuzem: the emulator core without a window, for test harnesses, bots
+ * and the like that want to run games in-process, frame by frame.
+ *
+ *   uzem *emu = uzem_create();
+ *   uzem_load_rom(emu, data, size);		// .uze or Intel hex
+ *   while (uzem_step_frame(emu, UZEM_PAD_START, 0) > 0)
+ *       look at uzem_framebuffer(emu) and uzem_audio(emu, &count)
+ *   uzem_destroy(emu);
+ *
+ * Frames are native: UZEM_FRAME_HEIGHT lines of UZEM_FRAME_WIDTH palette
+ * indexes, one per CPU cycle of the visible part of the line. An index is
+ * the kernel's BBGGGRRR color. uzem_frame_columns() gives the cycle shown
+ * in each of the UZEM_SCREEN_WIDTH columns uzem draws.
+ *
+ * Pointers handed out stay valid until uzem_destroy() and are updated in
+ * place, nothing is copied. Instances don't share anything except the SD
+ * card emulation, which libuzem doesn't enable, so each can run on a
+ * thread of its own. SDL is linked but never initialized.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UZEM_FRAME_WIDTH	1440
+#define UZEM_FRAME_HEIGHT	224
+#define UZEM_SCREEN_WIDTH	630
+#define UZEM_AUDIO_RATE		15734	/* unsigned 8-bit mono, one sample per line */
+
+/* Pad buttons for uzem_step_frame(), set when pressed, SNES bit order */
+#define UZEM_PAD_B			(1<<0)
+#define UZEM_PAD_Y			(1<<1)
+#define UZEM_PAD_SELECT		(1<<2)
+#define UZEM_PAD_START		(1<<3)
+#define UZEM_PAD_UP			(1<<4)
+#define UZEM_PAD_DOWN		(1<<5)
+#define UZEM_PAD_LEFT		(1<<6)
+#define UZEM_PAD_RIGHT		(1<<7)
+#define UZEM_PAD_A			(1<<8)
+#define UZEM_PAD_X			(1<<9)
+#define UZEM_PAD_L			(1<<10)
+#define UZEM_PAD_R			(1<<11)
+
+/* Address spaces for uzem_read_memory() and uzem_write_memory() */
+enum
+{
+	UZEM_DATA,		/* registers, I/O and SRAM as the CPU addresses them */
+	UZEM_PROGRAM,	/* flash, in bytes */
+	UZEM_EEPROM
+};
+
+typedef struct uzem uzem;
+
+uzem *uzem_create(void);
+void uzem_destroy(uzem *emu);
+
+/* Loads an .uze or Intel hex image, once after uzem_create(). 0 on success. */
+int uzem_load_rom(uzem *emu, const void *data, size_t size);
+
+/* Runs until the next frame is done with the pads set to p1 and p2.
+   1 for a frame, 0 if the game didn't finish one within two frame times,
+   -1 if the CPU stopped on an invalid instruction. */
+int uzem_step_frame(uzem *emu, unsigned p1, unsigned p2);
+
+/* Frames done so far */
+int uzem_frame_count(uzem *emu);
+
+const uint8_t *uzem_framebuffer(uzem *emu);
+const uint16_t *uzem_frame_columns(uzem *emu);
+
+/* Renders the last frame as 0x00RRGGBB pixels, UZEM_SCREEN_WIDTH wide and
+   UZEM_FRAME_HEIGHT*2 lines high like uzem's window, pitch in pixels. */
+void uzem_render(uzem *emu, uint32_t *pixels, int pitch);
+
+/* Makes uzem_render() simulate a composite signal, options being those of
+   uzem's --ntsc= ("" for the defaults, NULL turns it off). 0 on success,
+   -1 if the options are bad. */
+int uzem_set_ntsc(uzem *emu, const char *options);
+
+/* Samples output during the last uzem_step_frame() */
+const uint8_t *uzem_audio(uzem *emu, int *count);
+
+/* The whole machine, only loads back into the same build of libuzem.
+   Save and load return 0 on success, -1 if the buffer doesn't fit. */
+size_t uzem_state_size(void);
+int uzem_save_state(uzem *emu, void *buffer, size_t size);
+int uzem_load_state(uzem *emu, const void *buffer, size_t size);
+
+/* Copies up to length bytes and returns how many were in range. Data space
+   access goes straight to the registers, without I/O side effects. */
+size_t uzem_read_memory(uzem *emu, int space, uint32_t address, void *buffer, size_t length);
+size_t uzem_write_memory(uzem *emu, int space, uint32_t address, const void *buffer, size_t length);
+
+/* SRAM itself, size bytes from data address 0x100 */
+uint8_t *uzem_sram(uzem *emu, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
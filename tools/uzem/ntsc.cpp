@@ -0,0 +1,267 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "ntsc.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Fixed point scales: composite samples carry 4 fractional bits,
+// the subcarrier tables 6.
+#define SAMPLE_ONE	16
+#define CARRIER_ONE	64
+
+static inline u32 clamp255(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+NtscFilter::NtscFilter()
+{
+	settings.sharpness = 8;
+	settings.bleed = 2;
+	settings.saturation = 100;
+	settings.scanlines = 75;
+	settings.dotCrawl = false;
+}
+
+bool NtscFilter::configure(const char *options)
+{
+	while (*options)
+	{
+		char key[16];
+		int value, used = 0;
+		bool ok = sscanf(options, "%15[a-z]=%d%n", key, &value, &used) == 2;
+		if (ok && !strcmp(key, "sharp") && (value == 0 || value == 1))
+			settings.sharpness = value ? 4 : 8;
+		else if (ok && !strcmp(key, "bleed") && value >= 1 && value <= 4)
+			settings.bleed = value;
+		else if (ok && !strcmp(key, "sat") && value >= 0 && value <= 200)
+			settings.saturation = value;
+		else if (ok && !strcmp(key, "scanlines") && value >= 0 && value <= 100)
+			settings.scanlines = value;
+		else if (ok && !strcmp(key, "crawl") && (value == 0 || value == 1))
+			settings.dotCrawl = value;
+		else
+			ok = false;
+
+		options += used;
+		if (!ok || (*options && *options++ != ','))
+		{
+			fprintf(stderr, "Bad NTSC option, expected sharp=0|1, bleed=1..4, sat=0..200, scanlines=0..100 or crawl=0|1.\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+void NtscFilter::init(const SDL_PixelFormat *format)
+{
+	rshift = format->Rshift;
+	gshift = format->Gshift;
+	bshift = format->Bshift;
+
+	s32 carrierCos[8], carrierSin[8];
+	for (int p=0; p<8; p++)
+	{
+		double angle = p * M_PI / 4;
+		carrierCos[p] = (s32)floor(cos(angle) * CARRIER_ONE + 0.5);
+		carrierSin[p] = (s32)floor(sin(angle) * CARRIER_ONE + 0.5);
+	}
+
+	// Same 3:3:2 expansion as the plain palette, encoded to YIQ
+	for (int i=0; i<256; i++)
+	{
+		double red = (((i >> 0) & 7) * 255) / 7;
+		double green = (((i >> 3) & 7) * 255) / 7;
+		double blue = (((i >> 6) & 3) * 255) / 3;
+
+		double y = 0.299 * red + 0.587 * green + 0.114 * blue;
+		double ci = 0.596 * red - 0.274 * green - 0.322 * blue;
+		double cq = 0.211 * red - 0.523 * green + 0.312 * blue;
+
+		for (int p=0; p<8; p++)
+		{
+			double angle = p * M_PI / 4;
+			double s = y + ci * cos(angle) + cq * sin(angle);
+			s32 v = (s32)floor(s * SAMPLE_ONE + 0.5);
+			sample[i][p][0] = v;
+			sample[i][p][1] = v * carrierCos[p];
+			sample[i][p][2] = v * carrierSin[p];
+			sample[i][p][3] = 0;
+		}
+	}
+}
+
+void NtscFilter::decode_line(u32 *dest, const u8 *src, int phase)
+{
+	// Running sums of Y, I and Q turn every window average below into
+	// two lookups. Lane 3 is padding so each step is one 16 byte add.
+	int lumaSpanOffset = 4 * settings.sharpness;
+	int chromaSpanOffset = 4 * 8 * settings.bleed;
+
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	_mm_storeu_si128((__m128i*)sums[0], acc);
+	for (int c=0; c<VIDEO_LINE_CYCLES; c++)
+	{
+		acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)sample[src[c]][(c + phase) & 7]));
+		_mm_storeu_si128((__m128i*)sums[c + 1], acc);
+	}
+
+	__m128 ly = _mm_loadu_ps(gainY), li = _mm_loadu_ps(gainI), lq = _mm_loadu_ps(gainQ);
+	for (int x=0; x<VIDEO_WIDTH; x++)
+	{
+		const s32 *lumaLo = sums[lumaStart[x]];
+		const s32 *chromaLo = sums[chromaStart[x]];
+		__m128 luma = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)(lumaLo + lumaSpanOffset)), _mm_loadu_si128((const __m128i*)lumaLo)));
+		__m128 chroma = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)(chromaLo + chromaSpanOffset)), _mm_loadu_si128((const __m128i*)chromaLo)));
+
+		// Lane n of the result is output byte n, the gains already sit in place
+		__m128 rgb = _mm_mul_ps(_mm_shuffle_ps(luma, luma, 0x00), ly);
+		rgb = _mm_add_ps(rgb, _mm_mul_ps(_mm_shuffle_ps(chroma, chroma, 0x55), li));
+		rgb = _mm_add_ps(rgb, _mm_mul_ps(_mm_shuffle_ps(chroma, chroma, 0xaa), lq));
+
+		__m128i pixel = _mm_cvtps_epi32(rgb);
+		pixel = _mm_packs_epi32(pixel, pixel);
+		dest[x] = _mm_cvtsi128_si32(_mm_packus_epi16(pixel, pixel));
+	}
+#else
+	s32 y = 0, i = 0, q = 0;
+	sums[0][0] = sums[0][1] = sums[0][2] = sums[0][3] = 0;
+	for (int c=0; c<VIDEO_LINE_CYCLES; c++)
+	{
+		const s32 *s = sample[src[c]][(c + phase) & 7];
+		s32 *sum = sums[c + 1];
+		sum[0] = y += s[0];
+		sum[1] = i += s[1];
+		sum[2] = q += s[2];
+		sum[3] = 0;
+	}
+
+	for (int x=0; x<VIDEO_WIDTH; x++)
+	{
+		const s32 *lumaLo = sums[lumaStart[x]];
+		const s32 *chromaLo = sums[chromaStart[x]];
+		float luma = (float)(lumaLo[lumaSpanOffset] - lumaLo[0]);
+		float ci = (float)(chromaLo[chromaSpanOffset + 1] - chromaLo[1]);
+		float cq = (float)(chromaLo[chromaSpanOffset + 2] - chromaLo[2]);
+
+		u32 pixel = 0;
+		for (int n=0; n<4; n++)
+			pixel |= clamp255((int)(luma * gainY[n] + ci * gainI[n] + cq * gainQ[n] + 0.5f)) << (n * 8);
+		dest[x] = pixel;
+	}
+#endif
+}
+
+void NtscFilter::setup(const u16 *xmap)
+{
+	int lumaWidth = settings.sharpness;
+	int chromaWidth = settings.bleed * 8;
+
+	// Windows are centered on the sampled cycle and clamped to stay whole
+	// at the line edges, so they always span full subcarrier periods and
+	// the carrier cancels cleanly.
+	for (int x=0; x<VIDEO_WIDTH; x++)
+	{
+		int lo = xmap[x] - lumaWidth / 2 + 1;
+		if (lo < 0) lo = 0;
+		if (lo > VIDEO_LINE_CYCLES - lumaWidth) lo = VIDEO_LINE_CYCLES - lumaWidth;
+		lumaStart[x] = lo;
+
+		lo = xmap[x] - chromaWidth / 2 + 1;
+		if (lo < 0) lo = 0;
+		if (lo > VIDEO_LINE_CYCLES - chromaWidth) lo = VIDEO_LINE_CYCLES - chromaWidth;
+		chromaStart[x] = lo;
+	}
+
+	// YIQ to RGB with the window averages, demodulation gain, saturation
+	// and fixed point scales folded in. Columns are laid out by output
+	// byte so a pixel packs straight from the result.
+	float ky = 1.0f / (lumaWidth * SAMPLE_ONE);
+	float kc = 2.0f * settings.saturation / (100.0f * chromaWidth * SAMPLE_ONE * CARRIER_ONE);
+	int r = rshift / 8, g = gshift / 8, b = bshift / 8;
+	memset(gainY, 0, sizeof(gainY));
+	memset(gainI, 0, sizeof(gainI));
+	memset(gainQ, 0, sizeof(gainQ));
+	gainY[r] = ky; gainI[r] = 0.956f * kc; gainQ[r] = 0.621f * kc;
+	gainY[g] = ky; gainI[g] = -0.272f * kc; gainQ[g] = -0.647f * kc;
+	gainY[b] = ky; gainI[b] = -1.106f * kc; gainQ[b] = 1.703f * kc;
+}
+
+void NtscFilter::blend_line(u32 *dest, const u32 *a, const u32 *b)
+{
+	// Average of both lines scaled by the scanline level, byte by byte
+	int level = settings.scanlines * 256 / 100;
+	int x = 0;
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), scale = _mm_set1_epi16(level);
+	for (; x + 4 <= VIDEO_WIDTH; x += 4)
+	{
+		__m128i avg = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x)));
+		__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(avg, zero), scale), 8);
+		__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(avg, zero), scale), 8);
+		_mm_storeu_si128((__m128i*)(dest + x), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; x < VIDEO_WIDTH; x++)
+	{
+		u32 pixel = 0;
+		for (int n=0; n<32; n+=8)
+			pixel |= (((((a[x] >> n) & 255) + ((b[x] >> n) & 255) + 1) >> 1) * level >> 8) << n;
+		dest[x] = pixel;
+	}
+}
+
+void NtscFilter::render(u32 *dest, int pitch, const u8 *framebuffer, const u16 *xmap, int frame, bool interlaced)
+{
+	int crawl = settings.dotCrawl ? (frame & 1) * 4 : 0;
+
+	setup(xmap);
+
+	for (int y=0; y<VIDEO_LINES; y++)
+	{
+		u32 *line = lines[y & 1];
+
+		// 227.5 subcarrier periods per line: half a period (4 cycles) of shift each line
+		decode_line(line, framebuffer + y * VIDEO_LINE_CYCLES, (y * 4 + crawl) & 7);
+
+		if (interlaced)
+		{
+			memcpy(dest + (2 * y + (frame & 1)) * pitch, line, VIDEO_WIDTH * sizeof(u32));
+			continue;
+		}
+
+		memcpy(dest + 2 * y * pitch, line, VIDEO_WIDTH * sizeof(u32));
+		if (y > 0)
+			blend_line(dest + (2 * y - 1) * pitch, lines[(y - 1) & 1], line);
+	}
+
+	if (!interlaced)
+		blend_line(dest + (2 * VIDEO_LINES - 1) * pitch, lines[(VIDEO_LINES - 1) & 1], lines[(VIDEO_LINES - 1) & 1]);
+}
@@ -0,0 +1,91 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#ifndef NTSC_H
+#define NTSC_H
+
+#include "avr8.h"
+
+/*
+ * Composite video simulation, applied to the native index framebuffer
+ * once per frame (never from the emulation loop).
+ *
+ * The Uzebox pixel clock is 28.636MHz, exactly 8x the NTSC color
+ * subcarrier, so every CPU cycle maps to one of 8 subcarrier phases and
+ * a line of 1820 cycles is 227.5 subcarrier periods: the phase flips by
+ * 180 degrees on each line. Each palette index is encoded to a composite
+ * sample per phase, then decoded like a TV would: luma is averaged over
+ * one subcarrier period and chroma is demodulated and averaged over a
+ * wider window, which gives the color bleed and artifact colors.
+ *
+ * 262 lines of 227.5 periods are a whole number of periods, so like the
+ * real console the picture has no dot crawl from frame to frame unless
+ * asked for.
+ *
+ * configure() takes the --ntsc option string, comma separated settings:
+ *   sharp=0|1         luma window of 8 cycles (clean) or 4 (sharp)
+ *   bleed=1..4        chroma window in subcarrier periods
+ *   sat=0..200        saturation in percent
+ *   scanlines=0..100  brightness of the in-between lines in percent
+ *   crawl=0|1         shift the subcarrier phase every frame
+ */
+
+struct NtscSettings
+{
+	int sharpness;		// luma window in cycles, 4 (sharp) or 8 (clean)
+	int bleed;			// chroma window in subcarrier periods, 1..4
+	int saturation;		// percent, 100 is nominal
+	int scanlines;		// brightness of the in-between lines in percent, 100 for plain doubling
+	bool dotCrawl;		// shift the subcarrier phase every frame, off on the hardware
+};
+
+struct NtscFilter
+{
+	NtscFilter();
+
+	/* Applies an option string as described above, false if it is bad */
+	bool configure(const char *options);
+
+	/* Precomputes the encoder tables and the output pixel packing */
+	void init(const SDL_PixelFormat *format);
+
+	/* Filters one frame of VIDEO_LINES x VIDEO_LINE_CYCLES palette indexes
+	   into 32-bit pixels, VIDEO_WIDTH wide and doubled vertically. */
+	void render(u32 *dest, int pitch, const u8 *framebuffer, const u16 *xmap, int frame, bool interlaced);
+
+	NtscSettings settings;
+
+private:
+	void decode_line(u32 *dest, const u8 *src, int phase);
+	void blend_line(u32 *dest, const u32 *a, const u32 *b);
+	void setup(const u16 *xmap);
+
+	s32 sample[256][8][4];		// per palette index and subcarrier phase: composite sample, then premultiplied by cos and sin
+	s32 sums[VIDEO_LINE_CYCLES + 1][4];	// running Y, I, Q along the current line
+	u16 lumaStart[VIDEO_WIDTH], chromaStart[VIDEO_WIDTH];
+	float gainY[4], gainI[4], gainQ[4];	// YIQ to RGB, one lane per output byte
+	u32 lines[2][VIDEO_WIDTH];
+	u8 rshift, gshift, bshift;
+};
+
+#endif
@@ -0,0 +1,232 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#include <string.h>
+#include "presenter.h"
+
+// Index handoff for the event ring: the payload is written before the index
+// is published, and read before the slot is given back
+static inline int load_index(const int *index)
+{
+	return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_index(int *index, int value)
+{
+	__atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+Presenter::Presenter(avr8 *emu) : emu(emu), back(0), ready(1), front(2), fresh(false),
+	eventHead(0), eventTail(0), mouseDx(0), mouseDy(0), mouseButtons(0), keyRepeat(false), quit(false), stopped(false)
+{
+	for (int i=0; i<3; i++)
+	{
+		// Padded like avr8::framebuffer, for the vectorized expansion
+		frames[i] = new u8[VIDEO_LINES * VIDEO_LINE_CYCLES + 4];
+		memset(frames[i], 0, VIDEO_LINES * VIDEO_LINE_CYCLES + 4);
+		frameNumbers[i] = 0;
+	}
+	caption[0] = 0;
+	screenshot[0] = 0;
+
+	lock = SDL_CreateMutex();
+	changed = SDL_CreateCond();
+}
+
+Presenter::~Presenter()
+{
+	SDL_DestroyCond(changed);
+	SDL_DestroyMutex(lock);
+	for (int i=0; i<3; i++)
+		delete[] frames[i];
+}
+
+void Presenter::run()
+{
+	SDL_mutexP(lock);
+	while (!quit)
+	{
+		if (fresh)
+		{
+			int newest = ready;
+			ready = front;
+			front = newest;
+			fresh = false;
+			SDL_CondBroadcast(changed);
+			SDL_mutexV(lock);
+
+			emu->render_frame(frames[front], frameNumbers[front]);
+			SDL_Flip(emu->screen);
+			SDL_framerateDelay(&emu->fpsmanager);
+		}
+		else
+		{
+			// Keep the window alive while the game isn't sending frames
+			SDL_CondWaitTimeout(changed, lock, 10);
+			SDL_mutexV(lock);
+		}
+
+		pump_events();
+		SDL_mutexP(lock);
+	}
+
+	stopped = true;
+	SDL_CondBroadcast(changed);
+	SDL_mutexV(lock);
+}
+
+void Presenter::stop()
+{
+	SDL_mutexP(lock);
+	quit = true;
+	SDL_CondBroadcast(changed);
+	while (!stopped)
+		SDL_CondWait(changed, lock);
+	SDL_mutexV(lock);
+}
+
+void Presenter::pump_events()
+{
+	SDL_Event event;
+	bool queued = false;
+	while (SDL_PollEvent(&event))
+	{
+		int tail = eventTail;
+		int next = (tail + 1) % PRESENT_EVENTS;
+		if (next != load_index(&eventHead))
+		{
+			events[tail] = event;
+			store_index(&eventTail, next);
+			queued = true;
+		}
+	}
+
+	// Only needed by a single-stepping emulation waiting in poll_event()
+	if (queued)
+	{
+		SDL_mutexP(lock);
+		SDL_CondBroadcast(changed);
+		SDL_mutexV(lock);
+	}
+
+	// The emulation only looks at the mouse once a frame, so add up the motion
+	int dx, dy;
+	u8 buttons = SDL_GetRelativeMouseState(&dx,&dy);
+	if (emu->pad_mode == avr8::SNES_MOUSE && emu->fullscreen)
+	{
+		// keep mouse centered so it doesn't get stuck on edge of screen.
+		// ...and immediately consume the bogus motion event it generated.
+		int ignored;
+		SDL_WarpMouse(400,300);
+		SDL_GetRelativeMouseState(&ignored,&ignored);
+	}
+
+	char title[sizeof(caption)], path[sizeof(screenshot)];
+	SDL_mutexP(lock);
+	mouseDx += dx;
+	mouseDy += dy;
+	mouseButtons = buttons;
+	strcpy(title, caption);
+	strcpy(path, screenshot);
+	bool repeat = keyRepeat;
+	caption[0] = 0;
+	screenshot[0] = 0;
+	keyRepeat = false;
+	SDL_mutexV(lock);
+
+	if (title[0])
+		SDL_WM_SetCaption(title, NULL);
+	if (path[0])
+		SDL_SaveBMP(emu->screen, path);
+	if (repeat)
+		SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY,SDL_DEFAULT_REPEAT_INTERVAL);
+}
+
+void Presenter::submit_frame(const u8 *framebuffer, int frameCounter)
+{
+	memcpy(frames[back], framebuffer, VIDEO_LINES * VIDEO_LINE_CYCLES);
+	frameNumbers[back] = frameCounter;
+
+	SDL_mutexP(lock);
+	// Only blocks when the presenter is a whole frame behind
+	while (fresh && !stopped)
+		SDL_CondWait(changed, lock);
+	int done = back;
+	back = ready;
+	ready = done;
+	fresh = true;
+	SDL_CondBroadcast(changed);
+	SDL_mutexV(lock);
+}
+
+bool Presenter::poll_event(SDL_Event &event, bool wait)
+{
+	int head = eventHead;
+	if (wait && head == load_index(&eventTail))
+	{
+		SDL_mutexP(lock);
+		while (head == load_index(&eventTail) && !stopped)
+			SDL_CondWait(changed, lock);
+		SDL_mutexV(lock);
+	}
+
+	if (head == load_index(&eventTail))
+		return false;
+	event = events[head];
+	store_index(&eventHead, (head + 1) % PRESENT_EVENTS);
+	return true;
+}
+
+u8 Presenter::read_mouse(int *dx, int *dy)
+{
+	SDL_mutexP(lock);
+	*dx = mouseDx;
+	*dy = mouseDy;
+	mouseDx = mouseDy = 0;
+	u8 buttons = mouseButtons;
+	SDL_mutexV(lock);
+	return buttons;
+}
+
+void Presenter::set_caption(const char *text)
+{
+	SDL_mutexP(lock);
+	strncpy(caption, text, sizeof(caption) - 1);
+	caption[sizeof(caption) - 1] = 0;
+	SDL_mutexV(lock);
+}
+
+void Presenter::save_screenshot(const char *path)
+{
+	SDL_mutexP(lock);
+	strncpy(screenshot, path, sizeof(screenshot) - 1);
+	screenshot[sizeof(screenshot) - 1] = 0;
+	SDL_mutexV(lock);
+}
+
+void Presenter::enable_key_repeat()
+{
+	SDL_mutexP(lock);
+	keyRepeat = true;
+	SDL_mutexV(lock);
+}
@@ -0,0 +1,105 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#ifndef PRESENTER_H
+#define PRESENTER_H
+
+#include "avr8.h"
+
+/*
+ * Shows frames on a thread of its own, so the emulation never waits for
+ * the display.
+ *
+ * SDL 1.2 wants the window and its events handled on the thread that
+ * opened them, so the presenter runs on the main thread and the emulation
+ * on a second one. At the end of each frame the emulation copies it to a
+ * back buffer and swaps that with the newest finished frame. The presenter
+ * takes the newest frame, expands it with avr8::render_frame(), flips and
+ * keeps the frame rate. With three buffers the emulation only waits if the
+ * presenter hasn't picked up the previous frame yet.
+ *
+ * Input goes the other way: the events the presenter pumps are queued, and
+ * the emulation handles them at the end of its next frame, like before.
+ * The queue is a single producer, single consumer ring, each side only
+ * storing its own index, so neither side takes a lock to pass an event.
+ *
+ * Everything that has to happen on the window's thread is asked for from
+ * the emulation and done by the presenter: the caption, screenshots and key
+ * repeat. On the way out shutdown() stops the presenter and the emulation
+ * thread returns, and the main thread joins it before exiting.
+ */
+
+#define PRESENT_EVENTS	256		// queued events, more are dropped
+
+struct Presenter
+{
+	Presenter(avr8 *emu);
+	~Presenter();
+
+	/* Shows frames and pumps events until stop(), on the window's thread */
+	void run();
+
+	/* Stops run() from another thread and waits until it's out of SDL */
+	void stop();
+
+	/* The rest is for the emulation thread */
+
+	/* Queues the finished frame, only blocks if the last one wasn't shown yet */
+	void submit_frame(const u8 *framebuffer, int frameCounter);
+
+	/* Next queued event, false when there is none unless wait is set */
+	bool poll_event(SDL_Event &event, bool wait);
+
+	/* Mouse motion since the last call, like SDL_GetRelativeMouseState() */
+	u8 read_mouse(int *dx, int *dy);
+
+	void set_caption(const char *text);
+	void save_screenshot(const char *path);
+	void enable_key_repeat();
+
+private:
+	void pump_events();
+
+	avr8 *emu;
+
+	u8 *frames[3];
+	int frameNumbers[3];
+	int back, ready, front;		// filled by the emulation, newest finished, shown
+	bool fresh;					// ready hasn't been shown yet
+
+	SDL_Event events[PRESENT_EVENTS];
+	int eventHead, eventTail;	// only written by the emulation and the presenter
+
+	int mouseDx, mouseDy;
+	u8 mouseButtons;
+
+	char caption[128];
+	char screenshot[32];
+	bool keyRepeat;
+	bool quit, stopped;
+
+	SDL_mutex *lock;
+	SDL_cond *changed;
+};
+
+#endif
@@ -0,0 +1,345 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#include <string.h>
+#include "recorder.h"
+
+static void put16(u8 *p, u16 value)
+{
+	p[0] = value & 0xff;
+	p[1] = value >> 8;
+}
+
+static void put32(u8 *p, u32 value)
+{
+	put16(p, value & 0xffff);
+	put16(p + 2, value >> 16);
+}
+
+static u16 get16(const u8 *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static u32 get32(const u8 *p)
+{
+	return get16(p) | (get16(p + 2) << 16);
+}
+
+// PackBits style run length encoding, see recorder.h
+static u32 rle_encode(u8 *dest, const u8 *src, u32 len)
+{
+	u32 out = 0, i = 0;
+
+	while (i < len)
+	{
+		u32 run = 1;
+		while (i + run < len && run < 130 && src[i + run] == src[i])
+			run++;
+
+		if (run >= 3)
+		{
+			dest[out++] = (u8)(run + 125);
+			dest[out++] = src[i];
+			i += run;
+			continue;
+		}
+
+		// Literals up to the next run worth encoding
+		u32 start = i;
+		while (i < len && i - start < 128 && !(i + 2 < len && src[i] == src[i + 1] && src[i] == src[i + 2]))
+			i++;
+		dest[out++] = (u8)(i - start - 1);
+		memcpy(dest + out, src + start, i - start);
+		out += i - start;
+	}
+	return out;
+}
+
+// Returns the decoded length, or 0 if the data overruns dest
+static u32 rle_decode(u8 *dest, u32 size, const u8 *src, u32 len)
+{
+	u32 out = 0, i = 0;
+
+	while (i < len)
+	{
+		u32 c = src[i++];
+		if (c < 128)
+		{
+			if (i + c + 1 > len || out + c + 1 > size)
+				return 0;
+			memcpy(dest + out, src + i, c + 1);
+			i += c + 1;
+			out += c + 1;
+		}
+		else
+		{
+			if (i >= len || out + c - 125 > size)
+				return 0;
+			memset(dest + out, src[i++], c - 125);
+			out += c - 125;
+		}
+	}
+	return out;
+}
+
+Recorder::Recorder() : current(0), container(false), quit(false), failed(false), videoFile(0), audioFile(0),
+	thread(0), lock(0), changed(0)
+{
+	frames[0].audioCount = frames[1].audioCount = 0;
+	frames[0].full = frames[1].full = false;
+	memset(previous, 0, sizeof(previous));
+}
+
+Recorder::~Recorder()
+{
+	close();
+}
+
+bool Recorder::open(const char *path, const u16 *map)
+{
+	memcpy(xmap, map, sizeof(xmap));
+
+	size_t len = strlen(path);
+	container = len > 4 && !strcmp(path + len - 4, ".uzr");
+
+	videoFile = fopen(path, "wb");
+	if (!videoFile)
+	{
+		fprintf(stderr, "Unable to open recording file '%s'.\n", path);
+		return false;
+	}
+
+	if (container)
+	{
+		u8 header[16];
+		memcpy(header, "UZR1", 4);
+		put16(header + 4, VIDEO_WIDTH);
+		put16(header + 6, VIDEO_LINES);
+		put16(header + 8, RECORD_FPS);
+		put16(header + 10, RECORD_AUDIO_RATE);
+		put32(header + 12, 0);
+		fwrite(header, sizeof(header), 1, videoFile);
+	}
+	else
+	{
+		char *audioPath = new char[len + 5];
+		strcpy(audioPath, path);
+		strcat(audioPath, ".pcm");
+		audioFile = fopen(audioPath, "wb");
+		if (!audioFile)
+			fprintf(stderr, "Unable to open audio recording file '%s'.\n", audioPath);
+		delete[] audioPath;
+		if (!audioFile)
+		{
+			fclose(videoFile);
+			videoFile = 0;
+			return false;
+		}
+	}
+
+	lock = SDL_CreateMutex();
+	changed = SDL_CreateCond();
+	thread = SDL_CreateThread(writer_thread, this);
+	return thread != 0;
+}
+
+void Recorder::submit_frame(const u8 *framebuffer)
+{
+	if (!thread)
+		return;
+
+	RecordFrame &frame = frames[current];
+	memcpy(frame.video, framebuffer, sizeof(frame.video));
+
+	SDL_mutexP(lock);
+	if (!failed)
+	{
+		frame.full = true;
+		SDL_CondSignal(changed);
+
+		// Only blocks when the writer is still busy with the previous frame
+		current ^= 1;
+		while (frames[current].full && !failed)
+			SDL_CondWait(changed, lock);
+	}
+	SDL_mutexV(lock);
+
+	frames[current].audioCount = 0;
+}
+
+void Recorder::close()
+{
+	if (thread)
+	{
+		SDL_mutexP(lock);
+		quit = true;
+		SDL_CondSignal(changed);
+		SDL_mutexV(lock);
+		SDL_WaitThread(thread, NULL);
+		thread = 0;
+
+		SDL_DestroyCond(changed);
+		SDL_DestroyMutex(lock);
+
+		// Audio since the last frame, only the raw stream can hold it
+		RecordFrame &tail = frames[current];
+		if (audioFile && tail.audioCount && !failed)
+			fwrite(tail.audio, tail.audioCount, 1, audioFile);
+	}
+
+	if (videoFile)
+		fclose(videoFile);
+	if (audioFile)
+		fclose(audioFile);
+	videoFile = audioFile = 0;
+}
+
+int Recorder::writer_thread(void *data)
+{
+	Recorder *rec = (Recorder*)data;
+	int next = 0;
+
+	for (;;)
+	{
+		SDL_mutexP(rec->lock);
+		while (!rec->frames[next].full && !rec->quit)
+			SDL_CondWait(rec->changed, rec->lock);
+		bool done = !rec->frames[next].full;
+		SDL_mutexV(rec->lock);
+
+		// Queued frames are always drained before quitting
+		if (done)
+			break;
+
+		bool ok = rec->write_frame(rec->frames[next]);
+
+		// On failure submit_frame() must stop waiting for the other buffer
+		SDL_mutexP(rec->lock);
+		rec->frames[next].full = false;
+		if (!ok)
+			rec->failed = true;
+		SDL_CondSignal(rec->changed);
+		SDL_mutexV(rec->lock);
+
+		if (!ok)
+		{
+			fprintf(stderr, "Recording stopped, write failed. The following frames are dropped.\n");
+			break;
+		}
+		next ^= 1;
+	}
+	return 0;
+}
+
+bool Recorder::write_frame(RecordFrame &frame)
+{
+	for (int y=0; y<VIDEO_LINES; y++)
+	{
+		const u8 *src = frame.video + y * VIDEO_LINE_CYCLES;
+		u8 *dest = image + y * VIDEO_WIDTH;
+		for (int x=0; x<VIDEO_WIDTH; x++)
+			dest[x] = src[xmap[x]];
+	}
+
+	if (!container)
+	{
+		if (fwrite(image, sizeof(image), 1, videoFile) != 1)
+			return false;
+		return !frame.audioCount || fwrite(frame.audio, frame.audioCount, 1, audioFile) == 1;
+	}
+
+	// Deltas against the previous frame are mostly zero runs
+	for (u32 i=0; i<sizeof(image); i++)
+	{
+		u8 pixel = image[i];
+		image[i] ^= previous[i];
+		previous[i] = pixel;
+	}
+
+	u8 size[4], count[2];
+	u32 len = rle_encode(packed, image, sizeof(image));
+	put32(size, len);
+	put16(count, frame.audioCount);
+
+	return fwrite(size, 4, 1, videoFile) == 1 && fwrite(packed, len, 1, videoFile) == 1 &&
+		fwrite(count, 2, 1, videoFile) == 1 &&
+		(!frame.audioCount || fwrite(frame.audio, frame.audioCount, 1, videoFile) == 1);
+}
+
+RecordReader::RecordReader() : file(0)
+{
+}
+
+RecordReader::~RecordReader()
+{
+	close();
+}
+
+bool RecordReader::open(const char *path)
+{
+	u8 header[16];
+
+	file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, "UZR1", 4) ||
+		get16(header + 4) != VIDEO_WIDTH || get16(header + 6) != VIDEO_LINES)
+	{
+		fprintf(stderr, "'%s' is not a %dx%d .uzr recording.\n", path, VIDEO_WIDTH, VIDEO_LINES);
+		close();
+		return false;
+	}
+
+	memset(previous, 0, sizeof(previous));
+	return true;
+}
+
+bool RecordReader::read_frame(u8 *image)
+{
+	u8 size[4], count[2];
+
+	if (!file || fread(size, 4, 1, file) != 1)
+		return false;
+
+	u32 len = get32(size);
+	if (len > sizeof(packed) || fread(packed, len, 1, file) != 1 ||
+		rle_decode(image, sizeof(previous), packed, len) != sizeof(previous))
+		return false;
+
+	for (u32 i=0; i<sizeof(previous); i++)
+		previous[i] = image[i] ^= previous[i];
+
+	// Skip the audio
+	if (fread(count, 2, 1, file) != 1)
+		return false;
+	return fseek(file, get16(count), SEEK_CUR) == 0;
+}
+
+void RecordReader::close()
+{
+	if (file)
+		fclose(file);
+	file = 0;
+}
@@ -0,0 +1,132 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdio.h>
+#include "avr8.h"
+
+/*
+ * Lossless video and audio capture for --record.
+ *
+ * Frames are the native palette indexes resampled to VIDEO_WIDTH x
+ * VIDEO_LINES, one byte per pixel. The kernel's 3:3:2 index layout is
+ * exactly ffmpeg's "bgr8" pixel format. Audio is the raw OCR2A sample
+ * stream, unsigned 8-bit mono at one sample per line (15734Hz).
+ *
+ * Any path not ending in .uzr gets raw streams, so it can be a named pipe:
+ * video goes to <path> and audio to <path>.pcm, e.g.
+ *
+ *   ffmpeg -f rawvideo -pix_fmt bgr8 -s 630x224 -r 60 -i game.raw
+ *          -f u8 -ar 15734 -ac 1 -i game.raw.pcm game.mkv
+ *
+ * A .uzr path gets a compact single file instead. After a 16 byte header
+ * ("UZR1", then little endian u16 width, height, frames per second and
+ * audio rate, then 4 reserved bytes) each frame is stored as:
+ *
+ *   u32 size, then the frame XORed with the previous one and run length
+ *   encoded: a control byte c < 128 is followed by c+1 literal bytes,
+ *   c >= 128 by one byte repeated c-125 times.
+ *   u16 count, then that many audio samples.
+ *
+ * Encoding and writing run on a background thread. Two frame buffers are
+ * swapped at the end of each frame, so the emulation only waits if the
+ * writer falls a whole frame behind. If a write fails the recording
+ * stops and later frames are dropped.
+ */
+
+#define RECORD_FPS			60
+#define RECORD_AUDIO_RATE	15734
+#define RECORD_AUDIO_MAX	1024	// per frame, the kernel outputs one sample per line
+
+struct RecordFrame
+{
+	u8 video[VIDEO_LINES * VIDEO_LINE_CYCLES];
+	u8 audio[RECORD_AUDIO_MAX];
+	int audioCount;
+	bool full;
+};
+
+struct Recorder
+{
+	Recorder();
+	~Recorder();
+
+	/* Opens the output(s) and starts the writer thread */
+	bool open(const char *path, const u16 *xmap);
+
+	/* Queues the finished frame along with the audio since the previous one */
+	void submit_frame(const u8 *framebuffer);
+
+	/* Writes out everything queued and stops the writer thread */
+	void close();
+
+	void audio_sample(u8 value)
+	{
+		RecordFrame &frame = frames[current];
+		if (frame.audioCount < RECORD_AUDIO_MAX)
+			frame.audio[frame.audioCount++] = value;
+	}
+
+private:
+	static int writer_thread(void *data);
+	bool write_frame(RecordFrame &frame);
+
+	RecordFrame frames[2];
+	int current;				// buffer being filled by the emulation
+	bool container, quit;
+	bool failed;				// the writer gave up, frames are dropped
+	FILE *videoFile, *audioFile;
+	u16 xmap[VIDEO_WIDTH];
+
+	// Writer thread state
+	u8 image[VIDEO_WIDTH * VIDEO_LINES];
+	u8 previous[VIDEO_WIDTH * VIDEO_LINES];
+	u8 packed[VIDEO_WIDTH * VIDEO_LINES + VIDEO_WIDTH * VIDEO_LINES / 128 + 1];
+
+	SDL_Thread *thread;
+	SDL_mutex *lock;
+	SDL_cond *changed;
+};
+
+/* Reads .uzr files back one frame at a time */
+struct RecordReader
+{
+	RecordReader();
+	~RecordReader();
+
+	bool open(const char *path);
+
+	/* Fills in the next VIDEO_WIDTH x VIDEO_LINES image, false at the end */
+	bool read_frame(u8 *image);
+
+	void close();
+
+private:
+	FILE *file;
+	u8 previous[VIDEO_WIDTH * VIDEO_LINES];
+	u8 packed[VIDEO_WIDTH * VIDEO_LINES + VIDEO_WIDTH * VIDEO_LINES / 128 + 1];
+};
+
+#endif
@@ -0,0 +1,303 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#include <string.h>
+#include "regress.h"
+
+static u32 fnv1a(const u8 *data, u32 len)
+{
+	u32 hash = 2166136261u;
+	for (u32 i=0; i<len; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+static u32 crc_table[256];
+
+static u32 crc32(u32 crc, const u8 *data, u32 len)
+{
+	if (!crc_table[1])
+	{
+		for (u32 n=0; n<256; n++)
+		{
+			u32 c = n;
+			for (int k=0; k<8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			crc_table[n] = c;
+		}
+	}
+
+	crc = ~crc;
+	for (u32 i=0; i<len; i++)
+		crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put32be(u8 *p, u32 value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void write_chunk(FILE *f, const char *type, const u8 *data, u32 len)
+{
+	u8 buf[4];
+	put32be(buf, len);
+	fwrite(buf, 4, 1, f);
+	fwrite(type, 4, 1, f);
+	if (len)
+		fwrite(data, len, 1, f);
+	put32be(buf, crc32(crc32(0, (const u8*)type, 4), data, len));
+	fwrite(buf, 4, 1, f);
+}
+
+// Minimal PNG writer: 8-bit RGB, zlib stream made of stored blocks.
+// Diff images are rare and small, so compression isn't worth a dependency.
+static bool write_png(const char *path, const u8 *rgb, int width, int height)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return false;
+
+	static const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	fwrite(signature, 8, 1, f);
+
+	u8 ihdr[13];
+	put32be(ihdr, width);
+	put32be(ihdr + 4, height);
+	ihdr[8] = 8;		// bit depth
+	ihdr[9] = 2;		// truecolor
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	write_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+
+	// Rows with a leading "no filter" byte
+	u32 rowLen = width * 3 + 1;
+	u32 rawLen = rowLen * height;
+	u8 *raw = new u8[rawLen];
+	for (int y=0; y<height; y++)
+	{
+		raw[y * rowLen] = 0;
+		memcpy(raw + y * rowLen + 1, rgb + y * width * 3, width * 3);
+	}
+
+	u32 blocks = (rawLen + 65534) / 65535;
+	u8 *zlib = new u8[2 + rawLen + blocks * 5 + 4];
+	u8 *out = zlib;
+	*out++ = 0x78;
+	*out++ = 0x01;
+	u32 a = 1, b = 0;
+	for (u32 pos=0; pos<rawLen; )
+	{
+		u32 len = rawLen - pos > 65535 ? 65535 : rawLen - pos;
+		*out++ = (pos + len == rawLen);
+		*out++ = len & 0xff;
+		*out++ = len >> 8;
+		*out++ = ~len & 0xff;
+		*out++ = (~len >> 8) & 0xff;
+		memcpy(out, raw + pos, len);
+		out += len;
+		for (u32 i=0; i<len; i++)
+		{
+			a = (a + raw[pos + i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		pos += len;
+	}
+	put32be(out, (b << 16) | a);
+	out += 4;
+
+	write_chunk(f, "IDAT", zlib, out - zlib);
+	write_chunk(f, "IEND", NULL, 0);
+
+	delete[] zlib;
+	delete[] raw;
+	return fclose(f) == 0;
+}
+
+Regression::Regression() : update(false), failed(false), limit(0), last(0), count(0), next(0), recorder(0)
+{
+}
+
+bool Regression::open(const char *goldenPath, bool updating, int frameLimit, const u16 *map)
+{
+	update = updating;
+	limit = frameLimit ? frameLimit : REGRESS_FRAMES;
+	memcpy(xmap, map, sizeof(xmap));
+
+	// The images live next to the hashes, in a .uzr of the same name
+	snprintf(path, sizeof(path), "%s", goldenPath);
+	snprintf(imagePath, sizeof(imagePath), "%s", goldenPath);
+	char *ext = strrchr(imagePath, '.');
+	if (!ext || strchr(ext, '/') || strchr(ext, '\\'))
+		ext = imagePath + strlen(imagePath);
+	if (ext + 5 > imagePath + sizeof(imagePath))
+		return false;
+	strcpy(ext, ".uzr");
+
+	if (update)
+	{
+		recorder = new Recorder();
+		return recorder->open(imagePath, xmap);
+	}
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Unable to open golden file '%s'.\n", path);
+		return false;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), f) && count < REGRESS_MAX_CHECKS)
+	{
+		int n;
+		unsigned int hash;
+		if (line[0] != '#' && sscanf(line, "%d %x", &n, &hash) == 2)
+		{
+			frames[count] = n;
+			hashes[count++] = hash;
+		}
+	}
+	fclose(f);
+
+	if (!count)
+	{
+		fprintf(stderr, "No frames listed in golden file '%s'.\n", path);
+		return false;
+	}
+	return reader.open(imagePath);
+}
+
+bool Regression::frame(int n, const u8 *framebuffer)
+{
+	last = n;
+
+	if (update)
+	{
+		if (n % REGRESS_INTERVAL == 0 && count < REGRESS_MAX_CHECKS)
+		{
+			recorder->submit_frame(framebuffer);
+			frames[count] = n;
+			hashes[count++] = fnv1a(resample(framebuffer), sizeof(image));
+		}
+		return n >= limit;
+	}
+
+	if (n != frames[next])
+		return false;
+
+	u32 hash = fnv1a(resample(framebuffer), sizeof(image));
+	bool haveGolden = reader.read_frame(golden);
+	if (hash != hashes[next])
+	{
+		printf("%s: frame %d hash %08x, expected %08x\n", path, n, hash, hashes[next]);
+		if (haveGolden)
+			write_diff(n);
+		failed = true;
+		return true;
+	}
+	return ++next >= count;
+}
+
+const u8 *Regression::resample(const u8 *framebuffer)
+{
+	for (int y=0; y<VIDEO_LINES; y++)
+	{
+		const u8 *src = framebuffer + y * VIDEO_LINE_CYCLES;
+		u8 *dest = image + y * VIDEO_WIDTH;
+		for (int x=0; x<VIDEO_WIDTH; x++)
+			dest[x] = src[xmap[x]];
+	}
+	return image;
+}
+
+void Regression::write_diff(int n)
+{
+	// Golden, actual and changed pixels side by side
+	const int width = VIDEO_WIDTH * 3;
+	u8 *rgb = new u8[width * VIDEO_LINES * 3];
+
+	for (int y=0; y<VIDEO_LINES; y++)
+	{
+		for (int x=0; x<VIDEO_WIDTH; x++)
+		{
+			u8 expected = golden[y * VIDEO_WIDTH + x], actual = image[y * VIDEO_WIDTH + x];
+			u8 *p = rgb + (y * width + x) * 3;
+			u8 index[3] = { expected, actual, 0 };
+			for (int panel=0; panel<3; panel++, p += VIDEO_WIDTH * 3)
+			{
+				if (panel == 2)
+				{
+					p[0] = p[1] = p[2] = expected != actual ? 255 : 0;
+					continue;
+				}
+				// Same 3:3:2 expansion as the emulator palette
+				p[0] = (((index[panel] >> 0) & 7) * 255) / 7;
+				p[1] = (((index[panel] >> 3) & 7) * 255) / 7;
+				p[2] = (((index[panel] >> 6) & 3) * 255) / 3;
+			}
+		}
+	}
+
+	char diffPath[1100];
+	snprintf(diffPath, sizeof(diffPath), "%.*s-%d.png", (int)(strrchr(imagePath, '.') - imagePath), imagePath, n);
+	if (write_png(diffPath, rgb, width, VIDEO_LINES))
+		printf("%s: wrote %s\n", path, diffPath);
+	else
+		fprintf(stderr, "Unable to write '%s'.\n", diffPath);
+	delete[] rgb;
+}
+
+int Regression::close()
+{
+	if (update)
+	{
+		if (recorder)
+			recorder->close();
+
+		FILE *f = fopen(path, "w");
+		if (!f)
+		{
+			fprintf(stderr, "Unable to write golden file '%s'.\n", path);
+			return 1;
+		}
+		fprintf(f, "# frame fnv1a, see tools/uzem/regress.h\n");
+		for (int i=0; i<count; i++)
+			fprintf(f, "%d %08x\n", frames[i], hashes[i]);
+		fclose(f);
+		printf("%s: wrote %d golden frames\n", path, count);
+		return 0;
+	}
+
+	reader.close();
+	if (!failed && next < count)
+	{
+		printf("%s: stopped at frame %d before reaching frame %d\n", path, last, frames[next]);
+		failed = true;
+	}
+	if (!failed)
+		printf("%s: ok, %d frames match\n", path, count);
+	return failed ? 1 : 0;
+}
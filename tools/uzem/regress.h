@@ -0,0 +1,77 @@
+/*
+(The MIT License)
+
+Copyright (c) 2008-2015, David Etherton, Eric Anderton, Alec Bourque et al
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#ifndef REGRESS_H
+#define REGRESS_H
+
+#include <stdio.h>
+#include "avr8.h"
+#include "recorder.h"
+
+/*
+ * Golden frame checks for --golden.
+ *
+ * A golden is a text file of "<frame> <hash>" lines, the hash being FNV-1a
+ * over the VIDEO_WIDTH x VIDEO_LINES index image (what --record writes),
+ * plus a .uzr next to it holding those same frames. Comparing stops at
+ * the last listed frame; on the first mismatch a PNG with the golden,
+ * the actual frame and the changed pixels side by side is written next
+ * to the golden as <name>-<frame>.png.
+ *
+ * Updating records every REGRESS_INTERVAL frames up to the frame limit.
+ */
+
+#define REGRESS_INTERVAL	60
+#define REGRESS_FRAMES		600		// default length when updating
+#define REGRESS_MAX_CHECKS	1024
+
+struct Regression
+{
+	Regression();
+
+	/* Loads the golden hashes, or starts new ones when updating */
+	bool open(const char *path, bool update, int frames, const u16 *xmap);
+
+	/* Checks frame n, returns true once the run is complete */
+	bool frame(int n, const u8 *framebuffer);
+
+	/* Finishes writing, returns the process exit code */
+	int close();
+
+private:
+	const u8 *resample(const u8 *framebuffer);
+	void write_diff(int n);
+
+	bool update, failed;
+	int limit, last;
+	int frames[REGRESS_MAX_CHECKS];
+	u32 hashes[REGRESS_MAX_CHECKS];
+	int count, next;
+	char path[1024], imagePath[1024];
+	u16 xmap[VIDEO_WIDTH];
+	u8 image[VIDEO_WIDTH * VIDEO_LINES], golden[VIDEO_WIDTH * VIDEO_LINES];
+	Recorder *recorder;				// writes the golden images when updating
+	RecordReader reader;			// reads them back when comparing
+};
+
+#endif
@@ -23,9 +23,15 @@ THE SOFTWARE.
 */
 #include "uzem.h"
 #include "avr8.h"
+#include "ntsc.h"
+#include "recorder.h"
+#include "regress.h"
+#include "presenter.h"
 #include "gdbserver.h"
 #include "uzerom.h"
+#include "hexloader.h"
 #include <getopt.h>
+#include <ctype.h>
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
@@ -39,6 +45,17 @@ static const struct option longopts[] ={
     { "hwsurface"  , no_argument      , NULL, 'w' },
     { "nodoublebuf", no_argument      , NULL, 'x' },
     { "interlaced" , no_argument      , NULL, 'i' },
+    { "ntsc"       , optional_argument, NULL, 'N' },
+    { "record"     , required_argument, NULL, 'R' },
+    { "headless"   , no_argument      , NULL, 'H' },
+    { "noidle"     , no_argument      , NULL, 'I' },
+    { "runahead"   , required_argument, NULL, 'A' },
+    { "nothread"   , no_argument      , NULL, 'T' },
+    { "ram"        , no_argument      , NULL, 'M' },
+    { "symbols"    , required_argument, NULL, 'P' },
+    { "frames"     , required_argument, NULL, 'F' },
+    { "golden"     , required_argument, NULL, 'G' },
+    { "update-golden", no_argument    , NULL, 'U' },
     { "mouse"      , no_argument      , NULL, 'm' },
     { "2p"         , no_argument      , NULL, '2' },
     { "img"        , required_argument, NULL, 'g' },
@@ -57,7 +74,7 @@ static const struct option longopts[] ={
     {NULL          , 0                , NULL, 0}
 };
 
-   static const char* shortopts = "hnfclwxim2re:p:bdt:k:s:v";
+   static const char* shortopts = "hnfclwxiN::R:HIA:TMP:F:G:Um2re:p:bdt:k:s:v";
 
 #define printerr(fmt,...) fprintf(stderr,fmt,##__VA_ARGS__)
 
@@ -75,6 +92,21 @@ void showHelp(char* programName){
     printerr("\t--fullscreen -f     Enable full screen\n");
     printerr("\t--hwsurface -w      Use SDL hardware surface (probably slower)\n");
     printerr("\t--nodoublebuf -x    No double buffering\n");
+    printerr("\t--interlaced -i     Only refresh alternate lines each frame, like an interlaced display\n");
+    printerr("\t--ntsc[=opts] -N    Simulate a composite NTSC signal (color bleed, scanlines), opts being\n");
+    printerr("\t                    sharp=0|1,bleed=1..4,sat=0..200,scanlines=0..100,crawl=0|1\n");
+    printerr("\t--record -R <path>  Record raw video to <path> and audio to <path>.pcm (can be pipes),\n");
+    printerr("\t                    or both to a compact RLE file if <path> ends in .uzr\n");
+    printerr("\t--headless -H       No window or sound and no frame rate limit, Ctrl-C to stop\n");
+    printerr("\t--noidle -I         Run busy-wait loops instead of skipping to the next interrupt\n");
+    printerr("\t--runahead -A <n>   Show the frame n frames ahead of the game, for less input lag\n");
+    printerr("\t--nothread -T       Draw the screen from the emulation thread instead of its own\n");
+    printerr("\t--ram -M            Watch stack depth and free RAM, report stack/data collisions and\n");
+    printerr("\t                    writes past the end of SRAM (they stop the program under gdb)\n");
+    printerr("\t--symbols -P <file> .elf or .map of the game for --ram (default: next to GAMEFILE)\n");
+    printerr("\t--frames -F <n>     Quit after n frames\n");
+    printerr("\t--golden -G <file>  Compare frames against golden hashes, exit code 1 on mismatch\n");
+    printerr("\t--update-golden -U  Write the --golden file instead, one frame per second up to --frames\n");
     printerr("\t--mouse -m          Start with emulated mouse enabled\n");
     printerr("\t--2p -2             Start with snes 2p mode enabled\n");
     printerr("\t--sd -s <path>      SD card emulation from contents of path\n");
@@ -86,17 +118,7 @@ void showHelp(char* programName){
     printerr("\t--loadcap -l        Load and replays controllers data from file.\n");
 }
 
-char *strlwr(char *str)
-{
-  size_t i;
-  size_t len = strlen(str);
-
-  for(i=0; i<len; i++)
-    str[i]=tolower((unsigned char)str[i]);
-
-  return str;
-}
-
+// case insensitive, so the path itself can keep its case
 int ends_with(const char* name, const char* extension, size_t length)
 {
  const char* ldot = strrchr(name, '.');
@@ -104,7 +126,10 @@ int ends_with(const char* name, const char* extension, size_t length)
  {
    if (length == 0)
 	 length = strlen(extension);
-   return strncmp(ldot + 1, extension, length) == 0;
+   for (size_t i = 0; i < length; i++)
+     if (tolower((unsigned char)ldot[1 + i]) != extension[i])
+       return 0;
+   return 1;
  }
  return 0;
 }
@@ -112,6 +137,8 @@ int ends_with(const char* name, const char* extension, size_t length)
 // header for use with UzeRom files
 RomHeader uzeRomHeader;
 
+static int emulate(void *data);
+
 int main(int argc,char **argv)
 {
 	avr8 uzebox;
@@ -134,6 +161,13 @@ int main(int argc,char **argv)
 
     int opt;
     char* heximage = NULL;
+    char* recordPath = NULL;
+    char* goldenPath = NULL;
+    bool updateGolden = false;
+    bool presenterThread = true;
+    bool ramMonitor = false;
+    char* symbolsPath = NULL;
+    bool eepromGiven = false;
    // char* eepromFile = NULL;
     int bootsize = 0;
 
@@ -165,6 +199,43 @@ int main(int argc,char **argv)
         case 'i':
 			uzebox.interlaced = true;
             break;
+        case 'N':
+			uzebox.ntsc = new NtscFilter();
+			if(optarg && !uzebox.ntsc->configure(optarg))
+				return 1;
+            break;
+        case 'R':
+            recordPath = optarg;
+            break;
+        case 'H':
+			uzebox.headless = true;
+			uzebox.enableSound = false;
+            break;
+        case 'I':
+			uzebox.idleSkip = false;
+            break;
+        case 'A':
+			uzebox.runAhead = atoi(optarg);
+            break;
+        case 'T':
+            presenterThread = false;
+            break;
+        case 'M':
+            ramMonitor = true;
+            break;
+        case 'P':
+            symbolsPath = optarg;
+            ramMonitor = true;
+            break;
+        case 'F':
+			uzebox.frameLimit = atoi(optarg);
+            break;
+        case 'G':
+            goldenPath = optarg;
+            break;
+        case 'U':
+            updateGolden = true;
+            break;
         case 'm':
 			uzebox.pad_mode = avr8::SNES_MOUSE;
             break;
@@ -180,6 +251,7 @@ int main(int argc,char **argv)
         case 'e':
             //eepromFile = optarg;
             uzebox.eepromFile=optarg;
+            eepromGiven = true;
             break;
         case 'b':
             uzebox.pc = 0x7800;//0xF000; //set start for boot image
@@ -221,11 +293,10 @@ int main(int argc,char **argv)
         return 1;
     }
 
-    // start EEPROM emulation if appropriate
-    if(uzebox.eepromFile){
-        uzebox.LoadEEPROMFile(uzebox.eepromFile);
-    }
-    
+    // golden runs must not depend on whatever eeprom.bin is lying around
+    if (goldenPath && !eepromGiven)
+        uzebox.eepromFile = NULL;
+
     // attempt to load the hex image
     if(!heximage){
         printerr("Error: No HEX program or boot file specified.\n\n");
@@ -238,7 +309,6 @@ int main(int argc,char **argv)
 
     	unsigned char* buffer = (unsigned char*)(uzebox.progmem);
 
-    	strlwr(heximage);
     	if(ends_with(heximage,"uze", 3)){
 
 
@@ -249,6 +319,11 @@ int main(int argc,char **argv)
                     showHelp(argv[0]);
                     return 1;
                 }
+                printf("%s\n",uzeRomHeader.name);
+                printf("%s\n",uzeRomHeader.author);
+                printf("%d\n",uzeRomHeader.year);
+                printf(uzeRomHeader.target == 1? "Uzebox 1.0 - ATmega1284\n\n" : "Uzebox 1.0 - ATmega644\n\n");
+                uzebox.set_mcu(uzeRomHeader.target);
                 // enable mouse support if required
                 if(uzeRomHeader.mouse){
                     uzebox.pad_mode = avr8::SNES_MOUSE;
@@ -262,13 +337,48 @@ int main(int argc,char **argv)
 
     	}else{
             printf("Loading Hex Image...\n");
-            if(!loadHex(heximage,buffer)){
+            HexInfo hexInfo;
+            if(!loadHexFile(heximage,buffer,sizeof(uzebox.progmem),&hexInfo)){
                 printerr("Error: cannot load HEX image '%s'.\n\n",heximage);
                 showHelp(argv[0]);
                 return 1;
             }
+            printf("Flash used: ");
+            printHexRanges(stdout,&hexInfo);
+            printf("\n");
+            // only the 1284 has flash past 64K
+            if(hexInfo.end > 65536){
+                uzebox.set_mcu(MCU_1284);
+                printf("Uzebox 1.0 - ATmega1284\n");
+            }
+        }
+
+        // start EEPROM emulation if appropriate, sized for the target
+        if(uzebox.eepromFile){
+            uzebox.LoadEEPROMFile(uzebox.eepromFile);
         }
 
+        // --ram: without symbols only what gets written counts as data
+        if(ramMonitor){
+            bool found = false;
+            if(symbolsPath){
+                found = uzebox.load_symbols(symbolsPath);
+                if(!found)
+                    printerr("Warning: no data end symbols in '%s'.\n",symbolsPath);
+            }else{
+                const char* extensions[] = { ".elf", ".map" };
+                char path[1024];
+                const char *dot = strrchr(heximage, '.');
+                int length = dot? dot - heximage : strlen(heximage);
+                for(int i = 0; i < 2 && !found && length + 5 < (int)sizeof(path); i++){
+                    sprintf(path, "%.*s%s", length, heximage, extensions[i]);
+                    found = uzebox.load_symbols(path);
+                }
+            }
+            if(found)
+                printf("Static data ends at 0x%04X\n", uzebox.dataEnd - 1);
+            uzebox.start_ram_monitor();
+        }
 
 
     	//get rom name without extension to build
@@ -362,6 +472,10 @@ int main(int argc,char **argv)
 		}
 	}
 
+	// gdb has to stop in the frames that count
+	if (uzebox.enableGdb || uzebox.runAhead < 0)
+		uzebox.runAhead = 0;
+
 	// init the GUI
 	if (!uzebox.init_gui()){
         printerr("Error: Failed to init GUI.\n\n");
@@ -369,6 +483,18 @@ int main(int argc,char **argv)
 		return 1;
     	}
 
+	if (recordPath) {
+		uzebox.recorder = new Recorder();
+		if (!uzebox.recorder->open(recordPath, uzebox.scanline_xmap))
+			return 1;
+	}
+
+	if (goldenPath) {
+		uzebox.regress = new Regression();
+		if (!uzebox.regress->open(goldenPath, updateGolden, uzebox.frameLimit, uzebox.scanline_xmap))
+			return 1;
+	}
+
    	if (uzebox.enableGdb == true) {
 #if defined(USE_GDBSERVER_DEBUG)
             uzebox.gdb = new GdbServer(&uzebox, uzebox.gdbPort, true, true);
@@ -379,7 +505,35 @@ int main(int argc,char **argv)
         else
             uzebox.state = CPU_RUNNING;
 
-   	srand(time(NULL));	//used for the watchdog timer entropy
+   	srand(goldenPath ? 0 : time(NULL));	//used for the watchdog timer entropy, fixed for golden runs
+
+	// The window stays on this thread, see presenter.h. gdb and its idle()
+	// loop want the emulation here too.
+	if (presenterThread && !uzebox.headless && !uzebox.enableGdb)
+	{
+		uzebox.presenter = new Presenter(&uzebox);
+		SDL_Thread *thread = SDL_CreateThread(emulate, &uzebox);
+		if (thread)
+		{
+			// Returns once shutdown() stopped it, the emulation thread follows
+			uzebox.presenter->run();
+			int status = 0;
+			SDL_WaitThread(thread, &status);
+			delete uzebox.presenter;
+			uzebox.presenter = 0;
+			return status;
+		}
+		delete uzebox.presenter;
+		uzebox.presenter = 0;
+	}
+
+	return emulate(&uzebox);
+}
+
+// Runs the CPU until shutdown(), which exits unless there is a presenter thread
+static int emulate(void *data)
+{
+	avr8 &uzebox = *(avr8*)data;
 	const int cycles=100000000;
 	int left, now;
 	char caption[128];
@@ -389,6 +543,8 @@ int main(int argc,char **argv)
 	{
 		if (uzebox.fullscreen){
 			puts(caption);
+        }else if (uzebox.presenter){
+			uzebox.presenter->set_caption(caption);
         }else{
 			SDL_WM_SetCaption(caption, NULL);
         }
@@ -396,11 +552,21 @@ int main(int argc,char **argv)
 		left = cycles;
 		now = SDL_GetTicks();
 		while (left > 0)
-			left -= uzebox.exec();
+		{
+			u32 spent = uzebox.exec();
+			if (!spent && uzebox.presenter && uzebox.state == CPU_STOPPED)
+				return uzebox.exitCode;
+			left -= spent;
+		}
 		
 		now = SDL_GetTicks() - now;
+		if (now == 0)
+			now = 1;			// skipped busy-waits can be quicker than a tick
 
 		sprintf(caption,"Uzebox Emulator " VERSION " (ESC=quit, F1=help)  %02d.%03d Mhz",cycles/now/1000,(cycles/now)%1000);
+		if (uzebox.ramMonitor)
+			sprintf(caption + strlen(caption),"  RAM free %d (least %d)",
+				uzebox.ram_free(uzebox.spFrameLow),uzebox.ram_free(uzebox.spLowest));
 	}
 
 	return 0;
@@ -55,42 +55,144 @@ bool isUzeromFile(char* in_filename){
     return false;
 }
 
-bool loadUzeImage(char* in_filename,RomHeader *header,u8 *buffer){
+// flash size of each AVR target, in bytes
+static const uint32_t targetProgSize[] = { 65536, 131072 };
+
+#define PACK_BLOCK_HEADER 8
+#define PACK_MIN_MATCH 4
+
+static uint32_t crc32(const u8 *data,size_t size){
+    uint32_t crc = 0xFFFFFFFF;
+    while(size--){
+        crc ^= *data++;
+        for(int i=0; i<8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return crc ^ 0xFFFFFFFF;
+}
 
-    FILE* f = fopen(in_filename,"rb");
-    size_t ret;
-    if(f){
-        ret = fread(header,1,512,f);
-	if(ret != 512) {
-            printf("Error: failed to read the file %s.\n", in_filename);
+// Unpacks the blocks of a version 2 image, returns false if any is damaged
+static bool unpackBlocks(const u8 *data,size_t size,u8 *buffer,uint32_t progSize){
+    uint32_t out = 0;
+    while(out < progSize){
+        if(size < PACK_BLOCK_HEADER){
+            printf("Error: UzeROM image is truncated.\n");
             return false;
-	}
-               
-        if(header->version != HEADER_VERSION){
-            printf("Error: cannot parse version %d UzeROM files.\n",header->version);
         }
-        printf("%s\n",header->name);
-        printf("%s\n",header->author);
-        printf("%d\n",header->year);
-        
-        if(header->target == 0){
-            printf("Uzebox 1.0 - ATmega644\n");
+        uint32_t blockSize = data[0] | (data[1] << 8);
+        uint32_t packed = data[2] | (data[3] << 8);
+        uint32_t crc = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+        data += PACK_BLOCK_HEADER;
+        size -= PACK_BLOCK_HEADER;
+        if(blockSize == 0 || blockSize > progSize - out || packed > blockSize || packed > size){
+            printf("Error: bad block header at offset 0x%x.\n",(unsigned)out);
+            return false;
+        }
+
+        uint32_t start = out, end = out + blockSize;
+        if(packed == blockSize){
+            memcpy(buffer + out,data,blockSize);
+            out = end;
+        }else{
+            const u8 *in = data, *inEnd = data + packed;
+            while(out < end && in < inEnd){
+                u8 token = *in++;
+                if(token < 0x80){
+                    uint32_t len = token + 1;
+                    if(len > (uint32_t)(inEnd - in) || len > end - out)
+                        break;
+                    memcpy(buffer + out,in,len);
+                    in += len;
+                    out += len;
+                }else{
+                    if(inEnd - in < 2)
+                        break;
+                    uint32_t distance = in[0] | (in[1] << 8);
+                    uint32_t len = token - 0x80 + PACK_MIN_MATCH;
+                    in += 2;
+                    if(distance == 0 || distance > out || len > end - out)
+                        break;
+                    for(; len; len--, out++)
+                        buffer[out] = buffer[out - distance];
+                }
+            }
+            if(out != end || in != inEnd){
+                printf("Error: bad block data at offset 0x%x.\n",(unsigned)start);
+                return false;
+            }
         }
-        else if(header->target == 1){
-            printf("Uzebox 2.0 - XTmega128\n");
-            printf("Error: Uzebox 2.0 ROM images are not supported.\n");
+        if(crc32(buffer + start,blockSize) != crc){
+            printf("Error: CRC mismatch in block at offset 0x%x.\n",(unsigned)start);
             return false;
         }
-        printf("\n");
-        
-        if (fread(buffer,1,header->progSize,f) != header->progSize) {
-            printf("Erro: failed to read the file %s.\n", in_filename);
+        data += packed;
+        size -= packed;
+    }
+    return true;
+}
+
+bool loadUzeBuffer(const u8 *data,size_t size,RomHeader *header,u8 *buffer){
+
+    if(size < HEADER_SIZE){
+        printf("Error: UzeROM image is too short.\n");
+        return false;
+    }
+    memcpy(header,data,HEADER_SIZE);
+
+    for(int i=0; i<MAGIC_SIZE; i++){
+        if(header->marker[i] != magic[i]){
+            printf("Error: not an UzeROM image.\n");
             return false;
-	}
-        fclose(f);
-        return true;
-    }    
-    return false;
+        }
+    }
+
+    if(header->version != HEADER_VERSION && header->version != HEADER_VERSION_PACKED){
+        printf("Error: cannot parse version %d UzeROM files.\n",header->version);
+    }
+
+    if(header->target != 0 && header->target != 1){
+        printf("Error: unknown AVR target %d.\n",header->target);
+        return false;
+    }
+
+    if(header->progSize > targetProgSize[header->target]){
+        printf("Error: program size %u is too large for the target.\n",(unsigned)header->progSize);
+        return false;
+    }
+
+    if(header->version == HEADER_VERSION_PACKED){
+        return unpackBlocks(data + HEADER_SIZE,size - HEADER_SIZE,buffer,header->progSize);
+    }
+
+    if(size - HEADER_SIZE < header->progSize){
+        printf("Error: UzeROM image is truncated.\n");
+        return false;
+    }
+    memcpy(buffer,data + HEADER_SIZE,header->progSize);
+    return true;
+}
+
+bool loadUzeImage(char* in_filename,RomHeader *header,u8 *buffer){
+
+    FILE* f = fopen(in_filename,"rb");
+    if(!f){
+        return false;
+    }
+
+    fseek(f,0,SEEK_END);
+    long size = ftell(f);
+    fseek(f,0,SEEK_SET);
+
+    u8 *data = size > 0? (u8*)malloc(size) : NULL;
+    bool result = data && fread(data,1,size,f) == (size_t)size;
+    fclose(f);
+    if(!result){
+        printf("Error: failed to read the file %s.\n", in_filename);
+    }else{
+        result = loadUzeBuffer(data,size,header,buffer);
+    }
+    free(data);
+    return result;
 }
 
 //copy strings without end of lines special characters
@@ -106,87 +208,3 @@ static void strcpy2(char* dest, char* src, int maxsize)
 		i++;
 	}
 }
-
-static inline int parse_hex_nibble(char s)
-{
-	if (s >= '0' && s <= '9')
-		return s - '0';
-	else if (s >= 'A' && s <= 'F')
-		return s - 'A' + 10;
-	else if (s >= 'a' && s <= 'a')
-		return s - 'a' + 10;
-	else
-		return -1;
-}
-
-static int parse_hex_byte(const char *s)
-{
-	return (parse_hex_nibble(s[0])<<4) | parse_hex_nibble(s[1]);
-}
-
-static int parse_hex_word(const char *s)
-{
-	return (parse_hex_nibble(s[0])<<12) | (parse_hex_nibble(s[1]) << 8) |
-		(parse_hex_nibble(s[2])<<4) | parse_hex_nibble(s[3]);
-}
-
-bool loadHex(const char *in_filename,unsigned char *buffer,unsigned int *bytesRead)
-{
-	
-	//http://en.wikipedia.org/wiki/.hex
-
-	//(I've added the spaces for clarity, they don't exist in the real files)
-	//:10 65B0 00 661F771F881F991F1A9469F760957095 59
-	//:10 65C0 00 809590959B01AC01BD01CF010895F894 91
-	//:02 65D0 00 FFCF FB
-	//:02 65D2 00 0100 C6
-	//:00 0000 01 FF [EOF marker]
-
-	//First field is the byte count. Second field is the 16-bit address. Third field is the record type; 
-	//00 is data, 01 is EOF.	For record type zero, next "wide" field is the actual data, followed by a 
-	//checksum.
-	u16 progmemLast=0;
-	char line[128];
-	int lineNumber = 1;
-
-	FILE *in_file = fopen(in_filename,"rb");
-	if (!in_file) return false;
-
-	while (fgets(line, sizeof(line), in_file) && line[0]==':')
-	{
-		int bytes = parse_hex_byte(line+1);
-		int addr = parse_hex_word(line+3);
-		int recordType = parse_hex_byte(line+7);
-		if (recordType == 0)
-		{
-			char *lp = line + 9;
-			while (bytes > 0)
-			{
-                unsigned char value = parse_hex_byte(lp);
-				buffer[addr] = value;
-				addr ++;
-				if (addr > progmemLast){
-					progmemLast = addr;
-				}
-				lp += 2;
-				bytes -= 1;
-			}
-		}
-		else if (recordType == 1)
-		{
-			break;
-		}
-		else
-			fprintf(stderr,"ignoring unknown record type %d in line %d of %s\n",recordType,lineNumber,in_filename);
-
-		++lineNumber;
-	}
-/*
-    if(bytesRead != 0){
-        *bytesRead=progmemLast;
-    }
-    */
-	fclose(in_file);
-
-	return true;
-}
@@ -24,10 +24,12 @@
 */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef UZEROM_H
 
 #define HEADER_VERSION 1
+#define HEADER_VERSION_PACKED 2 //program stored as LZ blocks, see packrom.cpp
 #define VERSION_MAJOR 1
 #define VERSION_MINOR 0
 #define MAX_PROG_SIZE 61440 //65536-4096
@@ -39,6 +41,7 @@
     #define ALIGN1
 #endif
 
+#pragma pack(push,1)
 struct RomHeader{
     //Header fields (512 bytes)
     uint8_t marker[6]; //'UZEBOX'
@@ -51,8 +54,11 @@ struct RomHeader{
     uint8_t icon[16*16];
     uint32_t crc32;
     uint8_t mouse;
-    uint8_t reserved[178];
+    uint8_t description[64];
+    uint32_t packedSize; //bytes of block data following the header (version 2)
+    uint8_t reserved[105];
 } ALIGN1;
+#pragma pack(pop)
 
 /*
     isUzeromFile - returns true if the file is indeed an .uze file
@@ -61,12 +67,14 @@ bool isUzeromFile(char* in_filename);
 
 /*
     readUzeImage - reads an .uze file into the header and buffer structures provided.
+    Version 2 files are unpacked, checking the CRC of every block. Only errors are
+    printed, showing the header is up to the caller.
 */
 bool loadUzeImage(char* in_filename,RomHeader *header,unsigned char *buffer);
 
 /*
-    load_hex - loads a hex image into the buffer provided, and provides the number of bytes read.
+    loadUzeBuffer - same as loadUzeImage for an .uze file held in memory.
 */
-bool loadHex(const char *in_filename,unsigned char *buffer,unsigned int *bytesRead = 0);
+bool loadUzeBuffer(const unsigned char *data,size_t size,RomHeader *header,unsigned char *buffer);
 
 #endif